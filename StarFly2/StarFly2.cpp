@@ -11,8 +11,8 @@ Apparently big stars are drawn as circles of fixed color, apparently small - as
 Stars varies in size, distribution is somewhat like in real space (configurable).
 Star colors could be random RGB or more real black-body spectrum (distribution is just uniform).
 
-Render via GDI but pretty fast. 16-bit integer z-buffer used.
-No anti-aliasing of circles or several stars 'combining light' in one pixel.
+Render via GDI (or Direct3D 11 swap chain) but pretty fast. 16-bit integer z-buffer used.
+No anti-aliasing of circles or several stars 'combining light' in one pixel, unless Additive = 1.
 Initial generation makes even 3D star distribution in viewing cone (limited by FarPlane).
 If star moves out of sight, another is generated in the distance and fades-in from blackness.
 
@@ -21,13 +21,15 @@ star scale and scheme, colorization and scheme, color fading coefficient, fade-i
 
 Settings are loaded from ini-file located and named as .scr/.exe (StarFly2.ini by default)
 This ini-file should contain strings in the form "Name = value".
+File is watched while running: changed Speed, FadePower, FadeInTime, TargetFrameMs, Zoom, CenterX, CenterY and Stars are applied at once
+(Zoom, center and Stars only for Renderer = 0, stars are kept in place), other settings - on next start.
 
 Supported settings (default values are in supplied StarFly2.ini):
 Stars            - Number of stars seen simultaneously.
 Speed            - Fly speed. 1.0 means 5s for flying distance to FarPlane; 0.005 - 1000s.
-TimerRate        - Interval between frames in ms. 40 means render with ~25 fps.
-CenterX, CenterY - 'Destination point' location. (0.5, 0.5) is a center of desktop.
-                   If you have two similar monitors placed horizontally then (0.75, 0.5) would be center of right one.
+TimerRate        - Interval between frames in ms. 40 means render with ~25 fps. 0 - uncapped, next frame right after previous (Backend = 1 still waits for vsync).
+                   Frames are rendered by own thread on high-resolution waitable timer, if frame takes too long - missed frames are skipped.
+CenterX, CenterY - 'Destination point' location. (0.5, 0.5) is a center of monitor (or of desktop with Monitors = 0).
                    Negative values and >1.0 are possible, but not fully supported.
 Zoom             - 1.0 - ~90' view angle, >>1.0 - telescope, <<1.0 - fish-eye. Does not affect star sizes, only their motion and fading with distance.
 StarSize         - Base for star size. Value = distance at which star have radius 1 pixel.
@@ -38,8 +40,66 @@ DarkestRGB       - Darkest value for RGB components of random star color. 0 - bl
 ColorType        - Type of color generation for stars
                    0 - random in range [DarkestRGB, 255], could produce green, purple, cyan and so on - colors are not possible in real space. DarkestRGB recommended is 64;
                    1 - random black-body radiation color (value DarkestRGB allows to decrease color saturation).
+                   Colors are picked from palette of 256 entries, built at start.
 FadePower        - How fast star brightness fades with distance. 1.0 - linearly, 0.0 - does not fade.
 FadeInTime       - How fast newly generated star appears, ms. Does not affect program start.
+Simd             - 0 - scalar projection (reference code), 1 - SSE2 projection of 4 stars at once (8 stars with AVX2 if compiled with /arch:AVX2).
+Threads          - Number of threads for update and render, 0 - one per logical processor, 1 - single-threaded.
+SpriteCache      - 1 - circles with radius below 16 pixels are drawn from precomputed spans (1/8 pixel precision), 0 - exact calculation for all circles.
+Additive         - 1 - stars add their light in pixels (16 bits per channel), edges of circles are anti-aliased, bright overlaps are tone mapped
+                   (linear up to level 204, then compressed towards 255), z-buffer is not used. 0 - nearest star hides others. Only for Renderer = 0.
+DepthOrder       - 0 - z-buffer hides farther stars, 1 - stars are drawn back-to-front by buckets of depth (16 units), without z-buffer.
+                   Saves memory and clear of z-buffer, order of stars within one bucket is arbitrary.
+Streaks          - 1 - star leaves fading trail (1 pixel wide) from its position on previous frame, smooth motion of fast fly at low TimerRate;
+                   trail is anti-aliased with Additive = 1. 0 - off. Only for Renderer = 0.
+FlyYaw, FlyPitch - Direction of flight relative to view, degrees. (0, 0) - forward, FlyYaw = 180 - backward, 90 - side-view (fly to the right).
+RotateYaw, RotatePitch, RotateRoll - Rotation of view, degrees per second, positive - to the right, up and clockwise.
+                   If flight is not straight forward or view rotates, stars are moved by matrix and respawned on sides of view, which motion exposes.
+                   DepthOrder is not used then, Renderer = 1 falls back to CPU.
+Clusters         - Number of star clusters (globular ones and spiral galaxies) in addition to Stars, 0 - off.
+                   Far cluster is drawn as one glow, its stars are generated, moved and drawn only when it comes near;
+                   cluster out of view is respawned as a whole. DepthOrder is not used then, Renderer = 1 falls back to CPU.
+ClusterStars     - Stars in each cluster (rounded up to multiple of 8).
+ClusterSize      - Average radius of cluster (FarPlane is 5000), actual one is [0.5, 1.5) of it.
+Background       - Share of FarPlane, stars farther than it are baked into background image, e.g. 0.5 - 7/8 of Stars are in background; 0 - off.
+                   Frame is restored from background instead of clear, its stars are moved and drawn again only when they could shift by 1 pixel
+                   (in corners of screen), so it pays off for slow fly (Speed about 0.01 and below). Not used with free camera and Renderer = 1.
+                   Giant stars of field are not placed farther than field then (they fade in), so they are not drawn over nearer background.
+Backend          - 0 - GDI BitBlt, 1 - Direct3D 11 flip-model swap chain with vsync (Windows 8+, MSVS 2012+ build), GDI is used if it is not available.
+                   With Backend = 1 frame is rendered straight into mapped texture, with Profile = 1 - into DIB section, which is copied to it.
+Renderer         - 0 - CPU, 1 - GPU: stars are projected and drawn by shaders, CPU only respawns them (for millions of stars, requires Backend = 1 and Windows 8.1+).
+Seed             - Seed of random generator, 0 - new star field each start. Same seed gives same star field and frames for any Threads.
+Snapshot         - File of star field snapshot, empty - off. If file is missing, whole field is generated at start and written to it;
+                   if file matches configuration (frame size, Stars, StarSize, SizeType, colors, camera, clusters, background), field is mapped from it
+                   instead of generation, so each start shows same field. File of other configuration is kept and not used. Only for Renderer = 0.
+StepLog          - File of frame steps (ms per line), empty - off. Screensaver writes step of each frame, "/bench StepLog=file" replays them:
+                   with same Snapshot and frame size frames are the same as were shown (unless TargetFrameMs is on).
+                   With window per monitor (Monitors = 1, 2) monitor N > 1 uses file "name.N.ext" for Snapshot and StepLog.
+FastMath         - 1 - tables and approximations instead of pow and sqrt (fade error below one level of color for FadePower >= 0.5), 0 - exact calculation.
+Profile          - 1 - show overlay with frame times (last, p50, p99), times of phases and counters of stars and pixels, 0 - off. F2 toggles it.
+ProfileCsv       - File to write row per frame while profiling (times of phases in ms and counters), empty - no file. Full path is recommended.
+Monitors         - 0 - one window over whole virtual desktop;
+                   1 - window per monitor with own star field, frame and render thread, Stars and CenterX, CenterY are per monitor;
+                   2 - window per monitor, frames of all monitors are rendered in turn by one thread (Backend = 1 could wait vsync for each).
+                   "MonitorN.Name = value" sets any setting only for monitor N (1 - primary), it should follow common value of setting.
+TargetFrameMs    - Budget of star render per frame in ms, 0 - off. If frame takes longer, number of drawn stars is reduced (down to 1/16 of Stars),
+                   with headroom they are restored gradually and fade-in from distance. Only for Renderer = 0.
+
+Command line "/bench Name=value ..." runs headless benchmark: no window, frame in memory, fixed time step.
+Width, Height    - Frame size, 1920x1080 by default.
+Frames           - Number of measured frames (300), after 10 frames of warm-up.
+Step             - Time step of frame in ms, FrameInterval by default.
+StepLog          - Steps of frames are replayed from file instead of Step, all of them are measured (Frames is ignored), without warm-up.
+Any setting above could be given too, it overrides ini file. Seed = 0 is replaced by 1.
+Report (in form of ini file) is printed to standard output: frames/sec, ns per star and per pixel, checksum of last frame.
+
+Command line "/kernels Name=value ..." (or StarFly2Bench.exe of StarFly2Bench project) times separate kernels on frame in memory:
+project, respawn, update (move, projection and respawn by threads), raster (all stars by threads), clear, point,
+circle_r1.5 ... circle_r64 (4096 circles at same random places) and present_gdi (BitBlt of frame to display bitmap).
+Width, Height    - Frame size, 1920x1080 by default.
+Runs             - Runs of each kernel (20), minimum and median time are reported.
+Any setting could be given too, Seed = 0 is replaced by 1. Report is JSON: settings and per kernel items, ms and ns per item.
+Same checksum means same image, e.g. for Simd = 0 and 1 with FastMath = 0.
 
 
 Some base code got from Phosphor2 screensaver, 2010 Evan Green, GPLv3
@@ -58,27 +118,75 @@ Change log:
 2024-11-26 Slow fade-in
 2024-11-27 Type of star size distribution
 2024-11-30 .scr starting handling, ini from near exe
-
-Possible future improvements:
-- Support side-view / backward fly
-- Rotation
-- Support clouds/clusters and galaxies
+2026-10-14 Structure-of-arrays star pool, SIMD projection
+2026-10-14 Worker threads, parallel update and render by screen bands
+2026-10-14 Clearing of only touched pixels instead of whole frame
+2026-10-14 Circles drawn by row spans, cache of small circles
+2026-10-14 Presenter interface, Direct3D 11 flip-model backend
+2026-10-14 GPU render of instanced stars
+2026-10-14 Own random generator, per chunk of stars, parallel respawn
+2026-10-14 Tables for fade and size distribution, approximate 1/sqrt
+2026-10-14 Palette of star colors, star keeps only index of color
+2026-10-14 Profiler of frame phases with overlay and CSV trace
+2026-10-14 Headless benchmark with fixed time step
+2026-10-14 Render thread with deadlines of frames instead of multimedia timer, TimerRate setting fixed
+2026-10-14 Quality governor to hold TargetFrameMs by number of drawn stars
+2026-10-14 Window per monitor instead of one over virtual desktop
+2026-10-14 Packed colors - fade by integer multiply, pixel written by one store
+2026-10-14 Initial stars sampled directly in viewed pyramid, without rejection
+2026-10-14 Depth order - stars drawn back-to-front by buckets of depth, without z-buffer
+2026-10-14 Additive light with anti-aliased circles and tone map
+2026-10-14 Stars generated during first frames, arrays of stars and pixels in one block
+2026-10-14 Lifecycle - destructor frees everything, exit abandons current frame
+2026-10-14 Streaks - trails of stars from position on previous frame
+2026-10-14 Free camera - any direction of flight and rotation of view, respawn on exposed sides
+2026-10-14 Clusters of stars - culled and respawned as a whole, drawn as glow when far
+2026-10-14 Background - far stars baked into image and redrawn only when they move by a pixel, invisible stars skipped
+2026-10-14 Frame with top-down rows of any pitch, Direct3D 11 frame rendered straight into mapped staging texture
+2026-10-14 Kernels of projection and raster specialized by settings at compile time, chosen once
+2026-10-14 Snapshot of star field mapped from file, log of frame steps replayed by benchmark
+2026-10-14 Live reload of changed settings from ini file, number of stars changed without new star field
+2026-10-14 Frame follows resize of window (display mode, DPI), buffers of pixels from reused 64-byte aligned block, stars are kept
+2026-10-14 Benchmark of separate kernels with JSON report, StarFly2Bench console project
 ==========================================================================================================================*/
 
 #include <windows.h>
 #include <math.h>
 #include <stdio.h>
+#include <emmintrin.h> // SSE2
+#if defined(__AVX2__)
+#include <immintrin.h> // AVX2, only if compiler generates it (/arch:AVX2)
+#endif
+#if !defined(STARFLY2_D3D11) && !defined(STARFLY2_NO_D3D11) && defined(_MSC_VER) && (_MSC_VER >= 1700)
+#define STARFLY2_D3D11 // MSVS 2012+ comes with Windows 8 SDK, which has DXGI 1.2 for flip-model swap chain
+#endif
+#ifdef STARFLY2_D3D11
+#include <d3d11.h>  // Only headers are used, d3d11.dll and d3dcompiler_47.dll are loaded dynamically
+#include <dxgi1_2.h>
+#include <d3dcompiler.h>
+#endif
 
 // Definitions ----------------------------------------------------------------
 
 #define FP_TYPE   float     // Floating-point type
 
+#ifndef CREATE_WAITABLE_TIMER_HIGH_RESOLUTION
+#define CREATE_WAITABLE_TIMER_HIGH_RESOLUTION 0x00000002 // Windows 10 1803+, not in older SDK
+#endif
+
+#ifndef WM_DPICHANGED
+#define WM_DPICHANGED 0x02E0 // Windows 8.1+, not in older SDK
+#endif
+
 // Data Structure Definitions -------------------------------------------------
 
 enum StarState : UINT8
 {
 	State_New = 0,       // Star to be created on program start
 	State_Generated,     // Star generated normally
+	State_Clustered,     // Star of cluster, position is set from center of cluster
+	State_NewBackground, // Star of background to be created on program start, in far shell
+	State_Background,    // Star of background, moved and drawn only when background is baked
 };
 
 enum RandomColorType
@@ -94,17 +202,142 @@ enum RandomStarSize
 	SizeType_GammaLike = 2,   // Something like Gamma distribution with max at StarSize
 };
 
+// Fade with distance in SIMD projection, each one is own instantiation of kernel
+enum FadeKind
+{
+	Fade_Exact = 0, // pow per lane
+	Fade_Table,     // Interpolation in table of fade, FastMath = 1
+	Fade_Linear,    // FadePower = 1 - fade is viewSize
+	Fade_None,      // FadePower = 0 - no fade
+};
+
+// Buffers of raster, each one is own instantiation of drawing
+enum RasterKind
+{
+	Raster_Z = 0,   // Nearest star hides others by zBuffer
+	Raster_Order,   // Stars are drawn back-to-front, without zBuffer
+	Raster_Light,   // Light of stars is added in lightBuffer
+};
+
+// Faces of viewed pyramid, on which respawned stars appear
+enum SpawnFace
+{
+	Face_Far = 0,  // Far plane, the only one for forward fly
+	Face_MinX,     // Sides of pyramid (from viewer to edges of far plane) by axis of camera
+	Face_MaxX,
+	Face_MinY,
+	Face_MaxY,
+	Face_Count,
+};
+
+// Face of viewed pyramid for respawn with free camera
+// Space comes into view thru it with density of flow per unit of area: inflow + dot(gradient, position)
+struct SpawnSide
+{
+	FP_TYPE share;       // Upper bound of share of candidate positions on this face, cumulative, last is 1.0
+	FP_TYPE inflow;      // Density of flow by flight
+	FP_TYPE gradient[3]; // Change of density with position, by rotation
+	FP_TYPE peak;        // Maximum of density on face, it is at one of corners
+};
+
+// Kind of cluster - shape of distribution of its stars
+enum ClusterKind : UINT8
+{
+	ClusterKind_Globular = 0, // Sphere, dense to center (Plummer profile)
+	ClusterKind_Galaxy,       // Thin disk with two spiral arms and bulge, random orientation
+	ClusterKind_Count,
+};
+
+// How cluster is drawn in current frame
+enum ClusterView : UINT8
+{
+	ClusterView_Hidden = 0,   // Out of view - to be respawned
+	ClusterView_Impostor,     // Far - one glow of summed light of its stars, stars are not touched
+	ClusterView_Stars,        // Near - its stars are placed, projected and drawn one by one
+};
+
+// Cluster of stars inside bounding sphere, it is moved and culled as one star
+// Its stars are kept as offsets from center, they are generated from seed when cluster comes near first time
+struct Cluster
+{
+	FP_TYPE x, y, z;    // Center, in same coordinates as stars
+	FP_TYPE radius;     // Bounding sphere of its stars
+	UINT32 seed;        // Generator of its stars
+	ClusterKind kind;
+	ClusterView view;
+	bool generated;     // Stars are generated for current seed
+	UINT8 colorFrom;    // Stars take palette colors [colorFrom, colorFrom + ClusterColors)
+
+	// Viewed values of impostor
+	FP_TYPE xp;         // Position on screen
+	FP_TYPE yp;
+	FP_TYPE viewSize;   // Radius of glow on screen
+	FP_TYPE fade;       // Average fade of glow
+};
+
 class StarFly2;
 
+// Fast random generator xoshiro128+ ( https://prng.di.unimi.it/ ), period 2^128-1
+// Not thread-safe, each thread or task should use its own generator
+class Random
+{
+public:
+	Random() { Seed(0); }
+
+	void Seed( UINT32 seed );
+	void Fill( FP_TYPE* values, int count );
+
+	// Next 32 random bits, lowest bits are weaker
+	UINT32 Next()
+	{
+		UINT32 result = s[0] + s[3];
+		UINT32 t = s[1] << 9;
+		s[2] ^= s[0];
+		s[3] ^= s[1];
+		s[1] ^= s[2];
+		s[0] ^= s[3];
+		s[2] ^= t;
+		s[3] = (s[3] << 11) | (s[3] >> 21);
+		return result;
+	}
+
+	// Random FP number in range [0, 1) with 24 bits of precision
+	FP_TYPE NextFloat() { return (Next() >> 8) * ((FP_TYPE)1.0 / 16777216); }
+
+private:
+	UINT32 s[4];
+};
+
+// Tables for approximation of pow in fade with distance and in distribution of star sizes
+// Both use linear interpolation
+class FastTables
+{
+public:
+	static const int FadeSteps = 4096;     // Fade error is below 1/256 (one level of color) for FadePower >= minFadePower
+	static const int SizeSteps = 1024;     // Relative error of star size is below 1e-4
+	static const FP_TYPE minFadePower;     // Fade with smaller power is too steep near 0 - pow is used
+	static const FP_TYPE sizeFrom, sizeTo; // Range of size table, steep head and tail are calculated directly
+
+	FastTables();
+
+	void BuildFade( FP_TYPE power );
+	void BuildSize();
+	FP_TYPE StarRadius( FP_TYPE r ) const;
+
+	FP_TYPE fadePower;             // Power of fade table
+	bool fadeByTable;              // Table is built and should be used
+	FP_TYPE fade[FadeSteps + 2];   // pow(i/FadeSteps, fadePower), last is for interpolation at viewSize = 1.0
+	FP_TYPE size[SizeSteps + 2];   // randStarRadius in [sizeFrom, sizeTo]
+};
+
 class Star
 {
 public:
 	static const FP_TYPE giantFactor; // Giants are generated N-times further
+	static const FP_TYPE minSize;     // If larger - draw as circle, smaller - just 1 pixel
 
 	// Absolute values
-	UINT8 r; // Color
-	UINT8 g;
-	UINT8 b;
+	UINT8 color; // Index in palette
 	StarState state;
 	FP_TYPE x;
 	FP_TYPE y;
@@ -118,8 +351,489 @@ public:
 	FP_TYPE viewSize; // Radius on screen
 	FP_TYPE fade; // Fade (0.0 - black, 1.0 - r,g,b)
 
-	void Process( StarFly2* app);
-	void Render( StarFly2* app);
+	void Process( StarFly2* app, Random& random );
+	bool Project( StarFly2* app);
+	void Randomize( StarFly2* app, Random& random );
+};
+
+// One aligned block for arrays of same lifetime - stars and per-pixel buffers
+// Arrays are taken one after another and freed all at once, so allocation does not depend on number of arrays
+class Arena
+{
+public:
+	static const size_t Align = 64; // Alignment of each array, bytes (cache line, so rows of threads do not share lines)
+
+	Arena();
+	~Arena();
+
+	bool Allocate( size_t bytes );
+	bool Reserve( size_t bytes );
+	void* Take( size_t bytes );
+	void Free();
+	void Swap( Arena& other );
+	static size_t Round( size_t bytes ) { return (bytes + Align - 1) / Align * Align; }
+
+private:
+	UINT8* block;
+	size_t size;
+	size_t used;
+};
+
+// Structure-of-arrays storage of all stars
+// Each field is separate array aligned for SIMD, so projection touches only hot data
+// Arrays are taken from arena, which owns them
+// Star class is used as temporary for scalar processing of a single star
+class StarPool
+{
+public:
+	static const int Block = 8;  // Capacity is rounded up to this number of stars (AVX register of floats)
+
+	int count;    // Number of stars
+	int capacity; // Number of allocated elements
+
+	// Hot data - used by projection every frame
+	FP_TYPE* x;
+	FP_TYPE* y;
+	FP_TYPE* z;
+	FP_TYPE* size;
+	int* fadeIn;
+	FP_TYPE* xp;
+	FP_TYPE* yp;
+	FP_TYPE* viewSize;
+	FP_TYPE* fade;
+
+	// Cold data - used only on render or regeneration
+	UINT8* color; // Index in palette
+	StarState* state;
+	FP_TYPE* xpPrev; // Streaks - position on previous frame, NULL if streaks are off
+	FP_TYPE* ypPrev;
+
+	StarPool();
+	~StarPool();
+
+	static size_t Bytes( int stars, bool streaks );
+	bool Allocate( int stars, bool streaks, Arena& arena );
+	void Free();
+	void Get( int index, Star& star ) const;
+	void Set( int index, const Star& star );
+	void Copy( const StarPool& from, int fromIndex, int toIndex, int count );
+
+	// Streaks - current position becomes previous one, projection overwrites the older one
+	void KeepPositions()
+	{
+		FP_TYPE* t = xp; xp = xpPrev; xpPrev = t;
+		t = yp; yp = ypPrev; ypPrev = t;
+	}
+};
+
+// Growable array of star indices, memory is kept between frames
+class IndexList
+{
+public:
+	int* data;
+	int count;
+	int capacity;
+
+	IndexList();
+	~IndexList();
+
+	void Clear() { count = 0; }
+	void Push( int value )
+	{
+		if (count == capacity)
+			Grow();
+		data[count++] = value;
+	}
+
+private:
+	void Grow();
+};
+
+// Precomputed spans of small circles, quantized by radius and sub-pixel position of center
+// Each sprite is list of rows, row is pair of left and right pixel (inclusive) relative to floor of center
+class CircleCache
+{
+public:
+	static const int MaxRadius = 16;  // Circles with smaller radius are taken from cache
+	static const int RadiusSteps = 8; // Quantization of radius, steps per pixel
+	static const int OffsetSteps = 4; // Quantization of center position, steps per pixel
+	static const int MaxRows = 2*MaxRadius + 3;
+
+	struct Sprite
+	{
+		int top;            // First row relative to floor of center
+		int rows;           // Number of rows
+		const INT8* spans;  // [rows*2] left, right
+	};
+
+	CircleCache();
+	~CircleCache();
+
+	bool Build();
+	void Free();
+	const Sprite* Find( FP_TYPE viewSize, FP_TYPE xp, FP_TYPE yp ) const;
+
+private:
+	Sprite* sprites;
+	INT8* spans;
+};
+
+// Circle prepared for rasterization by rows
+struct CircleShape
+{
+	FP_TYPE xp, yp;    // Center
+	FP_TYPE lim;       // Squared radius
+	int kFrom, kTo;    // Columns of bounding rectangle clipped by screen
+	int jFrom, jTo;    // Rows of bounding rectangle clipped by screen
+	const CircleCache::Sprite* sprite; // Precomputed spans or NULL for exact calculation
+	int xBase, yBase;  // Floor of center for sprite
+};
+
+// Function executed by worker pool
+// context - user data
+// task - index of task, [0, tasks)
+typedef void (*WorkerJob)( void* context, int task );
+
+// Pool of worker threads for splitting frame into parallel tasks
+// Calling thread also executes tasks, so pool with 0 threads simply runs all tasks in order
+class WorkerPool
+{
+public:
+	WorkerPool();
+	~WorkerPool();
+
+	bool Start( int threads );
+	void Stop();
+	void Run( WorkerJob job, void* context, int tasks );
+	int Threads() const { return threadCount + 1; } // Including calling thread
+
+private:
+	struct Worker
+	{
+		WorkerPool* pool;
+		HANDLE thread;
+		HANDLE start; // Auto-reset event - new job posted
+	};
+
+	Worker* workers;
+	int threadCount;
+	HANDLE done; // Auto-reset event - all workers finished current job
+	volatile LONG nextTask;
+	volatile LONG pending; // Workers still executing current job
+	volatile LONG quit;
+	WorkerJob job;
+	void* context;
+	int tasks;
+
+	void Work();
+	static DWORD WINAPI ThreadProc( LPVOID parameter );
+};
+
+enum PresentBackend
+{
+	Backend_Gdi = 0,
+	Backend_D3D11 = 1,
+	Backend_Memory = 2, // Frame is not shown, for benchmark without window
+};
+
+// Shows rendered frames in window
+// Frame is 32-bit BGRX buffer of fixed size with top-down rows, Pitch bytes apart (multiple of 4, same for whole life of presenter)
+// Frame is rendered between BeginFrame and Present, its contents are kept from previous frame unless Buffer changes
+class Presenter
+{
+public:
+	virtual ~Presenter() {}
+
+	virtual bool Initialize( HWND window, int width, int height ) = 0;
+	virtual void Destroy() = 0;
+	virtual bool BeginFrame( bool gdi ) = 0; // gdi - frame should be printable by GDI (BufferDc); false on failure
+	virtual bool Present( int windowWidth, int windowHeight ) = 0;
+	virtual UINT8* Buffer() const = 0;
+	virtual int Pitch() const = 0;
+	virtual HDC BufferDc() const = 0; // DC with frame selected for GDI output, NULL if not supported
+	virtual PresentBackend Backend() const = 0;
+};
+
+// Frame in DIB section, copied to window by BitBlt
+class GdiPresenter : public Presenter
+{
+public:
+	GdiPresenter();
+	~GdiPresenter();
+
+	bool Initialize( HWND window, int width, int height );
+	void Destroy();
+	bool BeginFrame( bool gdi ) { return true; }
+	bool Present( int windowWidth, int windowHeight );
+	UINT8* Buffer() const { return buffer; }
+	int Pitch() const { return frameWidth * 4; } // Rows of 32-bit DIB are always aligned
+	HDC BufferDc() const { return memDc; }
+	PresentBackend Backend() const { return Backend_Gdi; }
+
+private:
+	HWND targetWindow;
+	int frameWidth, frameHeight;
+	HBITMAP memBitmap;
+	HBITMAP origBitmap;
+	HDC memDc;
+	UINT8* buffer;
+};
+
+// Frame in memory only, presenting does nothing
+class MemoryPresenter : public Presenter
+{
+public:
+	MemoryPresenter();
+	~MemoryPresenter();
+
+	bool Initialize( HWND window, int width, int height );
+	void Destroy();
+	bool BeginFrame( bool gdi ) { return true; }
+	bool Present( int windowWidth, int windowHeight ) { return true; }
+	UINT8* Buffer() const { return buffer; }
+	int Pitch() const { return pitch; }
+	HDC BufferDc() const { return NULL; }
+	PresentBackend Backend() const { return Backend_Memory; }
+
+private:
+	UINT8* buffer;
+	int pitch;
+};
+
+#ifdef STARFLY2_D3D11
+// Frame is rendered straight into mapped staging texture, which is copied to back buffer of DXGI flip-model swap chain
+// Present waits for vertical blank, so tearing of GDI BitBlt is avoided
+// When GDI should print on frame, it is rendered into DIB section of GDI presenter (never presented) with same pitch and uploaded
+class D3D11Presenter : public Presenter
+{
+public:
+	D3D11Presenter();
+	~D3D11Presenter();
+
+	bool Initialize( HWND window, int width, int height );
+	void Destroy();
+	bool BeginFrame( bool gdi );
+	bool Present( int windowWidth, int windowHeight );
+	UINT8* Buffer() const { return buffer; }
+	int Pitch() const { return pitch; }
+	HDC BufferDc() const { return (frame.Buffer() == buffer) ? frame.BufferDc() : NULL; }
+	PresentBackend Backend() const { return Backend_D3D11; }
+
+	bool Flip();
+	ID3D11Device* Device() const { return device; }
+	ID3D11DeviceContext* Context() const { return context; }
+	ID3D11Texture2D* BackBuffer() const { return backBuffer; }
+
+private:
+	HMODULE library;
+	ID3D11Device* device;
+	ID3D11DeviceContext* context;
+	IDXGISwapChain1* swapChain;
+	ID3D11Texture2D* backBuffer;
+	ID3D11Texture2D* upload; // Staging texture, keeps frame between maps
+	int frameWidth, frameHeight;
+	int pitch;               // RowPitch of first map of upload, frame is rejected if it changes
+	UINT8* buffer;           // Mapped upload or frame, NULL before first BeginFrame
+	bool mapped;             // Upload is mapped, Present unmaps it
+	GdiPresenter frame;
+};
+
+// Star as stored on GPU, projected by vertex shader
+struct GpuStar
+{
+	FP_TYPE x, y;
+	FP_TYPE z;         // Absolute depth (distance passed at spawn + depth) modulo GpuStarRenderer::DepthWrap
+	FP_TYPE size;
+	INT32 fadeInEnd;   // Total time in ms, when fade-in ends
+	UINT32 color;      // R, G, B bytes from lowest
+};
+
+// Parameters of frame for shaders
+struct GpuFrame
+{
+	FP_TYPE screen[4]; // ScreenWidth, ScreenHeight, CenterX*ScreenWidth, CenterY*ScreenHeight
+	FP_TYPE view[4];   // ScreenScale, distance passed modulo DepthWrap, FadePower, FadeInK
+	INT32 time[4];     // Total time in ms
+};
+
+// Renders all stars by one instanced draw into back buffer of D3D11Presenter
+// Each star is a quad, vertex shader does projection, fading and choice of circle or single point as Star::Project and DrawStar
+// Depth buffer of 16 bits replaces zBuffer
+class GpuStarRenderer
+{
+public:
+	static const int DepthWrap = 65536; // Stored depth wraps, so its precision does not degrade with time
+
+	GpuStarRenderer();
+	~GpuStarRenderer();
+
+	bool Initialize( D3D11Presenter* presenter, int width, int height, int stars );
+	void Destroy();
+	GpuStar* MapStars( bool discard );
+	void UnmapStars();
+	bool Render( const GpuFrame& frame );
+
+private:
+	HMODULE compiler;
+	ID3D11DeviceContext* context; // Device and context are owned by presenter
+	ID3D11VertexShader* vertexShader;
+	ID3D11PixelShader* pixelShader;
+	ID3D11InputLayout* layout;
+	ID3D11Buffer* instances; // [starCount] GpuStar
+	ID3D11Buffer* constants; // GpuFrame
+	ID3D11Texture2D* depth;
+	ID3D11DepthStencilView* depthView;
+	ID3D11DepthStencilState* depthState;
+	ID3D11RasterizerState* rasterizer;
+	ID3D11RenderTargetView* target;
+	int frameWidth, frameHeight;
+	int starCount;
+
+	ID3DBlob* Compile( pD3DCompile compile, const char* entry, const char* profile );
+};
+#endif
+
+// Phases of frame measured by profiler
+enum ProfilePhase
+{
+	Phase_Clear = 0,   // Clear of pixels touched on previous frame
+	Phase_Process,     // Move, projection and respawn of stars
+	Phase_Raster,      // Drawing of stars
+	Phase_Present,     // Copy of frame to window
+	Phase_Total,       // Whole frame
+	PhaseCount,
+};
+
+// Counters of rendered frame, kept per band so bands are rendered in parallel without sharing
+struct FrameCounters
+{
+	int pixels;          // Pixels written
+	int zRejects;        // Pixels hidden by nearer stars
+	int circles;         // Stars drawn as circles
+	int points;          // Stars drawn as single pixels
+	LONGLONG clearTicks; // Time of clearing, QueryPerformanceCounter ticks
+
+	void Clear() { pixels = 0; zRejects = 0; circles = 0; points = 0; clearTicks = 0; }
+	void Add( const FrameCounters& other );
+};
+
+// Frame-time profiler: phase times by QueryPerformanceCounter, percentiles of recent frames and CSV trace
+// Phases are measured always (it is cheap), results are collected only if enabled
+class FrameProfiler
+{
+public:
+	static const int History = 256; // Recent frames for percentiles
+	static const int Lines = 4;     // Lines of overlay text
+
+	FrameProfiler();
+	~FrameProfiler();
+
+	static LONGLONG Now()
+	{
+		LARGE_INTEGER counter;
+		QueryPerformanceCounter(&counter);
+		return counter.QuadPart;
+	}
+
+	void SetCsv( const char* path );
+	void Close();
+	void BeginFrame();
+	void Add( ProfilePhase phase, LONGLONG elapsed ) { ticks[phase] += elapsed; }
+	double Ms( LONGLONG elapsed ) const { return elapsed * msPerTick; }
+	void EndFrame( int intervalMs, int stars, int respawns, int skipped, const FrameCounters& counters );
+	int Line( int line, char* text, int size ) const;
+
+	volatile bool enabled; // Collect frames, show overlay and write CSV, toggled by F2
+
+private:
+	double msPerTick;
+	LONGLONG frameStart;
+	LONGLONG ticks[PhaseCount];  // Current frame
+	double ms[PhaseCount];       // Last collected frame
+	int lastStars, lastRespawns;
+	unsigned int skippedFrames;  // Deadlines missed since start
+	FrameCounters lastCounters;
+	double history[History];     // Total times of recent frames, ms
+	int historyCount, historyNext;
+	double p50, p99;
+	unsigned int frames;         // Collected frames
+	char csvPath[MAX_PATH];      // Empty - no CSV
+	FILE* csv;
+	bool csvFailed;
+};
+
+// Log of frame time steps, one number of ms per line
+// Written by screensaver and replayed by benchmark, so frames seen on display are reproduced with same star field (Snapshot)
+class StepLog
+{
+public:
+	StepLog();
+	~StepLog();
+
+	void SetPath( const char* path );
+	void Close();
+	void Record( unsigned int stepMs );
+	bool Load( IndexList& steps ) const;
+	bool Enabled() const { return 0 != path[0]; }
+	const char* Path() const { return path; }
+
+private:
+	char path[MAX_PATH]; // Empty - no log
+	FILE* file;          // Opened on first recorded frame
+	bool failed;
+};
+
+// Result of reading snapshot of star field
+enum SnapshotStatus
+{
+	Snapshot_Off = 0,    // No snapshot configured or stars are on GPU
+	Snapshot_Loaded,     // Star field is taken from file
+	Snapshot_Saved,      // File was missing, generated star field is written to it
+	Snapshot_Failed,     // File was missing and could not be written
+	Snapshot_Mismatch,   // File is for other configuration, it is kept and star field is generated as usual
+};
+
+// Header of snapshot file, followed by arrays of SnapshotArrays
+// Numbers are in native format of build, file is accepted only if configuration part matches exactly
+struct SnapshotHeader
+{
+	char magic[8];          // "SF2SNAP"
+	UINT32 version;
+	UINT32 fpBytes;         // sizeof(FP_TYPE)
+
+	// Configuration, which star field depends on
+	INT32 width, height;
+	INT32 stars, fieldStars, backCount, savedStars; // savedStars - first stars of pool in file, without ones of clusters
+	INT32 clusters, clusterStars;
+	INT32 sizeType, colorType, darkestRGB, fastMath;
+	FP_TYPE starSize, zoom, centerX, centerY;
+	FP_TYPE clusterSize, background;
+	FP_TYPE flyYaw, flyPitch, rotateYaw, rotatePitch, rotateRoll;
+
+	// Not compared
+	UINT32 seed;            // Configured Seed, 0 - field was generated from time
+	UINT64 bytes;           // Size of whole file
+};
+
+// Settings applied live by ReloadSettings, read from ini without whole object of renderer
+// Only settings present in file are changed, so file being written by editor does not bring defaults
+struct LiveSettings
+{
+	int monitor;          // MonitorIndex of surface, for "MonitorN." settings
+	int stars;            // Stars
+	int fadeInTime;       // FadeInTime
+	FP_TYPE speed;        // Speed
+	FP_TYPE fadePower;    // FadePower
+	FP_TYPE targetFrameMs; // TargetFrameMs
+	FP_TYPE zoom, centerX, centerY;
+
+	bool ApplySetting( const char* name, const char* value );
+};
+
+enum RenderMode
+{
+	Renderer_Cpu = 0,
+	Renderer_Gpu = 1,
 };
 
 class StarFly2
@@ -131,9 +845,12 @@ public:
 	static const int MouseTolerance = 5;  // pixels, Smaller moves will not trigger exit
 
 	static const FP_TYPE  FarPlane;       // Distance, at which most new stars are generated
+	static const int GenerateBatch = 32768; // Stars generated before first frame and by each next frame, till all are generated
+	static const int PaletteSize = 256;   // Colors of stars, index is kept in one byte
 
 	// Configuration
 	bool ScreenSaverWindowed;
+	int Monitors;     // 0 - one window over virtual desktop, 1 - window per monitor, 2 - window per monitor, one render thread
 	FP_TYPE StarSizeFactor;
 	FP_TYPE CenterX;
 	FP_TYPE CenterY;
@@ -144,76 +861,312 @@ public:
 	RandomColorType ColorType;
 	RandomStarSize SizeType;
 	int FadeInTime;
+	bool UseFastMath; // Tables and approximations instead of pow and sqrt, Star::Project remains reference code
+	FastTables tables;
+	FP_TYPE FlyYaw;      // Direction of flight relative to view, degrees
+	FP_TYPE FlyPitch;
+	FP_TYPE RotateYaw;   // Rotation of view, degrees per second
+	FP_TYPE RotatePitch;
+	FP_TYPE RotateRoll;
 
 	// State
 	POINT MousePosition;
 	int ScreenWidth, ScreenHeight;
 	FP_TYPE ScreenScale;
 	FP_TYPE FadeInK;
+	FP_TYPE fieldDepth; // Share of FarPlane filled by field stars, farther ones are in background; 1.0 without background
+	bool FreeCamera;  // Flight is not straight forward or view rotates - stars are moved by matrix, respawned on several faces
+
+	void SpawnOnFace( Random& random, FP_TYPE& xs, FP_TYPE& ys, FP_TYPE& depth ) const;
+	FP_TYPE RandomSize( FP_TYPE u ) const;
 
 private:
 	int StarCount;
+	int fieldStars;   // Stars moved and drawn every frame, StarCount without background
 	int FrameInterval;
 	FP_TYPE FlySpeed;
 	FP_TYPE Zoom;
+	FP_TYPE TargetFrameMs; // Budget of star render for quality governor, 0 - off
 
 	int TotalTimeMs;
-	bool inRender; // Barrier flag
 	unsigned int PrevTime;
 
-	// GDI objects
+	// Surface of one monitor
+	int MonitorIndex;        // Monitor of window, 1 - primary, 0 - not bound to monitor, "MonitorN." settings are applied for it
+	int SurfaceCount;        // Surfaces rendered simultaneously, automatic number of threads is divided between them
+	StarFly2* renderLeader;  // Surface, which render thread also renders this one, NULL - own render thread
+	StarFly2* nextSurface;   // Next surface rendered by render thread of this one
+
+	// Window and frame
 	HWND OurWindow;
-	MMRESULT OurTimer;
-	HBITMAP MemBitmap;
-	HBITMAP OrigBitmap1;
-	HDC MemDc;
-	UINT8* MemBuffer;
+	HANDLE renderThread;     // Calls UpdateScreen on deadlines of frames
+	HANDLE stopEvent;        // Manual-reset event - render thread should exit
+	volatile LONG stopping;  // Set with stopEvent, current frame is abandoned
+	HANDLE frameTimer;       // Waitable timer of next deadline
+	char iniPath[MAX_PATH];  // Loaded ini file, empty - none
+	HANDLE iniChange;        // Notification of change in folder of ini file, render thread applies changed settings
+	FILETIME iniWriteTime;   // Last write of ini file, other files written in its folder do not reload settings
+	bool timerPeriod;        // timeBeginPeriod(1) was called for timer without high resolution
+	int frameSkipped;        // Deadlines missed before current frame
+	PresentBackend Backend;  // Configured backend, GDI is used if it is not available
+	Presenter* presenter;
+	UINT8* MemBuffer;        // Frame of presenter, taken on each frame
+	int RowStride;           // Pixels from row of frame to next one, also for zBuffer, lightBuffer and background
+	RenderMode Renderer;     // Configured renderer, GPU one requires Direct3D 11 backend
 	UINT16* zBuffer;
+	UINT16* lightBuffer;     // Additive mode - light of pixels, 16 bits per channel in order of frame, cleared with frame
+
+	UINT32 Seed;     // Seed of random generator, 0 - from time
+	Random random;   // Generator for initial stars and serial respawn
+	UINT32 respawnSeed;      // Seed of generators of blocks, from same seed as random, but it is not drawn from it
+	static const int RandomBlock = 16 * StarPool::Block; // Stars of one generator of respawns, chunks are split by these blocks
+	Random* blockRandom;     // [randomBlocks] Generators of respawns, one per RandomBlock stars of pool, in arena
+	int randomBlocks;        // Blocks of field and background stars, so star field does not depend on chunks and threads
+	bool UseSimd;    // Use SIMD projection, otherwise scalar Star::Process
+	bool UseSprites; // Use precomputed spans for small circles, otherwise exact per-row calculation
+	Arena arena;      // Arrays of stars and clusters
+	Arena pixelArena; // Buffers of pixels - zBuffer, lightBuffer and background, taken again when frame size changes
+	StarPool stars;  // All stars
+	int generatedStars; // First stars, which are generated, others are generated by next frames
+	int activeStars; // First stars, which are moved and drawn, less than generatedStars if governor reduced load
+	double frameCostMs; // Smoothed time of star render, for governor
+	int governorHold;   // Frames till next reduction of load
+	UINT32 palette[PaletteSize]; // Star colors, packed as in frame
+	CircleCache sprites;
+
+	// Additive light - stars combine light in pixels, edges of circles are anti-aliased, no z-buffer
+	static const int LightShift = 6;  // Light of star is color << LightShift, so 4 full stars in one pixel saturate it
+	static const int ToneKnee = 204;  // Tone map is linear up to this level, higher light is compressed towards 255
+	bool UseAdditive;       // Configured, otherwise nearest star hides others
+
+	// Depth order - stars are drawn back-to-front, z-buffer is not used
+	// All stars move with same speed, so star keeps its bucket of absolute depth (depth + distance passed) till respawn
+	static const int DepthBuckets = 2048;    // Ring of buckets covers depth of giants (FarPlane * Star::giantFactor)
+	static const int DepthBucketDepth = 16;  // Distance of one bucket, order of stars in one bucket is arbitrary
+	bool UseDepthOrder;     // Configured, otherwise z-buffer
+	bool UseStreaks;        // Configured, stars are drawn with trails from position on previous frame
+	IndexList* depthRing;   // [DepthBuckets] Stars by absolute depth
+	int* starBucket;        // [stars.capacity] Bucket of each star in ring, -1 - none
+	int* starEntry;         // [stars.capacity] Position of each star in its bucket
+	int* chunkBuckets;      // [ChunkCount+1] Buckets of each chunk for binning, as steps from far end of ring
+	LONGLONG nearBucket;    // Bucket at viewer, absolute
+	double depthDistance;   // Distance passed since start
+
+	// Multithreading
+	int ThreadCount;        // Configured number of threads, 0 - auto
+	WorkerPool workers;
+	int ChunkCount;         // Stars are split into chunks for parallel update
+	int BandCount;          // Screen is split into horizontal bands for parallel render
+	IndexList* respawns;    // [ChunkCount] Stars to be regenerated, per chunk
+	IndexList* bins;        // [ChunkCount*BandCount] Stars to be rendered, per chunk and band
+	int* bandRows;          // [BandCount+1] First row of each band
+	int* rowBand;           // [ScreenHeight] Band of each row
+	IndexList* dirty;       // [BandCount] Spans of pixels touched on previous frame, per band
+	FrameCounters* counters; // [BandCount] Counters of rendered frame, per band
+	bool clearAll;          // Next frame should clear whole screen
+	FP_TYPE frameMovedZ;    // Parameters of current frame for jobs
+	FP_TYPE frameRotation[9]; // Free camera - star is moved as frameRotation * (star - frameShift), rows of matrix
+	FP_TYPE frameShift[3];
+	int framePassedMs;
+	int frameRespawns;      // Stars regenerated in current frame
+
+	// Free camera, stars are kept in its coordinates: x - right, y - down (as rows of frame), z - forward
+	FP_TYPE flyDirection[3]; // Unit vector of flight
+	FP_TYPE starSpin[3];     // Angular velocity of stars relative to camera, radians per ms (opposite to rotation of view)
+	SpawnSide spawnSides[Face_Count];
+
+	// Clusters - stars in groups with bounding sphere, far cluster is drawn as one glow, hidden one is respawned as a whole
+	static const FP_TYPE ImpostorRadius;  // Cluster of smaller radius on screen (pixels) is drawn as glow
+	static const int ClusterColors = 64;  // Span of palette for stars of one cluster, black-body palette is sorted by temperature
+	int ClusterCount;        // Configured number of clusters, 0 - off
+	int ClusterStars;        // Configured stars of each cluster, rounded up to StarPool::Block
+	FP_TYPE ClusterSize;     // Configured average radius of cluster
+	Cluster* clusters;       // [ClusterCount] Taken from arena
+	int clusterFirst;        // First star of clusters in pool, after all field stars
+	FP_TYPE* offsetX;        // [ClusterCount*ClusterStars] Offsets of stars from center of cluster, coordinates of star field at start
+	FP_TYPE* offsetY;
+	FP_TYPE* offsetZ;
+	FP_TYPE clusterStarSize; // Average size of star, for light of glow
+	double cameraTurn[9];    // Free camera - rotation of star field since start (product of frameRotation), for offsets
+	FP_TYPE viewPlanes[4][3]; // Outward normals of sides of viewed pyramid, planes go thru viewer
+	IndexList* clusterStars; // [ChunkCount] Visible stars of near clusters to be rendered, per chunk
+	IndexList* clusterHidden; // [ChunkCount] Stars of near clusters out of view, temporary
+
+	// Background - stars of far shell are drawn into background image, it is restored instead of clear of pixels
+	// Shell is baked again, when its stars could move on screen by BackgroundError since previous bake
+	static const FP_TYPE BackgroundError; // Pixels
+	FP_TYPE BackgroundDepth; // Configured share of FarPlane, farther stars are in background; 0 - off
+	int backFirst;           // First star of background in pool, after field stars
+	int backCount;           // Stars of background, StarCount - fieldStars
+	int generatedBack;       // First stars of background, which are generated
+	UINT32* background;      // [RowStride*ScreenHeight] Baked frame, NULL - off
+	UINT16* backLight;       // [RowStride*ScreenHeight*4] Additive mode - baked light
+	bool bakeBackground;     // Current frame bakes background
+	FP_TYPE backStep;        // Distance of fly between bakes
+	FP_TYPE backMovedZ;      // Distance and time passed since previous bake
+	int backPassedMs;
+	IndexList* backRespawns; // [ChunkCount] Stars of background to be regenerated, per chunk
+	IndexList* backBins;     // [ChunkCount*BandCount] Stars of background to be baked, per chunk and band
+
+	// Instrumentation
+	FrameProfiler profiler;
+
+	// Snapshot of star field and log of frame steps, to start with exact field and replay same frames
+	static const int MaxSnapshotArrays = 16;
+	char snapshotPath[MAX_PATH];     // Empty - star field is generated
+	SnapshotStatus snapshotStatus;
+	StepLog stepLog;
+
+	void FillSnapshotHeader( SnapshotHeader& header ) const;
+	int SnapshotArrays( void** data, size_t* bytes );
+	SnapshotStatus LoadSnapshot();
+	bool SaveSnapshot();
+
+	// Kernels specialized by configuration at compile time, chosen once by SelectKernels, so their loops have no branches by settings
+	typedef void (StarFly2::*ProjectKernel)( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn );
+	typedef void (StarFly2::*RasterKernel)( const int* indices, int from, int to, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	ProjectKernel projectKernel; // SIMD projection of field stars
+	ProjectKernel clusterKernel; // SIMD projection of cluster stars, they are placed without free camera
+	RasterKernel rasterKernel;   // Drawing of pool stars
+
+	void SelectKernels();
+	template <bool Free, int Fade> ProjectKernel PickProjection() const;
+	template <bool Free> ProjectKernel PickFade( FadeKind fade ) const;
+	template <int Raster> RasterKernel PickRaster() const;
+	void ProjectStars( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn );
+	template <bool Free, int Fade, bool FastSqrt> void ProjectStarsSse2( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn );
+#if defined(__AVX2__)
+	template <bool Free, int Fade, bool FastSqrt> void ProjectStarsAvx2( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn );
+#endif
+	void InitializeCamera();
+	void BuildSpawnSides();
+	void UpdateCamera( int passedMs );
+	bool InitializeClusters();
+	void SpawnCluster( Cluster& cluster, bool initial, Random& random );
+	void GenerateClusterStars( int index );
+	bool ViewCluster( Cluster& cluster );
+	void ProcessClusters( int chunk );
+	void DrawClusters( int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	void DrawImpostor( const Cluster& cluster, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	void BackRange( int chunk, int& from, int& to ) const;
+	void ProjectBackground( int chunk );
+	void SaveBackground( int rowFrom, int rowTo, IndexList& dirty );
+	void RegenerateStars( const IndexList& respawn );
+	bool StarRows( int index, int& rowFrom, int& rowTo ) const;
+	void ChunkRange( int chunk, int& from, int& to ) const;
+	bool InitializeThreads();
+	void DestroyThreads();
+	void InitializeBands();
+	void DestroyBands();
+	void RenderStars();
+	void RasterBand( int band );
+	void ClearBand( int band );
+	void MarkDirty( int x, int y, int width, int height );
+	void DrawProfile( HDC dc );
+	void GovernQuality( double costMs );
+	void ActivateStars( int count );
+	bool InitializeDepthOrder();
+	void DestroyDepthOrder();
+	void PlaceStar( int index );
+	void UpdateDepthOrder();
+	void BinStar( int index, IndexList* bins ) const;
+	void AddCircle( FP_TYPE xp, FP_TYPE yp, FP_TYPE radius, __m128i light, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	void AddLight( int offset, __m128i light );
+	template <int Raster, bool Streaks> void DrawPoolStars( const int* indices, int from, int to, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	template <int Raster> void DrawStreak( FP_TYPE x0, FP_TYPE y0, FP_TYPE x1, FP_TYPE y1, UINT32 color, UINT16 z, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters );
+	template <int Raster> void PutStreakPixel( int offset, UINT32 color, UINT16 z, IndexList& dirty, FrameCounters& counters );
+	bool InitializePresenter( PresentBackend backend );
+	void DestroyPresenter();
+	void BuildPalette();
+	bool InitializeStars();
+	bool AllocateStars();
+	bool AllocatePixels();
+	void SplitStars( int count, int& field, int& back ) const;
+	FP_TYPE BackgroundStep() const;
+	void GenerateStars( int count );
+	bool ResizeStars( int count );
+	void ApplyView( FP_TYPE zoom, FP_TYPE centerX, FP_TYPE centerY );
+	bool ResizeFrame( int width, int height );
+	bool ReloadSettings();
+	bool FallBackToGdi();
+
+#ifdef STARFLY2_D3D11
+	// GPU render
+	static const int ExitBuckets = 4096;    // Ring of buckets covers GpuStarRenderer::DepthWrap
+	static const int ExitBucketDepth = 16;  // Distance of one bucket, stars are respawned after leaving view not later than this
+	GpuStarRenderer* gpu;   // Not NULL if stars are rendered on GPU, then stars pool is not used
+	IndexList* exitRing;    // [ExitBuckets] Stars by distance passed, at which they leave view
+	LONGLONG nextExit;      // Next bucket to be respawned, absolute
+	double gpuDistance;     // Distance passed since start
+
+	bool InitializeGpu();
+	void DestroyGpu();
+	bool RenderStarsGpu();
+	void SpawnGpuStar( int index, StarState state, GpuStar& target );
+	FP_TYPE ExitDepth( const Star& star ) const;
+	bool VisibleAt( const Star& star, FP_TYPE z ) const;
+#endif
 
-	Star* allStars;  // All stars (array in fact)
+	bool Stopping() const;
 
-	void Process( int index, int flag );
+	static void JobProject( void* context, int task );
+	static void JobBin( void* context, int task );
+	static void JobRaster( void* context, int task );
 
 public:
 	StarFly2();
+	~StarFly2();
 
-	void LoadSettings ( const char * filename );
+	bool LoadSettings ( const char * filename );
+	void SetSurface ( int monitor, int surfaces, StarFly2* leader );
+	bool ApplySetting ( const char* name, const char* value );
 	bool Initialize ( HWND Window );
+	bool InitializeRender( int width, int height );
 	void Destroy ();
 	bool UpdateScreen ( );
-	void PutPixelOnBufferZ(int x, int y, UINT8 r, UINT8 g, UINT8 b, UINT16 z);
-	void PutPixelOnBufferCheckZ(int x, int y, UINT8 r, UINT8 g, UINT8 b, UINT16 z);
-
-	static VOID CALLBACK TimerEvent ( UINT TimerId, UINT Message, DWORD_PTR User, DWORD_PTR Parameter1, DWORD_PTR Parameter2 );
+	bool RenderFrame ( unsigned int PassedTimeMs, int WindowWidth, int WindowHeight );
+	int Benchmark ( char* options );
+	int BenchmarkKernels ( char* options );
+	void DrawStar(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, FP_TYPE fade, FP_TYPE z, UINT32 color, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters);
+	template <int Raster> void DrawStarAs(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, FP_TYPE fade, FP_TYPE z, UINT32 color, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters);
+	void PrepareCircle(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, CircleShape& circle) const;
+	bool CircleSpan(const CircleShape& circle, int j, int& left, int& right) const;
+	int FillSpanZ(int j, int left, int right, UINT32 color, UINT16 z);
+	void FillSpan(int j, int left, int right, UINT32 color);
+	bool PutPixelOnBufferZ(int x, int y, UINT32 color, UINT16 z);
+	void PutPixelOnBuffer(int x, int y, UINT32 color);
+	void PutPixelOnBufferCheckZ(int x, int y, UINT32 color, UINT16 z);
+
+	bool StartRenderThread ( );
+	void StopRenderThread ( );
+	void RenderLoop ( );
+	static DWORD WINAPI RenderThreadProc ( LPVOID parameter );
 	static LRESULT WINAPI ScreenSaverProc ( HWND hWnd, UINT Message, WPARAM wParam, LPARAM lParam );
 
-#ifdef _DEBUG
-	int RandCount; // Counter of star randomization
-#endif
-
 };
 
 const char StarFly2::ApplicationName[] = "StarFly2";
 const FP_TYPE StarFly2::FarPlane = (FP_TYPE)5000.0;
+const FP_TYPE StarFly2::ImpostorRadius = (FP_TYPE)16.0;
+const FP_TYPE StarFly2::BackgroundError = (FP_TYPE)1.0;
 const FP_TYPE Star::giantFactor = (FP_TYPE)5.0;
+const FP_TYPE Star::minSize = (FP_TYPE)0.8;
+const FP_TYPE FastTables::minFadePower = (FP_TYPE)0.5;
+const FP_TYPE FastTables::sizeFrom = (FP_TYPE)(1.0 / 64.0);
+const FP_TYPE FastTables::sizeTo = (FP_TYPE)(15.0 / 16.0);
 
 // Functions ----------------------------------------------------------------
 
-// Function to generate random FP number in range [0, 1)
-FP_TYPE randFloat()
-{
-	static const FP_TYPE divisor = ((FP_TYPE)1.0)/(FP_TYPE)(RAND_MAX+1); // +1 to not generate 1.0
-	return rand()*divisor;
-}
-
 // Generates distribution vaguely resembling Gamma distribution for k=3.0-5.0
-// Maximum of distribution is 1.0, values are in range [0, ~27.15] ( if RAND_MAX = 0x7FFF - typical )
-FP_TYPE randStarRadius()
+// r - uniform random number in range [0, 1)
+// Maximum of distribution is 1.0, values are in range [0, ~27.15]
+FP_TYPE randStarRadius( FP_TYPE r )
 {
 	static const FP_TYPE one = (FP_TYPE)1.0;
 	static const FP_TYPE pwr = (FP_TYPE)0.3;
 	static const FP_TYPE coeff = (FP_TYPE)1.2;
-	FP_TYPE r = randFloat();
+	static const FP_TYPE rMax = (FP_TYPE)(32767.0 / 32768.0); // Range is the same as it was with rand() and RAND_MAX = 0x7FFF
+	r = min(r, rMax);
 	return coeff * pow(r / (one - r), pwr);
 }
 
@@ -228,139 +1181,3407 @@ char* trim(char* text)
 	return text;
 }
 
+// FNV-1a hash, for comparison of rendered frames
+// data, size - bytes to hash
+UINT32 fnv1a( const UINT8* data, size_t size )
+{
+	UINT32 hash = 2166136261u;
+	for (size_t i = 0; i < size; i++)
+		hash = (hash ^ data[i]) * 16777619u;
+	return hash;
+}
+
 // Methods ------------------------------------------------------------------
 
+// Initialize generator state from single number by SplitMix32
+// seed - any number, same seed gives same sequence
+void Random::Seed( UINT32 seed )
+{
+	for (int i = 0; i < 4; i++)
+	{
+		UINT32 z = (seed += 0x9E3779B9);
+		z = (z ^ (z >> 16)) * 0x85EBCA6B;
+		z = (z ^ (z >> 13)) * 0xC2B2AE35;
+		s[i] = z ^ (z >> 16); // State never becomes all zeros, as SplitMix32 is bijection of distinct values
+	}
+}
+
+// Fill array with random FP numbers in range [0, 1)
+// values - array to fill
+// count - number of values
+void Random::Fill( FP_TYPE* values, int count )
+{
+	for (int i = 0; i < count; i++)
+		values[i] = NextFloat();
+}
+
 // Project star to screen and regenerate it if necessary
 // app - pointer to main object
-void Star::Process( StarFly2* app )
+void Star::Process( StarFly2* app, Random& random )
 {
-	static const FP_TYPE one = (FP_TYPE)1.0;
+	while (!Project(app))
+		Randomize(app, random); // Will rerun projection, new star is generated in view, so there is no second pass except rounding at edges
+}
 
-	while (true)
-	{
-		// Project star to screen coordinates and check if it is still visible
-		do
-		{
-			if (0 > z) break; // Star is behind viewer - generate new one
+// Project star to screen coordinates and check if it is still visible
+// app - pointer to main object
+// Return Value: true if star is visible, false if it should be regenerated
+bool Star::Project( StarFly2* app )
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
 
-			FP_TYPE dist2 = x*x + y*y + z*z;
-			viewSize = size / sqrt(dist2);
-			int size1 = (int)viewSize;
+	if (0 > z) return false; // Star is behind viewer - generate new one
+	if (app->FreeCamera && State_Clustered != state && z > app->FarPlane * ((size > app->StarSizeFactor*giantFactor) ? giantFactor : one))
+		return false; // Star is beyond far plane (of giants for giant) - it could go away only with free camera, cluster is culled as a whole
 
-			FP_TYPE k1 = app->ScreenScale/z;
+	FP_TYPE dist2 = x*x + y*y + z*z;
+	viewSize = size / sqrt(dist2);
+	int size1 = (int)viewSize;
 
-			xp = app->CenterX*app->ScreenWidth + x * k1;
-			if (xp<-size1 || xp>=(app->ScreenWidth+size1))
-				break; // Star circle is outside viewed cone - generate new one
+	FP_TYPE k1 = app->ScreenScale/z;
 
-			yp = app->CenterY*app->ScreenHeight + y * k1;
-			if (yp<-size1 || yp>=(app->ScreenHeight+size1))
-				break;
+	xp = app->CenterX*app->ScreenWidth + x * k1;
+	if (xp<-size1 || xp>=(app->ScreenWidth+size1))
+		return false; // Star circle is outside viewed cone - generate new one
 
-			if (one > viewSize)
-				fade = pow(viewSize, app->FadePower); // Calculate fade of color with distance
-			else
-				fade = one;
+	yp = app->CenterY*app->ScreenHeight + y * k1;
+	if (yp<-size1 || yp>=(app->ScreenHeight+size1))
+		return false;
 
-			// Fade in of star (regardless of FadePower)
-			if (0 < fadeIn)
-			{
-				FP_TYPE k2 = (FP_TYPE)(one - fadeIn * app->FadeInK); // FadeInK = 1.0 / FadeInTime
-				if (one < viewSize)
-				{	// size0 > 1  =>  1) fade 0->1, viewSize 0->1, 2) fade=1, viewSize 1->size0
-					viewSize *= k2;
-					fade = (one > viewSize) ? viewSize : one;
-				}
-				else
-				{	// size0 < 1  =>  1) fade 0->fade0, viewSize 0->size0
-					viewSize *= k2;
-					fade *= k2;
-				}
-			}
+	if (one > viewSize)
+		fade = pow(viewSize, app->FadePower); // Calculate fade of color with distance
+	else
+		fade = one;
 
-			return; // Proejction OK - exit
+	// Fade in of star (regardless of FadePower)
+	if (0 < fadeIn)
+	{
+		FP_TYPE k2 = (FP_TYPE)(one - fadeIn * app->FadeInK); // FadeInK = 1.0 / FadeInTime
+		if (one < viewSize)
+		{	// size0 > 1  =>  1) fade 0->1, viewSize 0->1, 2) fade=1, viewSize 1->size0
+			viewSize *= k2;
+			fade = (one > viewSize) ? viewSize : one;
 		}
-		while(false);
-
-		// Randomize star
-#ifdef _DEBUG
-		app->RandCount++;
-#endif
-		// Position generation
-		if (State_New == state) // Initial star randomization - inside rect.cuboid, which will be limited to viewing cone by projection and checks (see above)
-		{
-			z = randFloat()*app->FarPlane; // Current way
-			fadeIn = 0; // No fade-in
+		else
+		{	// size0 < 1  =>  1) fade 0->fade0, viewSize 0->size0
+			viewSize *= k2;
+			fade *= k2;
 		}
-		else // New stars during fly - on FarPlane
+	}
+
+	return true; // Proejction OK
+}
+
+// Randomize star - position, size and color
+// app - pointer to main object
+// random - generator of calling thread
+void Star::Randomize( StarFly2* app, Random& random )
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
+
+	FP_TYPE u[5]; // All uniform numbers at once: position, size, color
+	random.Fill(u, 5);
+
+	// Position generation
+	FP_TYPE depth; // Share of FarPlane
+	FP_TYPE xs = u[1]; // Share of screen width and height
+	FP_TYPE ys = u[2];
+	bool back = (State_NewBackground == state || State_Background == state); // Star of far shell, behind field stars
+	if (State_New == state || State_NewBackground == state) // Initial star randomization - inside pyramid of viewed space, up to FarPlane
+	{	// Area of pyramid section grows as z^2, so z = FarPlane * cbrt(uniform); (0, 1] to not put star into viewer
+		if (back) // Shell (fieldDepth, 1] - cbrt of uniform in (fieldDepth^3, 1]
 		{
-			z = app->FarPlane;
-			fadeIn = app->FadeInTime; // Normal fade-in
+			FP_TYPE cube = app->fieldDepth*app->fieldDepth*app->fieldDepth;
+			depth = (FP_TYPE)pow((FP_TYPE)(cube + (one - cube)*(one - u[0])), (FP_TYPE)(1.0 / 3.0));
 		}
+		else // Up to fieldDepth, it is 1.0 without background
+			depth = (FP_TYPE)pow((FP_TYPE)(one - u[0]), (FP_TYPE)(1.0 / 3.0)) * app->fieldDepth;
+		fadeIn = 0; // No fade-in
+	}
+	else // New stars during fly - on FarPlane (or on far side of field stars), or on sides of pyramid exposed by free camera
+	{
+		depth = back ? one : app->fieldDepth;
+		if (app->FreeCamera)
+			app->SpawnOnFace(random, xs, ys, depth);
+		fadeIn = app->FadeInTime; // Normal fade-in
+	}
+	z = depth*app->FarPlane;
+
+	// Take into account screen width, height, ScreenScale, FarPlane and CenterX/CenterY
+	// xp_min = CenterX*ScreenWidth + x_min * ScreenScale/z = 0
+	// xp_max = CenterX*ScreenWidth + x_max * ScreenScale/z = ScreenWidth
+	// x = (rnd[0-1] - CenterX)*XrandSpan*z/FarPlane  where XrandSpan = ScreenWidth*FarPlane/ScreenScale
+	x = (xs - app->CenterX)*app->XrandSpan*depth;
+	y = (ys - app->CenterY)*app->YrandSpan*depth;
+	// Star is always inside viewed space, for any CenterX/CenterY, only fp-precision can trigger again regeneration of a star after this
+
+	// Size generation
+	FP_TYPE sizeR = app->RandomSize(u[3]);
+	if (sizeR > giantFactor && (back || one <= app->fieldDepth))
+	{	// Giant stars should appear n-times further to not pop-up as circles
+		// Giants of field in front of background stay within field (they fade in), otherwise they would be drawn over baked nearer stars
+		z *= giantFactor;
+		x *= giantFactor;
+		y *= giantFactor;
+	}
+	size = app->StarSizeFactor*sizeR;
 
-		// Take into account screen width, height, ScreenScale, FarPlane and CenterX/CenterY
-		// xp_min = CenterX*ScreenWidth + x_min * ScreenScale/FarPlane = 0
-		// xp_max = CenterX*ScreenWidth + x_max * ScreenScale/FarPlane = ScreenWidth
-		// x = (rnd[0-1] - CenterX)*XrandSpan  where XrandSpan = ScreenWidth*FarPlane/ScreenScale
-		x = (randFloat() - app->CenterX)*app->XrandSpan;
-		y = (randFloat() - app->CenterY)*app->YrandSpan;
-		// If z=FarPlane then only fp-precision and star size can trigger again regeneration of a star after this
-		// On z=[0..FarPlane) - regeneration will happen with probability 2/3 (star is outsize pyramid volume of viewed space)
-		// If CenterX/CenterY<0.0 or >1.0 - probability of regeneration increases
+	// Color from palette
+	color = (UINT8)(u[4]*StarFly2::PaletteSize);
+}
 
-		// Size generation
-		FP_TYPE sizeR;
-		if (SizeType_AllEqual == app->SizeType)
-			sizeR = one;
-		else if (SizeType_From0to2 == app->SizeType)
-			sizeR = randFloat()*(FP_TYPE)2.0; // [0.0 - 2.0) with max at 1.0
-		else //if (SizeType_GammaLike == app->SizeType)
-			sizeR = randStarRadius(); // (0 - ~27) with max at 1.0
+// Random size of star by SizeType
+// u - uniform random number in range [0, 1)
+// Return Value: size relative to StarSizeFactor
+FP_TYPE StarFly2::RandomSize( FP_TYPE u ) const
+{
+	if (SizeType_AllEqual == SizeType)
+		return (FP_TYPE)1.0;
+	else if (SizeType_From0to2 == SizeType)
+		return u*(FP_TYPE)2.0; // [0.0 - 2.0) with max at 1.0
+	else //if (SizeType_GammaLike == SizeType)
+		return UseFastMath ? tables.StarRadius(u) : randStarRadius(u); // (0 - ~27) with max at 1.0
+}
 
-		if (sizeR > giantFactor)
-		{	// Giant stars should appear n-times further to not pop-up as circles
-			z *= giantFactor;
-			x *= giantFactor;
-			y *= giantFactor;
-		}
-		size = app->StarSizeFactor*sizeR;
+// Fast tables constructor
+FastTables::FastTables()
+{
+	fadePower = (FP_TYPE)-1.0; // Not built
+	fadeByTable = false;
+	memset(fade, 0, sizeof(fade));
+	memset(size, 0, sizeof(size));
+}
 
-		// Color generation
-		if (ColorType_RandomRGB == app->ColorType)
-		{
-			// Random color in range [DarkestRGB, 256)
-			// Could produce green, purple, cyan and so on - colors are not possible in real space
-			static const FP_TYPE colorRand = (FP_TYPE)(256 - app->DarkestRGB); // Span of color generation
-			r = app->DarkestRGB + (UINT8)(randFloat()*colorRand);
-			g = app->DarkestRGB + (UINT8)(randFloat()*colorRand);
-			b = app->DarkestRGB + (UINT8)(randFloat()*colorRand);
-		}
-		else //if (ColorType_RandomBlackBody == app->ColorType)
-		{
-			// Random black-body radiation color
-			// Based on https://stackoverflow.com/questions/21977786/star-b-v-color-index-to-apparent-rgb-color/#22630970  (optimized a bit)
-			FP_TYPE t, bv = (FP_TYPE)(-0.4 + randFloat()*2.4); // BV in range [-0.4, 2.4)
-			// Convert BV into RGB
-			static const FP_TYPE colorRange = (FP_TYPE)(255 - app->DarkestRGB); // Colorization
-			r = app->DarkestRGB, b = app->DarkestRGB, g = app->DarkestRGB;
-			if (bv < 0.00) // Switch for red
-			{
-				t = (FP_TYPE)((bv + 0.40)/(0.00 + 0.40));
-				r += (UINT8)(colorRange*(0.61+(0.11*t)+(0.1*t*t)));
-			}
-			else if (bv < 0.40)
-			{
-				t = (FP_TYPE)((bv - 0.00)/(0.40 - 0.00));
-				r += (UINT8)(colorRange*(0.83+(0.17*t)));
-			}
-			else
-				r += (UINT8)(colorRange);
-			if (bv < 0.00) // Switch for green
-			{
-				t = (FP_TYPE)((bv + 0.40)/(0.00 + 0.40));
-				g += (UINT8)(colorRange*(0.70+(0.07*t)+(0.1*t*t)));
-			}
-			else if (bv < 0.40)
+// Calculate table of fade for given power
+// power - FadePower
+void FastTables::BuildFade( FP_TYPE power )
+{
+	fadePower = power;
+	fadeByTable = (minFadePower <= power);
+	if (!fadeByTable)
+		return;
+	for (int i = 0; i <= FadeSteps; i++)
+		fade[i] = pow((FP_TYPE)i / FadeSteps, power);
+	fade[FadeSteps + 1] = (FP_TYPE)1.0; // viewSize >= 1.0 - no fade
+}
+
+// Calculate table of randStarRadius
+void FastTables::BuildSize()
+{
+	for (int i = 0; i <= SizeSteps + 1; i++)
+		size[i] = randStarRadius(sizeFrom + (sizeTo - sizeFrom) * min(i, SizeSteps) / SizeSteps);
+}
+
+// Inverse CDF of star size distribution by table, same as randStarRadius
+// r - uniform random number in range [0, 1)
+FP_TYPE FastTables::StarRadius( FP_TYPE r ) const
+{
+	if (r < sizeFrom || r >= sizeTo)
+		return randStarRadius(r);
+	FP_TYPE t = (r - sizeFrom) * (SizeSteps / (sizeTo - sizeFrom));
+	int i = (int)t; // Could be SizeSteps due to rounding, so table has one more item
+	return size[i] + (size[i + 1] - size[i]) * (t - i);
+}
+
+// Star pool constructor
+StarPool::StarPool()
+{
+	count = 0;
+	capacity = 0;
+	x = y = z = size = NULL;
+	fadeIn = NULL;
+	xp = yp = viewSize = fade = NULL;
+	color = NULL;
+	state = NULL;
+	xpPrev = ypPrev = NULL;
+}
+
+StarPool::~StarPool()
+{
+	Free();
+}
+
+// Size of arrays in arena for given number of stars
+// stars - number of stars
+// streaks - positions on previous frame are kept
+// Return Value: bytes, including alignment of each array
+size_t StarPool::Bytes( int stars, bool streaks )
+{
+	size_t capacity = max(Block, (stars + Block - 1) / Block * Block);
+	return (streaks ? 10 : 8) * Arena::Round(capacity * sizeof(FP_TYPE)) + Arena::Round(capacity * sizeof(int)) +
+		Arena::Round(capacity) + Arena::Round(capacity * sizeof(StarState));
+}
+
+// Take arrays for given number of stars from arena
+// stars - number of stars
+// streaks - positions on previous frame are kept
+// arena - allocated with at least Bytes(stars, streaks) free
+// Return Value: true on success
+bool StarPool::Allocate( int stars, bool streaks, Arena& arena )
+{
+	Free();
+	capacity = (stars + Block - 1) / Block * Block; // Whole number of SIMD blocks
+	if (0 == capacity)
+		capacity = Block;
+
+	x = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	y = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	z = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	size = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	fadeIn = (int*)arena.Take(capacity * sizeof(int));
+	xp = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	yp = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	viewSize = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	fade = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	color = (UINT8*)arena.Take(capacity);
+	state = (StarState*)arena.Take(capacity * sizeof(StarState));
+	if (streaks)
+	{
+		xpPrev = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+		ypPrev = (FP_TYPE*)arena.Take(capacity * sizeof(FP_TYPE));
+	}
+
+	if (NULL == x || NULL == y || NULL == z || NULL == size || NULL == fadeIn ||
+		NULL == xp || NULL == yp || NULL == viewSize || NULL == fade ||
+		NULL == color || NULL == state || (streaks && (NULL == xpPrev || NULL == ypPrev)))
+	{
+		Free();
+		return false;
+	}
+	count = stars;
+	return true;
+}
+
+// Forget arrays, memory is freed by arena
+void StarPool::Free()
+{
+	x = y = z = size = NULL;
+	fadeIn = NULL;
+	xp = yp = viewSize = fade = NULL;
+	color = NULL;
+	state = NULL;
+	xpPrev = ypPrev = NULL;
+	count = 0;
+	capacity = 0;
+}
+
+// Arena constructor
+Arena::Arena()
+{
+	block = NULL;
+	size = 0;
+	used = 0;
+}
+
+// Arena destructor
+Arena::~Arena()
+{
+	Free();
+}
+
+// Allocate block, previous one is freed
+// bytes - sum of Round() of all arrays
+// Return Value: true on success
+bool Arena::Allocate( size_t bytes )
+{
+	Free();
+	block = (UINT8*)_aligned_malloc(max(bytes, Align), Align);
+	if (NULL == block)
+		return false;
+	size = bytes;
+	return true;
+}
+
+// Take block for new set of arrays, previous block is kept if it fits and is not more than twice larger
+// Used for buffers of frame, which are taken again on each change of its size
+// bytes - sum of Round() of all arrays
+// Return Value: true on success
+bool Arena::Reserve( size_t bytes )
+{
+	if (NULL != block && bytes <= size && size / 2 <= bytes)
+	{
+		used = 0;
+		return true;
+	}
+	return Allocate(bytes);
+}
+
+// Take next array from block
+// bytes - size of array
+// Return Value: aligned array, not initialized; NULL if block is too small
+void* Arena::Take( size_t bytes )
+{
+	bytes = Round(bytes);
+	if (NULL == block || size - used < bytes)
+		return NULL;
+	void* result = block + used;
+	used += bytes;
+	return result;
+}
+
+// Free block with all arrays taken from it
+void Arena::Free()
+{
+	_aligned_free(block);
+	block = NULL;
+	size = 0;
+	used = 0;
+}
+
+// Exchange blocks with other arena, e.g. to keep arrays of previous one while new one is filled
+void Arena::Swap( Arena& other )
+{
+	UINT8* b = block; block = other.block; other.block = b;
+	size_t t = size; size = other.size; other.size = t;
+	t = used; used = other.used; other.used = t;
+}
+
+// Copy star from arrays
+void StarPool::Get( int index, Star& star ) const
+{
+	star.color = color[index];
+	star.state = state[index];
+	star.x = x[index];
+	star.y = y[index];
+	star.z = z[index];
+	star.size = size[index];
+	star.fadeIn = fadeIn[index];
+	star.xp = xp[index];
+	star.yp = yp[index];
+	star.viewSize = viewSize[index];
+	star.fade = fade[index];
+}
+
+// Copy star into arrays
+void StarPool::Set( int index, const Star& star )
+{
+	color[index] = star.color;
+	state[index] = star.state;
+	x[index] = star.x;
+	y[index] = star.y;
+	z[index] = star.z;
+	size[index] = star.size;
+	fadeIn[index] = star.fadeIn;
+	xp[index] = star.xp;
+	yp[index] = star.yp;
+	viewSize[index] = star.viewSize;
+	fade[index] = star.fade;
+}
+
+// Copy range of stars from other pool, e.g. when pool is allocated again
+// from - source pool, its streaks arrays are copied only if both pools keep them
+// fromIndex, toIndex - first star in source and in this pool
+// count - number of stars
+void StarPool::Copy( const StarPool& from, int fromIndex, int toIndex, int count )
+{
+	size_t fp = count * sizeof(FP_TYPE);
+	memcpy(x + toIndex, from.x + fromIndex, fp);
+	memcpy(y + toIndex, from.y + fromIndex, fp);
+	memcpy(z + toIndex, from.z + fromIndex, fp);
+	memcpy(size + toIndex, from.size + fromIndex, fp);
+	memcpy(fadeIn + toIndex, from.fadeIn + fromIndex, count * sizeof(int));
+	memcpy(xp + toIndex, from.xp + fromIndex, fp);
+	memcpy(yp + toIndex, from.yp + fromIndex, fp);
+	memcpy(viewSize + toIndex, from.viewSize + fromIndex, fp);
+	memcpy(fade + toIndex, from.fade + fromIndex, fp);
+	memcpy(color + toIndex, from.color + fromIndex, count);
+	memcpy(state + toIndex, from.state + fromIndex, count * sizeof(StarState));
+	if (NULL != xpPrev && NULL != from.xpPrev)
+	{
+		memcpy(xpPrev + toIndex, from.xpPrev + fromIndex, fp);
+		memcpy(ypPrev + toIndex, from.ypPrev + fromIndex, fp);
+	}
+}
+
+// Circle cache constructor
+CircleCache::CircleCache()
+{
+	sprites = NULL;
+	spans = NULL;
+}
+
+CircleCache::~CircleCache()
+{
+	Free();
+}
+
+// Calculate all sprites
+// Return Value: true on success
+bool CircleCache::Build()
+{
+	static const int radii = MaxRadius * RadiusSteps;
+	static const int count = radii * OffsetSteps * OffsetSteps;
+	if (NULL != sprites)
+		return true;
+
+	sprites = new Sprite[count];
+	spans = new INT8[count * MaxRows * 2];
+	for (int ri = 0; ri < radii; ri++)
+	for (int qy = 0; qy < OffsetSteps; qy++)
+	for (int qx = 0; qx < OffsetSteps; qx++)
+	{
+		// Circle with center and radius in the middle of quantization step
+		double radius = (ri + 0.5) / RadiusSteps;
+		double cx = (qx + 0.5) / OffsetSteps;
+		double cy = (qy + 0.5) / OffsetSteps;
+		int index = (ri * OffsetSteps + qy) * OffsetSteps + qx;
+		Sprite& sprite = sprites[index];
+		INT8* span = spans + index * MaxRows * 2;
+		sprite.top = 0;
+		sprite.rows = 0;
+		sprite.spans = span;
+		for (int j = (int)floor(cy - radius); j <= (int)ceil(cy + radius); j++)
+		{
+			double lim2 = radius*radius - (j - cy)*(j - cy);
+			if (0 > lim2)
+				continue;
+			int left = (int)ceil(cx - sqrt(lim2));
+			int right = (int)floor(cx + sqrt(lim2));
+			if (left > right)
+				continue;
+			if (0 == sprite.rows)
+				sprite.top = j;
+			span[2*(j - sprite.top)] = (INT8)left;
+			span[2*(j - sprite.top) + 1] = (INT8)right;
+			sprite.rows = j - sprite.top + 1;
+		}
+	}
+	return true;
+}
+
+void CircleCache::Free()
+{
+	delete[] sprites;
+	delete[] spans;
+	sprites = NULL;
+	spans = NULL;
+}
+
+// Find sprite for circle
+// viewSize - radius on screen
+// xp,yp - center on screen
+// Return Value: sprite or NULL if cache is not built or circle is too large
+const CircleCache::Sprite* CircleCache::Find( FP_TYPE viewSize, FP_TYPE xp, FP_TYPE yp ) const
+{
+	if (NULL == sprites || (FP_TYPE)MaxRadius <= viewSize)
+		return NULL;
+	int ri = (int)(viewSize * RadiusSteps);
+	int qx = min((int)((xp - floor(xp)) * OffsetSteps), OffsetSteps - 1); // Could be 1.0 for tiny negative xp due to rounding
+	int qy = min((int)((yp - floor(yp)) * OffsetSteps), OffsetSteps - 1);
+	return sprites + (ri * OffsetSteps + qy) * OffsetSteps + qx;
+}
+
+// Index list constructor
+IndexList::IndexList()
+{
+	data = NULL;
+	count = 0;
+	capacity = 0;
+}
+
+IndexList::~IndexList()
+{
+	delete[] data;
+}
+
+// Double capacity of list keeping its content
+void IndexList::Grow()
+{
+	int newCapacity = (0 == capacity) ? 256 : capacity * 2;
+	int* newData = new int[newCapacity];
+	if (0 < count)
+		memcpy(newData, data, count * sizeof(int));
+	delete[] data;
+	data = newData;
+	capacity = newCapacity;
+}
+
+// Worker pool constructor
+WorkerPool::WorkerPool()
+{
+	workers = NULL;
+	threadCount = 0;
+	done = NULL;
+	nextTask = 0;
+	pending = 0;
+	quit = 0;
+	job = NULL;
+	context = NULL;
+	tasks = 0;
+}
+
+WorkerPool::~WorkerPool()
+{
+	Stop();
+}
+
+// Start worker threads
+// threads - number of additional threads, 0 - all tasks are executed by calling thread
+// Return Value: true on success
+bool WorkerPool::Start( int threads )
+{
+	Stop();
+	if (0 >= threads)
+		return true;
+
+	done = CreateEvent(NULL, FALSE, FALSE, NULL);
+	if (NULL == done)
+		return false;
+
+	quit = 0;
+	workers = new Worker[threads];
+	for (int i = 0; i < threads; i++)
+	{
+		workers[i].pool = this;
+		workers[i].start = CreateEvent(NULL, FALSE, FALSE, NULL);
+		workers[i].thread = (NULL != workers[i].start) ? CreateThread(NULL, 0, ThreadProc, &workers[i], 0, NULL) : NULL;
+		if (NULL == workers[i].thread)
+		{
+			if (NULL != workers[i].start)
+				CloseHandle(workers[i].start);
+			break;
+		}
+		threadCount++;
+	}
+	return true; // Possibly with less threads than requested
+}
+
+// Stop and free all worker threads
+void WorkerPool::Stop()
+{
+	InterlockedExchange(&quit, 1);
+	for (int i = 0; i < threadCount; i++)
+		SetEvent(workers[i].start);
+	for (int i = 0; i < threadCount; i++)
+	{
+		WaitForSingleObject(workers[i].thread, INFINITE);
+		CloseHandle(workers[i].thread);
+		CloseHandle(workers[i].start);
+	}
+	delete[] workers;
+	workers = NULL;
+	threadCount = 0;
+	if (NULL != done)
+		CloseHandle(done);
+	done = NULL;
+}
+
+// Execute job for tasks [0, tasks) on all threads, returns when all tasks are done
+// Tasks are taken by threads one by one, so their execution order is not defined
+void WorkerPool::Run( WorkerJob job, void* context, int tasks )
+{
+	this->job = job;
+	this->context = context;
+	this->tasks = tasks;
+	nextTask = 0;
+	if (0 == threadCount)
+	{
+		Work();
+		return;
+	}
+
+	pending = threadCount;
+	for (int i = 0; i < threadCount; i++)
+		SetEvent(workers[i].start);
+	Work(); // Calling thread also works
+	WaitForSingleObject(done, INFINITE);
+}
+
+// Execute tasks of current job until all are taken
+void WorkerPool::Work()
+{
+	while (true)
+	{
+		LONG task = InterlockedIncrement(&nextTask) - 1;
+		if (task >= tasks)
+			break;
+		job(context, task);
+	}
+}
+
+// Worker thread function
+// parameter - pointer to Worker
+DWORD WINAPI WorkerPool::ThreadProc( LPVOID parameter )
+{
+	Worker* worker = (Worker*)parameter;
+	WorkerPool* pool = worker->pool;
+	while (true)
+	{
+		WaitForSingleObject(worker->start, INFINITE);
+		if (0 != pool->quit)
+			break;
+		pool->Work();
+		if (0 == InterlockedDecrement(&pool->pending))
+			SetEvent(pool->done);
+	}
+	return 0;
+}
+
+// GDI presenter constructor
+GdiPresenter::GdiPresenter()
+{
+	targetWindow = NULL;
+	frameWidth = 0;
+	frameHeight = 0;
+	memBitmap = NULL;
+	origBitmap = NULL;
+	memDc = NULL;
+	buffer = NULL;
+}
+
+GdiPresenter::~GdiPresenter()
+{
+	Destroy();
+}
+
+// Create DIB section for frame and select it into memory DC
+// window - window to present to
+// width, height - frame size
+// Return Value: true on success
+bool GdiPresenter::Initialize( HWND window, int width, int height )
+{
+	Destroy();
+	targetWindow = window;
+	frameWidth = width;
+	frameHeight = height;
+
+	HDC Dc = GetDC(window);
+	if (NULL == Dc)
+		return false;
+
+	bool Result = false;
+	do
+	{
+		memDc = CreateCompatibleDC(Dc);
+		if (NULL == memDc)
+			break;
+
+		// Based on https://stackoverflow.com/questions/10036527/render-buffer-on-screen-in-windows
+		BITMAPINFO bmi;
+		memset(&bmi, 0, sizeof(bmi));
+		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
+		bmi.bmiHeader.biWidth = width;
+		bmi.bmiHeader.biHeight = -height; // Top-down rows
+		bmi.bmiHeader.biPlanes = 1;
+		bmi.bmiHeader.biBitCount = 32;
+		bmi.bmiHeader.biCompression = BI_RGB;
+
+		memBitmap = CreateDIBSection(Dc, &bmi, DIB_RGB_COLORS, (void **)&buffer, 0, 0);
+		if (NULL == buffer || NULL == memBitmap)
+			break;
+
+		origBitmap = (HBITMAP)SelectObject(memDc, memBitmap);
+		if (NULL == origBitmap)
+			break;
+
+		Result = true;
+	} while (false);
+
+	ReleaseDC(window, Dc);
+	return Result;
+}
+
+// Restore and free GDI objects
+void GdiPresenter::Destroy()
+{
+	if (NULL != origBitmap)
+		SelectObject(memDc, origBitmap);
+	if (NULL != memBitmap)
+		DeleteObject(memBitmap);
+	if (NULL != memDc)
+		DeleteDC(memDc);
+	memBitmap = NULL;
+	origBitmap = NULL;
+	memDc = NULL;
+	buffer = NULL;
+}
+
+// Copy frame to window
+// windowWidth, windowHeight - current size of window client area
+// Return Value: true on success
+bool GdiPresenter::Present( int windowWidth, int windowHeight )
+{
+	HDC Dc = GetDC(targetWindow);
+	if (NULL == Dc)
+		return false;
+
+	BOOL Result = BitBlt(
+		Dc,
+		0, 0,
+		min(frameWidth, windowWidth),   // Just in case window size changed for some reason
+		min(frameHeight, windowHeight),
+		memDc,
+		0, 0,
+		SRCCOPY);
+
+	ReleaseDC(targetWindow, Dc);
+	return FALSE != Result;
+}
+
+MemoryPresenter::MemoryPresenter()
+{
+	buffer = NULL;
+	pitch = 0;
+}
+
+MemoryPresenter::~MemoryPresenter()
+{
+	Destroy();
+}
+
+// Allocate cleared frame
+// window - not used
+// width, height - frame size
+// Return Value: true on success
+bool MemoryPresenter::Initialize( HWND window, int width, int height )
+{
+	Destroy();
+	pitch = width * 4; // Packed rows, so whole frame could be hashed at once
+	buffer = (UINT8*)_aligned_malloc(pitch * height, 64);
+	if (NULL == buffer)
+		return false;
+	memset(buffer, 0, pitch * height);
+	return true;
+}
+
+// Free frame
+void MemoryPresenter::Destroy()
+{
+	_aligned_free(buffer);
+	buffer = NULL;
+}
+
+#ifdef STARFLY2_D3D11
+// Release COM interface and clear pointer
+template <class T> void SafeRelease( T*& object )
+{
+	if (NULL != object)
+		object->Release();
+	object = NULL;
+}
+
+// Direct3D 11 presenter constructor
+D3D11Presenter::D3D11Presenter()
+{
+	library = NULL;
+	device = NULL;
+	context = NULL;
+	swapChain = NULL;
+	backBuffer = NULL;
+	upload = NULL;
+	frameWidth = 0;
+	frameHeight = 0;
+	pitch = 0;
+	buffer = NULL;
+	mapped = false;
+}
+
+D3D11Presenter::~D3D11Presenter()
+{
+	Destroy();
+}
+
+// Create device, flip-model swap chain of frame size, upload texture and DIB section of same pitch
+// window - window to present to
+// width, height - frame size
+// Return Value: false if Direct3D 11 or DXGI 1.2 is not available (before Windows 8) or failed
+bool D3D11Presenter::Initialize( HWND window, int width, int height )
+{
+	Destroy();
+	frameWidth = width;
+	frameHeight = height;
+
+	bool Result = false;
+	IDXGIDevice* dxgiDevice = NULL;
+	IDXGIAdapter* adapter = NULL;
+	IDXGIFactory2* factory = NULL;
+	do
+	{
+		// Loaded dynamically, so screensaver still starts on systems without Direct3D 11
+		library = LoadLibrary("d3d11.dll");
+		if (NULL == library)
+			break;
+		PFN_D3D11_CREATE_DEVICE createDevice = (PFN_D3D11_CREATE_DEVICE)GetProcAddress(library, "D3D11CreateDevice");
+		if (NULL == createDevice)
+			break;
+
+		static const D3D_FEATURE_LEVEL levels[] = { D3D_FEATURE_LEVEL_11_0, D3D_FEATURE_LEVEL_10_1, D3D_FEATURE_LEVEL_10_0 };
+		if (FAILED(createDevice(NULL, D3D_DRIVER_TYPE_HARDWARE, NULL, D3D11_CREATE_DEVICE_BGRA_SUPPORT,
+			levels, sizeof(levels) / sizeof(levels[0]), D3D11_SDK_VERSION, &device, NULL, &context)))
+			break;
+
+		// Factory which created device
+		if (FAILED(device->QueryInterface(__uuidof(IDXGIDevice), (void**)&dxgiDevice)))
+			break;
+		if (FAILED(dxgiDevice->GetAdapter(&adapter)))
+			break;
+		if (FAILED(adapter->GetParent(__uuidof(IDXGIFactory2), (void**)&factory)))
+			break; // No DXGI 1.2
+
+		DXGI_SWAP_CHAIN_DESC1 desc;
+		memset(&desc, 0, sizeof(desc));
+		desc.Width = width;
+		desc.Height = height;
+		desc.Format = DXGI_FORMAT_B8G8R8A8_UNORM; // Same layout as DIB section
+		desc.SampleDesc.Count = 1;
+		desc.BufferUsage = DXGI_USAGE_RENDER_TARGET_OUTPUT;
+		desc.BufferCount = 2;
+		desc.Scaling = DXGI_SCALING_STRETCH; // If window size changed
+		desc.SwapEffect = DXGI_SWAP_EFFECT_FLIP_SEQUENTIAL;
+		desc.AlphaMode = DXGI_ALPHA_MODE_IGNORE;
+		if (FAILED(factory->CreateSwapChainForHwnd(device, window, &desc, NULL, NULL, &swapChain)))
+			break;
+		factory->MakeWindowAssociation(window, DXGI_MWA_NO_ALT_ENTER);
+
+		// With flip model buffer 0 always refers to current back buffer
+		if (FAILED(swapChain->GetBuffer(0, __uuidof(ID3D11Texture2D), (void**)&backBuffer)))
+			break;
+
+		D3D11_TEXTURE2D_DESC texture;
+		memset(&texture, 0, sizeof(texture));
+		texture.Width = width;
+		texture.Height = height;
+		texture.MipLevels = 1;
+		texture.ArraySize = 1;
+		texture.Format = DXGI_FORMAT_B8G8R8A8_UNORM;
+		texture.SampleDesc.Count = 1;
+		texture.Usage = D3D11_USAGE_STAGING; // Unlike dynamic one keeps contents, so only touched pixels are cleared
+		texture.CPUAccessFlags = D3D11_CPU_ACCESS_READ | D3D11_CPU_ACCESS_WRITE;
+		if (FAILED(device->CreateTexture2D(&texture, NULL, &upload)))
+			break;
+
+		// Pitch is known from map, buffers of pixels are allocated by it
+		D3D11_MAPPED_SUBRESOURCE map;
+		if (FAILED(context->Map(upload, 0, D3D11_MAP_WRITE, 0, &map)))
+			break;
+		pitch = (int)map.RowPitch;
+		memset(map.pData, 0, pitch * height);
+		context->Unmap(upload, 0);
+
+		// Columns beyond width are not shown
+		if (0 != pitch % 4 || !frame.Initialize(window, pitch / 4, height))
+			break;
+		memset(frame.Buffer(), 0, pitch * height);
+
+		Result = true;
+	} while (false);
+
+	SafeRelease(factory);
+	SafeRelease(adapter);
+	SafeRelease(dxgiDevice);
+	if (!Result)
+		Destroy();
+	return Result;
+}
+
+// Release Direct3D objects and frame
+void D3D11Presenter::Destroy()
+{
+	if (mapped)
+		context->Unmap(upload, 0); // Frame was abandoned
+	mapped = false;
+	buffer = NULL;
+	if (NULL != context)
+		context->ClearState();
+	SafeRelease(upload);
+	SafeRelease(backBuffer);
+	SafeRelease(swapChain);
+	SafeRelease(context);
+	SafeRelease(device);
+	if (NULL != library)
+		FreeLibrary(library);
+	library = NULL;
+	frame.Destroy();
+}
+
+// Map upload texture as frame, or take DIB section if GDI prints on frame
+// Map waits until copy of previous frame is done by GPU
+// gdi - GDI will print on frame
+// Return Value: false if device is lost or pitch of texture changed
+bool D3D11Presenter::BeginFrame( bool gdi )
+{
+	if (gdi)
+	{	// Uploaded by Present
+		if (mapped)
+			context->Unmap(upload, 0);
+		mapped = false;
+		buffer = frame.Buffer();
+		return true;
+	}
+	if (mapped)
+		return true; // Previous frame was not presented
+	D3D11_MAPPED_SUBRESOURCE map;
+	if (FAILED(context->Map(upload, 0, D3D11_MAP_READ_WRITE, 0, &map)))
+		return false;
+	mapped = true;
+	buffer = (UINT8*)map.pData;
+	return (int)map.RowPitch == pitch;
+}
+
+// Unmap or upload frame and present it on next vertical blank
+// windowWidth, windowHeight - not used, swap chain stretches frame to window
+// Return Value: false if device is lost
+bool D3D11Presenter::Present( int windowWidth, int windowHeight )
+{
+	if (!mapped)
+	{	// Frame in DIB section, same pitch
+		D3D11_MAPPED_SUBRESOURCE map;
+		if (FAILED(context->Map(upload, 0, D3D11_MAP_WRITE, 0, &map)) || (int)map.RowPitch != pitch)
+			return false;
+		memcpy(map.pData, frame.Buffer(), pitch * frameHeight);
+	}
+	context->Unmap(upload, 0);
+	mapped = false;
+
+	context->CopyResource(backBuffer, upload);
+	return Flip();
+}
+
+// Present back buffer on next vertical blank, frame is not uploaded
+// Return Value: false if device is lost
+bool D3D11Presenter::Flip()
+{
+	return SUCCEEDED(swapChain->Present(1, 0)); // DXGI_STATUS_OCCLUDED is success too
+}
+
+// Shaders of GPU star render, compiled at start
+// Vertex shader repeats Star::Project, pixel shader - circle check of StarFly2::CircleSpan
+static const char GpuStarShader[] =
+	"cbuffer Frame : register(b0)\n"
+	"{\n"
+	"	float4 screen; // ScreenWidth, ScreenHeight, CenterX*ScreenWidth, CenterY*ScreenHeight\n"
+	"	float4 view;   // ScreenScale, distance passed modulo DepthWrap, FadePower, FadeInK\n"
+	"	int4 time;     // Total time in ms\n"
+	"};\n"
+	"static const float DepthWrap = 65536.0;\n"
+	"static const float MinSize = 0.8;\n"
+	"struct Star\n"
+	"{\n"
+	"	float4 pos : POSITION;  // x, y, absolute z, size\n"
+	"	int fadeInEnd : FADEIN;\n"
+	"	uint4 color : COLOR;\n"
+	"};\n"
+	"struct Pixel\n"
+	"{\n"
+	"	float4 pos : SV_Position;\n"
+	"	nointerpolation float4 circle : CIRCLE; // xp, yp, squared radius, 1 - circle or 0 - single point\n"
+	"	nointerpolation float4 color : COLOR;\n"
+	"};\n"
+	"Pixel VS(Star star, uint vertex : SV_VertexID)\n"
+	"{\n"
+	"	Pixel o;\n"
+	"	o.pos = float4(0, 0, -1, 1); // Outside of view volume - not drawn\n"
+	"	o.circle = 0;\n"
+	"	o.color = 0;\n"
+	"	float z = star.pos.z - view.y;\n"
+	"	z -= DepthWrap * floor(z / DepthWrap + 0.5); // Real depth is in [-DepthWrap/2, DepthWrap/2)\n"
+	"	if (0 >= z)\n"
+	"		return o;\n"
+	"	float3 p3 = float3(star.pos.xy, z);\n"
+	"	float viewSize = star.pos.w / sqrt(dot(p3, p3));\n"
+	"	float size1 = floor(viewSize);\n"
+	"	float2 p = screen.zw + star.pos.xy * (view.x / z);\n"
+	"	if (any(p < -size1) || any(p >= screen.xy + size1))\n"
+	"		return o; // Respawn is done by CPU later\n"
+	"	float fade = (1 > viewSize) ? pow(viewSize, view.z) : 1;\n"
+	"	int fadeIn = star.fadeInEnd - time.x;\n"
+	"	if (0 < fadeIn)\n"
+	"	{\n"
+	"		float k2 = 1 - fadeIn * view.w;\n"
+	"		if (1 < viewSize)\n"
+	"		{\n"
+	"			viewSize *= k2;\n"
+	"			fade = min(viewSize, 1);\n"
+	"		}\n"
+	"		else\n"
+	"		{\n"
+	"			viewSize *= k2;\n"
+	"			fade *= k2;\n"
+	"		}\n"
+	"	}\n"
+	"	float2 from, to; // Pixels rectangle, rows are top-down as in frame of CPU render\n"
+	"	if (MinSize < viewSize)\n"
+	"	{\n"
+	"		float r = max(1, floor(viewSize));\n"
+	"		from = trunc(p) - r;\n"
+	"		to = trunc(p) + r + 2;\n"
+	"		o.circle = float4(p, viewSize * viewSize, 1);\n"
+	"	}\n"
+	"	else\n"
+	"	{\n"
+	"		from = trunc(p);\n"
+	"		to = from + 1;\n"
+	"	}\n"
+	"	float2 pixel = lerp(from, to, float2(vertex & 1, vertex >> 1));\n"
+	"	o.pos = float4(pixel.x / screen.x * 2 - 1, 1 - pixel.y / screen.y * 2, floor(z) / 65535.0, 1); // Depth is the same as in zBuffer\n"
+	"	o.color = float4(floor(star.color.rgb * fade) / 255.0, 1);\n"
+	"	return o;\n"
+	"}\n"
+	"float4 PS(Pixel p) : SV_Target\n"
+	"{\n"
+	"	if (0 < p.circle.w)\n"
+	"	{\n"
+	"		float2 d = floor(p.pos.xy) - p.circle.xy;\n"
+	"		if (d.x * d.x + d.y * d.y > p.circle.z)\n"
+	"			discard;\n"
+	"	}\n"
+	"	return p.color;\n"
+	"}\n";
+
+// GPU star render constructor
+GpuStarRenderer::GpuStarRenderer()
+{
+	compiler = NULL;
+	context = NULL;
+	vertexShader = NULL;
+	pixelShader = NULL;
+	layout = NULL;
+	instances = NULL;
+	constants = NULL;
+	depth = NULL;
+	depthView = NULL;
+	depthState = NULL;
+	rasterizer = NULL;
+	target = NULL;
+	frameWidth = 0;
+	frameHeight = 0;
+	starCount = 0;
+}
+
+GpuStarRenderer::~GpuStarRenderer()
+{
+	Destroy();
+}
+
+// Compile shader from GpuStarShader
+// compile - D3DCompile function
+// entry - function name
+// profile - shader model
+// Return Value: compiled shader or NULL on failure
+ID3DBlob* GpuStarRenderer::Compile( pD3DCompile compile, const char* entry, const char* profile )
+{
+	ID3DBlob* code = NULL;
+	ID3DBlob* errors = NULL;
+	HRESULT hr = compile(GpuStarShader, sizeof(GpuStarShader) - 1, "StarFly2", NULL, NULL, entry, profile,
+		D3DCOMPILE_OPTIMIZATION_LEVEL3, 0, &code, &errors);
+#ifdef _DEBUG
+	if (NULL != errors)
+		OutputDebugString((const char*)errors->GetBufferPointer());
+#endif
+	SafeRelease(errors);
+	if (FAILED(hr))
+		SafeRelease(code);
+	return code;
+}
+
+// Compile shaders and create buffers for given number of stars
+// presenter - Direct3D 11 presenter, its device is used and it should live longer
+// width, height - frame size
+// stars - number of stars
+// Return Value: false if shader compiler is not available or Direct3D failed
+bool GpuStarRenderer::Initialize( D3D11Presenter* presenter, int width, int height, int stars )
+{
+	Destroy();
+	frameWidth = width;
+	frameHeight = height;
+	starCount = stars;
+	context = presenter->Context();
+	ID3D11Device* device = presenter->Device();
+
+	bool Result = false;
+	ID3DBlob* vertexCode = NULL;
+	ID3DBlob* pixelCode = NULL;
+	do
+	{
+		// Compiler is part of Windows since 8.1, so it is loaded dynamically as Direct3D itself
+		compiler = LoadLibrary("d3dcompiler_47.dll");
+		if (NULL == compiler)
+			break;
+		pD3DCompile compile = (pD3DCompile)GetProcAddress(compiler, "D3DCompile");
+		if (NULL == compile)
+			break;
+
+		vertexCode = Compile(compile, "VS", "vs_4_0");
+		pixelCode = Compile(compile, "PS", "ps_4_0");
+		if (NULL == vertexCode || NULL == pixelCode)
+			break;
+		if (FAILED(device->CreateVertexShader(vertexCode->GetBufferPointer(), vertexCode->GetBufferSize(), NULL, &vertexShader)))
+			break;
+		if (FAILED(device->CreatePixelShader(pixelCode->GetBufferPointer(), pixelCode->GetBufferSize(), NULL, &pixelShader)))
+			break;
+
+		// Stars are instance data, vertices of quad are taken from SV_VertexID
+		static const D3D11_INPUT_ELEMENT_DESC elements[] =
+		{
+			{ "POSITION", 0, DXGI_FORMAT_R32G32B32A32_FLOAT, 0, 0,  D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+			{ "FADEIN",   0, DXGI_FORMAT_R32_SINT,           0, 16, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+			{ "COLOR",    0, DXGI_FORMAT_R8G8B8A8_UINT,      0, 20, D3D11_INPUT_PER_INSTANCE_DATA, 1 },
+		};
+		if (FAILED(device->CreateInputLayout(elements, sizeof(elements) / sizeof(elements[0]),
+			vertexCode->GetBufferPointer(), vertexCode->GetBufferSize(), &layout)))
+			break;
+
+		// Dynamic, so respawned stars are written in place without copy of whole buffer
+		D3D11_BUFFER_DESC buffer;
+		memset(&buffer, 0, sizeof(buffer));
+		buffer.ByteWidth = sizeof(GpuStar) * stars;
+		buffer.Usage = D3D11_USAGE_DYNAMIC;
+		buffer.BindFlags = D3D11_BIND_VERTEX_BUFFER;
+		buffer.CPUAccessFlags = D3D11_CPU_ACCESS_WRITE;
+		if (FAILED(device->CreateBuffer(&buffer, NULL, &instances)))
+			break;
+		buffer.ByteWidth = sizeof(GpuFrame);
+		buffer.BindFlags = D3D11_BIND_CONSTANT_BUFFER;
+		if (FAILED(device->CreateBuffer(&buffer, NULL, &constants)))
+			break;
+
+		D3D11_TEXTURE2D_DESC texture;
+		memset(&texture, 0, sizeof(texture));
+		texture.Width = width;
+		texture.Height = height;
+		texture.MipLevels = 1;
+		texture.ArraySize = 1;
+		texture.Format = DXGI_FORMAT_D16_UNORM; // Integer depth as zBuffer
+		texture.SampleDesc.Count = 1;
+		texture.Usage = D3D11_USAGE_DEFAULT;
+		texture.BindFlags = D3D11_BIND_DEPTH_STENCIL;
+		if (FAILED(device->CreateTexture2D(&texture, NULL, &depth)))
+			break;
+		if (FAILED(device->CreateDepthStencilView(depth, NULL, &depthView)))
+			break;
+		if (FAILED(device->CreateRenderTargetView(presenter->BackBuffer(), NULL, &target)))
+			break;
+
+		D3D11_DEPTH_STENCIL_DESC depthDesc;
+		memset(&depthDesc, 0, sizeof(depthDesc));
+		depthDesc.DepthEnable = TRUE;
+		depthDesc.DepthWriteMask = D3D11_DEPTH_WRITE_MASK_ALL;
+		depthDesc.DepthFunc = D3D11_COMPARISON_LESS_EQUAL; // Later star wins on equal depth, as in PutPixelOnBufferZ
+		if (FAILED(device->CreateDepthStencilState(&depthDesc, &depthState)))
+			break;
+
+		D3D11_RASTERIZER_DESC rasterDesc;
+		memset(&rasterDesc, 0, sizeof(rasterDesc));
+		rasterDesc.FillMode = D3D11_FILL_SOLID;
+		rasterDesc.CullMode = D3D11_CULL_NONE;
+		rasterDesc.DepthClipEnable = TRUE;
+		if (FAILED(device->CreateRasterizerState(&rasterDesc, &rasterizer)))
+			break;
+
+		Result = true;
+	} while (false);
+
+	SafeRelease(vertexCode);
+	SafeRelease(pixelCode);
+	if (!Result)
+		Destroy();
+	return Result;
+}
+
+// Release Direct3D objects
+void GpuStarRenderer::Destroy()
+{
+	SafeRelease(target);
+	SafeRelease(rasterizer);
+	SafeRelease(depthState);
+	SafeRelease(depthView);
+	SafeRelease(depth);
+	SafeRelease(constants);
+	SafeRelease(instances);
+	SafeRelease(layout);
+	SafeRelease(pixelShader);
+	SafeRelease(vertexShader);
+	if (NULL != compiler)
+		FreeLibrary(compiler);
+	compiler = NULL;
+	context = NULL;
+}
+
+// Map stars for writing
+// discard - previous content is lost, all stars should be written; otherwise only changed stars could be written
+// Return Value: array of stars or NULL on failure
+GpuStar* GpuStarRenderer::MapStars( bool discard )
+{
+	// Without discard GPU could still read previous frame, but only stars out of view are rewritten and new ones start fully faded
+	D3D11_MAPPED_SUBRESOURCE mapped;
+	if (FAILED(context->Map(instances, 0, discard ? D3D11_MAP_WRITE_DISCARD : D3D11_MAP_WRITE_NO_OVERWRITE, 0, &mapped)))
+		return NULL;
+	return (GpuStar*)mapped.pData;
+}
+
+// Finish writing of stars
+void GpuStarRenderer::UnmapStars()
+{
+	context->Unmap(instances, 0);
+}
+
+// Clear back buffer and draw all stars
+// frame - parameters of frame
+// Return Value: true on success
+bool GpuStarRenderer::Render( const GpuFrame& frame )
+{
+	D3D11_MAPPED_SUBRESOURCE mapped;
+	if (FAILED(context->Map(constants, 0, D3D11_MAP_WRITE_DISCARD, 0, &mapped)))
+		return false;
+	memcpy(mapped.pData, &frame, sizeof(frame));
+	context->Unmap(constants, 0);
+
+	static const FLOAT black[4] = { 0, 0, 0, 0 };
+	context->ClearRenderTargetView(target, black);
+	context->ClearDepthStencilView(depthView, D3D11_CLEAR_DEPTH, 1.0f, 0);
+
+	// Flip model unbinds back buffer after Present, so all state is set each frame
+	D3D11_VIEWPORT viewport = { 0, 0, (FLOAT)frameWidth, (FLOAT)frameHeight, 0, 1 };
+	UINT stride = sizeof(GpuStar);
+	UINT offset = 0;
+	context->OMSetRenderTargets(1, &target, depthView);
+	context->OMSetDepthStencilState(depthState, 0);
+	context->RSSetViewports(1, &viewport);
+	context->RSSetState(rasterizer);
+	context->IASetInputLayout(layout);
+	context->IASetVertexBuffers(0, 1, &instances, &stride, &offset);
+	context->IASetPrimitiveTopology(D3D11_PRIMITIVE_TOPOLOGY_TRIANGLESTRIP);
+	context->VSSetShader(vertexShader, NULL, 0);
+	context->VSSetConstantBuffers(0, 1, &constants);
+	context->PSSetShader(pixelShader, NULL, 0);
+	context->PSSetConstantBuffers(0, 1, &constants);
+	context->DrawInstanced(4, starCount, 0, 0); // Quad per star
+	return true;
+}
+#endif
+
+// Add counters of other band
+void FrameCounters::Add( const FrameCounters& other )
+{
+	pixels += other.pixels;
+	zRejects += other.zRejects;
+	circles += other.circles;
+	points += other.points;
+	clearTicks += other.clearTicks;
+}
+
+// Profiler constructor
+FrameProfiler::FrameProfiler()
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency); // Always succeeds since Windows XP
+	msPerTick = 1000.0 / (double)frequency.QuadPart;
+	enabled = false;
+	frameStart = 0;
+	memset(ticks, 0, sizeof(ticks));
+	memset(ms, 0, sizeof(ms));
+	lastStars = 0;
+	lastRespawns = 0;
+	skippedFrames = 0;
+	lastCounters.Clear();
+	historyCount = 0;
+	historyNext = 0;
+	p50 = 0;
+	p99 = 0;
+	frames = 0;
+	csvPath[0] = 0;
+	csv = NULL;
+	csvFailed = false;
+}
+
+FrameProfiler::~FrameProfiler()
+{
+	Close();
+}
+
+// Set file for per-frame trace, it is created on first collected frame
+// path - name of CSV file, empty - no trace
+void FrameProfiler::SetCsv( const char* path )
+{
+	Close();
+	strncpy_s(csvPath, sizeof(csvPath), path, _TRUNCATE);
+	csvFailed = false;
+}
+
+// Close CSV trace
+void FrameProfiler::Close()
+{
+	if (NULL != csv)
+		fclose(csv);
+	csv = NULL;
+}
+
+// Start measuring of new frame
+void FrameProfiler::BeginFrame()
+{
+	memset(ticks, 0, sizeof(ticks));
+	frameStart = Now();
+}
+
+// Order of doubles for qsort
+static int CompareMs( const void* a, const void* b )
+{
+	double d = *(const double*)a - *(const double*)b;
+	return (0 > d) ? -1 : (0 < d) ? 1 : 0;
+}
+
+// Finish measuring of frame, update percentiles and write it to CSV
+// intervalMs - time passed since previous frame
+// stars - number of stars
+// respawns - stars regenerated in this frame
+// skipped - deadlines missed before this frame
+// counters - sum of counters of all bands
+void FrameProfiler::EndFrame( int intervalMs, int stars, int respawns, int skipped, const FrameCounters& counters )
+{
+	ticks[Phase_Total] = Now() - frameStart;
+	for (int phase = 0; phase < PhaseCount; phase++)
+		ms[phase] = Ms(ticks[phase]);
+	lastStars = stars;
+	lastRespawns = respawns;
+	lastCounters = counters;
+	skippedFrames += skipped;
+	frames++;
+
+	// Percentiles by nearest rank
+	history[historyNext] = ms[Phase_Total];
+	historyNext = (historyNext + 1) % History;
+	historyCount = min(historyCount + 1, History);
+	double sorted[History];
+	memcpy(sorted, history, historyCount * sizeof(double));
+	qsort(sorted, historyCount, sizeof(double), CompareMs);
+	p50 = sorted[(historyCount * 50 + 99) / 100 - 1];
+	p99 = sorted[(historyCount * 99 + 99) / 100 - 1];
+
+	if (0 == csvPath[0] || csvFailed)
+		return;
+	if (NULL == csv)
+	{
+		if (0 != fopen_s(&csv, csvPath, "wt") || NULL == csv)
+		{
+			csv = NULL;
+			csvFailed = true; // Do not retry each frame
+			return;
+		}
+		fprintf(csv, "frame,interval_ms,skipped,clear_ms,process_ms,raster_ms,present_ms,total_ms,stars,respawns,pixels,z_rejects,circles,points\n");
+	}
+	fprintf(csv, "%u,%d,%d,%.4f,%.4f,%.4f,%.4f,%.4f,%d,%d,%d,%d,%d,%d\n", frames, intervalMs, skipped,
+		ms[Phase_Clear], ms[Phase_Process], ms[Phase_Raster], ms[Phase_Present], ms[Phase_Total],
+		stars, respawns, counters.pixels, counters.zRejects, counters.circles, counters.points);
+}
+
+// Text of overlay line for last collected frame
+// line - index of line, [0, Lines)
+// text, size - receives zero-terminated text
+// Return Value: length of text
+int FrameProfiler::Line( int line, char* text, int size ) const
+{
+	int len1 = 0;
+	switch (line)
+	{
+	case 0:
+		len1 = sprintf_s(text, size, "frame %.2f ms  p50 %.2f  p99 %.2f  (last %i of %u, skipped %u)",
+			ms[Phase_Total], p50, p99, historyCount, frames, skippedFrames);
+		break;
+	case 1:
+		len1 = sprintf_s(text, size, "clear %.2f  process %.2f  raster %.2f  present %.2f",
+			ms[Phase_Clear], ms[Phase_Process], ms[Phase_Raster], ms[Phase_Present]);
+		break;
+	case 2:
+		len1 = sprintf_s(text, size, "stars %i  respawns %i  circles %i  points %i",
+			lastStars, lastRespawns, lastCounters.circles, lastCounters.points);
+		break;
+	case 3:
+		len1 = sprintf_s(text, size, "pixels %i  z-rejects %i", lastCounters.pixels, lastCounters.zRejects);
+		break;
+	}
+	return max(0, len1);
+}
+
+// Step log constructor
+StepLog::StepLog()
+{
+	path[0] = 0;
+	file = NULL;
+	failed = false;
+}
+
+StepLog::~StepLog()
+{
+	Close();
+}
+
+// Set file of log, it is created on first recorded frame
+// path - name of file, empty - no log
+void StepLog::SetPath( const char* path )
+{
+	Close();
+	strncpy_s(this->path, sizeof(this->path), path, _TRUNCATE);
+	failed = false;
+}
+
+// Close written log
+void StepLog::Close()
+{
+	if (NULL != file)
+		fclose(file);
+	file = NULL;
+}
+
+// Append step of frame, file is rewritten on first call
+// stepMs - time passed since previous frame
+void StepLog::Record( unsigned int stepMs )
+{
+	if (0 == path[0] || failed)
+		return;
+	if (NULL == file)
+	{
+		if (0 != fopen_s(&file, path, "wt") || NULL == file)
+		{	// Do not retry each frame
+			file = NULL;
+			failed = true;
+			return;
+		}
+	}
+	fprintf(file, "%u\n", stepMs);
+}
+
+// Read all steps of log, lines without number are skipped
+// steps - receives steps in ms, in order of frames
+// Return Value: false if file could not be opened
+bool StepLog::Load( IndexList& steps ) const
+{
+	FILE* input = NULL;
+	if (0 != fopen_s(&input, path, "rt") || NULL == input)
+		return false;
+	char line[64];
+	while (NULL != fgets(line, sizeof(line), input))
+	{
+		char* end;
+		long step = strtol(line, &end, 10);
+		if (end != line && 0 <= step)
+			steps.Push((int)step);
+	}
+	fclose(input);
+	return true;
+}
+
+// Scale packed color - red and blue by one integer multiply, green by another, no per-component conversions
+// color - 0x00RRGGBB, as pixel of frame
+// f - [0, 256], 256 - full color
+// Return Value: scaled color, components are truncated
+static inline UINT32 ScaleColor( UINT32 color, UINT32 f )
+{
+	return (((color & 0xFF00FF) * f >> 8) & 0xFF00FF) | (((color & 0x00FF00) * f >> 8) & 0x00FF00);
+}
+
+// Scale packed color by fade
+// color - 0x00RRGGBB, as pixel of frame
+// fade - [0.0, 1.0]
+// Return Value: faded color, fade is truncated to 1/256, components are truncated
+static inline UINT32 FadeColor( UINT32 color, FP_TYPE fade )
+{
+	UINT32 f = min((UINT32)(fade * 256), (UINT32)256); // 256 - full color
+	return ScaleColor(color, f);
+}
+
+// Add light to one pixel with saturation and tone map its sum into frame
+// Light up to ToneKnee levels is copied as is, higher one approaches 255: knee + rest * x / (x + rest)
+// offset - index of pixel
+// light - 4 channels in lower half
+inline void StarFly2::AddLight( int offset, __m128i light )
+{
+	const __m128 knee = _mm_set1_ps((float)ToneKnee);
+	const __m128 rest = _mm_set1_ps((float)(255 - ToneKnee));
+	__m128i* sum = (__m128i*)(lightBuffer + offset*4);
+	__m128i total = _mm_adds_epu16(_mm_loadl_epi64(sum), light);
+	_mm_storel_epi64(sum, total);
+
+	__m128 x = _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(total, _mm_setzero_si128())), _mm_set1_ps(1.0f / (1 << LightShift))); // Levels
+	__m128 y = _mm_sub_ps(x, knee);
+	__m128 shoulder = _mm_add_ps(knee, _mm_div_ps(_mm_mul_ps(rest, y), _mm_add_ps(y, rest)));
+	__m128 linear = _mm_cmple_ps(x, knee);
+	__m128i level = _mm_cvttps_epi32(_mm_or_ps(_mm_and_ps(linear, x), _mm_andnot_ps(linear, shoulder)));
+	level = _mm_packs_epi32(level, level);
+	((UINT32*)MemBuffer)[offset] = (UINT32)_mm_cvtsi128_si32(_mm_packus_epi16(level, level));
+}
+
+// Render projected star to memory buffer
+// xp,yp - position on screen
+// viewSize - radius on screen
+// fade - fade of color (0.0 - black, 1.0 - color)
+// z - distance
+// color - entry of palette, packed as pixel of frame
+// rowFrom, rowTo - range of screen rows to draw, [0, ScreenHeight) for whole screen
+// dirty - receives spans of touched pixels (pairs of offset and length) to be cleared on next frame
+// counters - counters of band, circle is counted only by band of its first row
+// Raster - RasterKind of buffers of frame
+template <int Raster> void StarFly2::DrawStarAs(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, FP_TYPE fade, FP_TYPE z, UINT32 color, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters)
+{
+	UINT16 zp = (UINT16)z; // z-buffer value
+	UINT32 color0 = FadeColor(color, fade);
+	if (0 == color0)
+		return; // Black after fade - nothing to draw, does not hide other stars
+
+	if (Raster_Light == Raster)
+	{	// Additive light, circle always covers pixel nearest to its center, so there is no fall back to point
+		__m128i light = _mm_slli_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)color0), _mm_setzero_si128()), LightShift);
+		if (Star::minSize < viewSize)
+		{
+			AddCircle(xp, yp, viewSize, light, rowFrom, rowTo, dirty, counters);
+			return;
+		}
+		int xp1 = (int)xp;
+		int yp1 = (int)yp;
+		if (yp1 >= rowFrom && yp1 < rowTo && 0 <= xp1 && xp1 < ScreenWidth)
+		{
+			dirty.Push(xp1 + yp1*RowStride);
+			dirty.Push(1);
+			AddLight(xp1 + yp1*RowStride, light);
+			counters.pixels++;
+			counters.points++;
+		}
+		return;
+	}
+
+	if (Star::minSize < viewSize)
+	{
+#if 0 // Square
+		int size1 = ((FP_TYPE)1.0 < viewSize) ? (int)viewSize : 1;
+		int xp1 = (int)xp; // Integer coordinates
+		int yp1 = (int)yp;
+		for (int j = max(rowFrom,yp1-size1);j<min(yp1+size1,rowTo);j++)
+		for (int k = max(0,xp1-size1);k<min(xp1+size1,ScreenWidth);k++)
+			PutPixelOnBufferZ(k,j, color ,zp);
+		return;
+#endif
+
+		// Fine-grained circle with FP center, drawn by spans of rows
+		CircleShape circle;
+		PrepareCircle(xp, yp, viewSize, circle);
+		bool drawn = false;
+		int left, right;
+		int jFrom = max(rowFrom, circle.jFrom);
+		int jTo = min(rowTo, circle.jTo);
+		if (0 != rowFrom || ScreenHeight != rowTo)
+		{	// Only part of screen is drawn - check if circle has any pixel on whole screen, otherwise it is drawn as single point
+			// Row nearest to center is the widest one, so check it first
+			int jc = min(max(circle.jFrom, (int)floor(yp)), circle.jTo - 1);
+			drawn = (jc >= circle.jFrom) && (CircleSpan(circle, jc, left, right) ||
+				(jc + 1 < circle.jTo && CircleSpan(circle, jc + 1, left, right)));
+			for (int j = circle.jFrom; !drawn && j < circle.jTo; j++)
+				drawn = CircleSpan(circle, j, left, right);
+			if (!drawn)
+				jTo = jFrom; // Skip circle, go to single point
+		}
+		for (int j = jFrom; j < jTo; j++)
+		{
+			if (!CircleSpan(circle, j, left, right))
+				continue;
+			dirty.Push(left + j*RowStride);
+			dirty.Push(right - left + 1);
+			if (Raster_Order == Raster)
+			{	// Depth order - nearer stars are drawn later
+				FillSpan(j, left, right, color0);
+				counters.pixels += right - left + 1;
+			}
+			else
+			{
+				int written = FillSpanZ(j, left, right, color0, zp);
+				counters.pixels += written;
+				counters.zRejects += right - left + 1 - written;
+			}
+			drawn = true;
+		}
+		if (drawn)
+		{
+			if (rowFrom <= circle.jFrom && circle.jFrom < rowTo)
+				counters.circles++;
+			return;
+		}
+		// If no pixels were drawn - fall back to single point
+	}
+	// Single point
+	int xp1 = (int)xp;
+	int yp1 = (int)yp;
+	if (yp1 >= rowFrom && yp1 < rowTo && 0 <= xp1 && xp1 < ScreenWidth)
+	{
+		dirty.Push(xp1 + yp1*RowStride);
+		dirty.Push(1);
+		if (Raster_Order == Raster)
+		{
+			PutPixelOnBuffer(xp1,yp1,color0);
+			counters.pixels++;
+		}
+		else if (PutPixelOnBufferZ(xp1,yp1,color0,zp))
+			counters.pixels++;
+		else
+			counters.zRejects++;
+		counters.points++;
+	}
+}
+
+// Render star by mode of raster of current frame, for draws outside of RasterKernel
+// Parameters - as for DrawStarAs
+void StarFly2::DrawStar(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, FP_TYPE fade, FP_TYPE z, UINT32 color, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters)
+{
+	if (NULL != lightBuffer)
+		DrawStarAs<Raster_Light>(xp, yp, viewSize, fade, z, color, rowFrom, rowTo, dirty, counters);
+	else if (NULL == zBuffer)
+		DrawStarAs<Raster_Order>(xp, yp, viewSize, fade, z, color, rowFrom, rowTo, dirty, counters);
+	else
+		DrawStarAs<Raster_Z>(xp, yp, viewSize, fade, z, color, rowFrom, rowTo, dirty, counters);
+}
+
+// Render stars of pool, with trails if streaks are on
+// indices - indices of stars, NULL - stars are from and to themselves
+// from, to - range of indices
+// rowFrom, rowTo, dirty, counters - as for DrawStar
+// Raster - RasterKind of buffers of frame, Streaks - stars have trails
+template <int Raster, bool Streaks> void StarFly2::DrawPoolStars( const int* indices, int from, int to, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters )
+{
+	for (int k = from; k < to; k++)
+	{
+		int index = (NULL != indices) ? indices[k] : k;
+		UINT32 color = palette[stars.color[index]];
+		UINT32 color0 = FadeColor(color, stars.fade[index]);
+		if (0 == color0)
+			continue; // Black after fade, trail too
+		if (Streaks) // Trail is drawn first, so star covers its head
+			DrawStreak<Raster>(stars.xpPrev[index], stars.ypPrev[index], stars.xp[index], stars.yp[index],
+				color0, (UINT16)stars.z[index], rowFrom, rowTo, dirty, counters);
+		DrawStarAs<Raster>(stars.xp[index], stars.yp[index], stars.viewSize[index], stars.fade[index], stars.z[index],
+			color, rowFrom, rowTo, dirty, counters);
+	}
+}
+
+// Put pixel of trail without border checks, by mode of render (light, z-buffer or depth order)
+// offset - index of pixel
+// color - packed as pixel of frame
+// z - z-buffer value
+// dirty, counters - as for DrawStar
+// Raster - RasterKind of buffers of frame
+template <int Raster> inline void StarFly2::PutStreakPixel( int offset, UINT32 color, UINT16 z, IndexList& dirty, FrameCounters& counters )
+{
+	dirty.Push(offset);
+	dirty.Push(1);
+	if (Raster_Light == Raster)
+		AddLight(offset, _mm_slli_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128((int)color), _mm_setzero_si128()), LightShift));
+	else if (Raster_Order == Raster)
+		((UINT32*)MemBuffer)[offset] = color;
+	else if (zBuffer[offset] < z)
+	{	// Hidden by nearer star
+		counters.zRejects++;
+		return;
+	}
+	else
+	{
+		((UINT32*)MemBuffer)[offset] = color;
+		zBuffer[offset] = z;
+	}
+	counters.pixels++;
+}
+
+// Render trail of star, line 1 pixel wide from its position on previous frame to current one
+// Line is stepped by pixels of its major axis in fixed point 16.16, color grows from black at tail to full at head
+// Pixel of head is not drawn, it is covered by star itself
+// With additive light each step is split between two nearest pixels of minor axis (Xiaolin Wu), otherwise nearest pixel is drawn
+// x0,y0 - tail, position on previous frame
+// x1,y1 - head, current position
+// color - faded color of star, packed as pixel of frame
+// z - z-buffer value of star
+// rowFrom, rowTo, dirty, counters - as for DrawStar
+// Raster - RasterKind of buffers of frame
+template <int Raster> void StarFly2::DrawStreak( FP_TYPE x0, FP_TYPE y0, FP_TYPE x1, FP_TYPE y1, UINT32 color, UINT16 z, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters )
+{
+	static const FP_TYPE fixedOne = (FP_TYPE)65536.0;
+	bool steep = fabs(y1 - y0) > fabs(x1 - x0);
+	FP_TYPE u0 = steep ? y0 : x0; // Major axis
+	FP_TYPE v0 = steep ? x0 : y0; // Minor axis
+	FP_TYPE du = steep ? (y1 - y0) : (x1 - x0);
+	int tail = (int)floor(u0);
+	int head = (int)floor(steep ? y1 : x1);
+	if (tail == head)
+		return; // Star moved less than pixel
+	FP_TYPE slope = (steep ? (x1 - x0) : (y1 - y0)) / du; // In [-1, 1]
+
+	// Pixels from tail to head, clipped by screen and band
+	int kStart = (tail < head) ? tail : head + 1;
+	int kFrom = kStart;
+	int kTo = (tail < head) ? head : tail + 1;
+	kFrom = max(kFrom, steep ? rowFrom : 0);
+	kTo = min(kTo, steep ? rowTo : ScreenWidth);
+	int vFrom = steep ? 0 : rowFrom;
+	int vTo = steep ? ScreenWidth : rowTo;
+	if ((FP_TYPE)0.0 != slope)
+	{	// Minor axis is in range with reserve of pixel for anti-aliasing
+		FP_TYPE kA = u0 - (FP_TYPE)0.5 + (vFrom - 1 - v0) / slope;
+		FP_TYPE kB = u0 - (FP_TYPE)0.5 + (vTo + 1 - v0) / slope;
+		kFrom = (int)max((FP_TYPE)kFrom, (FP_TYPE)floor(min(kA, kB))); // Clamped before conversion, so steep slope does not overflow
+		kTo = (int)min((FP_TYPE)kTo, (FP_TYPE)ceil(max(kA, kB)) + 1);
+	}
+	else if (v0 < vFrom - 1 || v0 >= vTo + 1)
+		return; // Same reserve for line along axis
+	if (kFrom >= kTo)
+		return;
+
+	// Fixed point steps from first pixel of whole line, so each band draws same pixels as whole screen
+	// Minor axis is counted from vBase, so it stays positive within clipped range and shift is floor
+	int vBase = -2;
+	FP_TYPE c = kStart + (FP_TYPE)0.5 - u0; // Center of first pixel
+	int dt = (int)(fixedOne / du);
+	int dv = (int)(slope * fixedOne);
+	int t = (int)(c / du * fixedOne) + (kFrom - kStart) * dt; // Share of way from tail to head, 1.0 = 65536
+	int v = (int)((v0 + c * slope - vBase) * fixedOne) + (kFrom - kStart) * dv;
+	int stepU = steep ? RowStride : 1; // Offsets of pixel along axes
+	int stepV = steep ? 1 : RowStride;
+	int offset = kFrom * stepU;
+
+	if (Raster_Light != Raster)
+	{	// Nearest pixel
+		for (int k = kFrom; k < kTo; k++, t += dt, v += dv, offset += stepU)
+		{
+			int m = vBase + (v >> 16);
+			int f = min(t >> 8, 256);
+			if (0 < f && vFrom <= m && m < vTo)
+				PutStreakPixel<Raster>(offset + m * stepV, ScaleColor(color, f), z, dirty, counters);
+		}
+		return;
+	}
+
+	// Coverage of two pixels by distance of their centers to line
+	v -= (int)fixedOne / 2;
+	for (int k = kFrom; k < kTo; k++, t += dt, v += dv, offset += stepU)
+	{
+		int m = vBase + (v >> 16);
+		int f = min(t >> 8, 256);
+		if (0 >= f)
+			continue;
+		int cover = (v & 0xFFFF) >> 8; // Share of second pixel, [0, 256)
+		if (vFrom <= m && m < vTo)
+			PutStreakPixel<Raster>(offset + m * stepV, ScaleColor(color, f * (256 - cover) >> 8), z, dirty, counters);
+		if (vFrom <= m + 1 && m + 1 < vTo && 0 < cover)
+			PutStreakPixel<Raster>(offset + (m + 1) * stepV, ScaleColor(color, f * cover >> 8), z, dirty, counters);
+	}
+}
+
+// Add anti-aliased circle of light to accumulation buffer
+// Coverage of pixel is radius + 0.5 - distance of its center, clamped to [0, 1]
+// xp,yp - center on screen
+// radius - radius on screen
+// light - light of fully covered pixel, 4 channels in lower half
+// rowFrom, rowTo - range of screen rows to draw
+// dirty - receives spans of touched pixels
+// counters - counters of band, circle is counted only by band of its first row
+void StarFly2::AddCircle( FP_TYPE xp, FP_TYPE yp, FP_TYPE radius, __m128i light, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters )
+{
+	FP_TYPE outer = radius + (FP_TYPE)0.5;
+	FP_TYPE inner = radius - (FP_TYPE)0.5; // Fully covered up to it, radius > Star::minSize
+	int jFirst = max(0, (int)ceil(yp - outer));
+	int jFrom = max(rowFrom, jFirst);
+	int jTo = min(rowTo, (int)floor(yp + outer) + 1);
+	for (int j = jFrom; j < jTo; j++)
+	{
+		FP_TYPE yd2 = (j - yp)*(j - yp);
+		if (yd2 >= outer*outer)
+			continue;
+		FP_TYPE xo = sqrt(outer*outer - yd2);
+		int left = max(0, (int)ceil(xp - xo));
+		int right = min(ScreenWidth - 1, (int)floor(xp + xo));
+		if (left > right)
+			continue;
+		dirty.Push(left + j*RowStride);
+		dirty.Push(right - left + 1);
+
+		FP_TYPE inner2 = inner*inner - yd2;
+		int offset = left + j*RowStride;
+		for (int k = left; k <= right; k++, offset++)
+		{
+			FP_TYPE xd2 = (k - xp)*(k - xp);
+			if (xd2 <= inner2)
+				AddLight(offset, light);
+			else
+			{	// Edge - light scaled by coverage
+				FP_TYPE coverage = outer - sqrt(xd2 + yd2);
+				if (0 >= coverage)
+					continue;
+				int scale = (int)(min(coverage, (FP_TYPE)1.0) * 65535);
+				AddLight(offset, _mm_mulhi_epu16(light, _mm_set1_epi16((short)scale)));
+			}
+			counters.pixels++;
+		}
+	}
+	if (rowFrom <= jFirst && jFirst < rowTo)
+		counters.circles++;
+}
+
+// Prepare circle for drawing by rows
+// xp,yp - center on screen
+// viewSize - radius on screen
+// circle - receives bounding rectangle and source of spans
+void StarFly2::PrepareCircle(FP_TYPE xp, FP_TYPE yp, FP_TYPE viewSize, CircleShape& circle) const
+{
+	circle.sprite = UseSprites ? sprites.Find(viewSize, xp, yp) : NULL;
+	if (NULL != circle.sprite)
+	{
+		circle.xBase = (int)floor(xp);
+		circle.yBase = (int)floor(yp);
+		circle.kFrom = 0;
+		circle.kTo = ScreenWidth;
+		circle.jFrom = max(0, circle.yBase + circle.sprite->top);
+		circle.jTo = min(circle.yBase + circle.sprite->top + circle.sprite->rows, ScreenHeight);
+		return;
+	}
+
+	// Intersection of screen and bounding rectangle around star circle
+	int size1 = ((FP_TYPE)1.0 < viewSize) ? (int)viewSize : 1;
+	int xp1 = (int)xp; // Integer coordinates
+	int yp1 = (int)yp;
+	circle.xp = xp;
+	circle.yp = yp;
+	circle.lim = viewSize*viewSize;
+	circle.kFrom = max(0, xp1-size1);
+	circle.kTo = min(xp1+size1+2, ScreenWidth);
+	circle.jFrom = max(0, yp1-size1);
+	circle.jTo = min(yp1+size1+2, ScreenHeight);
+}
+
+// Span of circle pixels on given row
+// j - row, should be in [circle.jFrom, circle.jTo)
+// left, right - receive first and last pixel of span
+// Return Value: false if row has no pixels of circle
+// Exact calculation gives the same pixels as per-pixel check of 'xd*xd + yd*yd <= viewSize*viewSize'
+inline bool StarFly2::CircleSpan(const CircleShape& circle, int j, int& left, int& right) const
+{
+	if (NULL != circle.sprite)
+	{
+		const INT8* span = circle.sprite->spans + 2*(j - circle.yBase - circle.sprite->top);
+		left = max(circle.kFrom, circle.xBase + span[0]);
+		right = min(circle.kTo - 1, circle.xBase + span[1]);
+		return left <= right;
+	}
+
+	FP_TYPE yd = j - circle.yp;        // (xd,yd) - vector from star center to current pixel
+	FP_TYPE lim2 = circle.lim - yd*yd; // From 'xd*xd + yd*yd <= lim' we can write 'xd*xd <= lim - yd*yd'
+	if (0 > lim2 || circle.kFrom >= circle.kTo)
+		return false;
+
+	// Estimate ends by sqrt, then correct them by exact check of pixels, as rounding could differ
+	FP_TYPE half = sqrt(lim2);
+	FP_TYPE xd;
+	left = (int)max((FP_TYPE)circle.kFrom, min((FP_TYPE)(circle.kTo - 1), (FP_TYPE)ceil(circle.xp - half)));
+	right = (int)max((FP_TYPE)circle.kFrom, min((FP_TYPE)(circle.kTo - 1), (FP_TYPE)floor(circle.xp + half)));
+	while (left > circle.kFrom && (xd = (left - 1) - circle.xp, xd*xd <= lim2))
+		left--;
+	while (left <= right && (xd = left - circle.xp, xd*xd > lim2))
+		left++;
+	while (right < circle.kTo - 1 && (xd = (right + 1) - circle.xp, xd*xd <= lim2))
+		right++;
+	while (right >= left && (xd = right - circle.xp, xd*xd > lim2))
+		right--;
+	return left <= right;
+}
+
+// Fill span of row with color using z-buffer check
+// j - row
+// left, right - first and last pixel of span
+// color - packed as pixel of frame, alpha byte is 0 as after clear
+// z - z-buffer value
+// Return Value: number of written pixels, others are hidden by nearer stars
+int StarFly2::FillSpanZ(int j, int left, int right, UINT32 color, UINT16 z)
+{
+	int offset = left + j*RowStride;
+	UINT32* pixel = (UINT32*)MemBuffer + offset; // Frame is aligned, one store per pixel
+	UINT16* depth = zBuffer + offset;
+	int written = 0;
+	for (int k = left; k <= right; k++, pixel++, depth++)
+	{
+		if (*depth < z) // Check z-buffer
+			continue;
+		*pixel = color;
+		*depth = z;
+		written++;
+	}
+	return written;
+}
+
+// Fill span of row with color, without z-buffer
+// j - row
+// left, right - first and last pixel of span
+// color - packed as pixel of frame
+void StarFly2::FillSpan(int j, int left, int right, UINT32 color)
+{
+	UINT32* pixel = (UINT32*)MemBuffer + left + j*RowStride;
+	for (int k = left; k <= right; k++)
+		*pixel++ = color;
+}
+
+// Put single pixel into memory buffer without screen border checks and z-buffer
+// x,y - coordinates
+// color - packed as pixel of frame
+void StarFly2::PutPixelOnBuffer(int x, int y, UINT32 color)
+{
+	((UINT32*)MemBuffer)[x + y*RowStride] = color;
+}
+
+// Put single pixel into memory buffer without screen border checks
+// x,y - coordinates
+// color - packed as pixel of frame, alpha byte is 0 as after clear
+// z - z-buffer value
+// Return Value: false if pixel is hidden by nearer star
+bool StarFly2::PutPixelOnBufferZ(int x, int y, UINT32 color, UINT16 z)
+{
+	int offset = x + y*RowStride;
+	if (zBuffer[offset] < z) // Check z-buffer
+		return false;
+	((UINT32*)MemBuffer)[offset] = color;
+	zBuffer[offset] = z;
+	return true;
+}
+
+// Put single pixel into memory buffer with border checks
+// x,y - coordinates
+// color - packed as pixel of frame
+// z - z-buffer value
+void StarFly2::PutPixelOnBufferCheckZ(int x, int y, UINT32 color, UINT16 z)
+{
+	if (0>x || 0>y || x>=ScreenWidth || y>=ScreenHeight)
+		return;
+	PutPixelOnBufferZ(x,y, color, z);
+}
+
+// Choose specialized kernels of projection and raster for current settings
+// Should be called when FreeCamera, FadePower, tables of fade or buffers of frame change
+void StarFly2::SelectKernels()
+{
+	FadeKind fade = Fade_Exact;
+	if ((FP_TYPE)1.0 == FadePower)
+		fade = Fade_Linear;
+	else if ((FP_TYPE)0.0 == FadePower)
+		fade = Fade_None;
+	else if (UseFastMath && tables.fadeByTable)
+		fade = Fade_Table;
+	projectKernel = FreeCamera ? PickFade<true>(fade) : PickFade<false>(fade);
+	clusterKernel = PickFade<false>(fade);
+
+	if (NULL != lightBuffer)
+		rasterKernel = PickRaster<Raster_Light>();
+	else if (NULL == zBuffer)
+		rasterKernel = PickRaster<Raster_Order>();
+	else
+		rasterKernel = PickRaster<Raster_Z>();
+}
+
+// Projection kernel for fade, by FastMath
+// Return Value: instantiation of SSE2 or AVX2 kernel
+template <bool Free, int Fade> StarFly2::ProjectKernel StarFly2::PickProjection() const
+{
+#if defined(__AVX2__)
+	return UseFastMath ? &StarFly2::ProjectStarsAvx2<Free, Fade, true> : &StarFly2::ProjectStarsAvx2<Free, Fade, false>;
+#else
+	return UseFastMath ? &StarFly2::ProjectStarsSse2<Free, Fade, true> : &StarFly2::ProjectStarsSse2<Free, Fade, false>;
+#endif
+}
+
+// Projection kernel for kind of fade
+// fade - FadeKind
+template <bool Free> StarFly2::ProjectKernel StarFly2::PickFade( FadeKind fade ) const
+{
+	switch (fade)
+	{
+	case Fade_Table:
+		return PickProjection<Free, Fade_Table>();
+	case Fade_Linear:
+		return PickProjection<Free, Fade_Linear>();
+	case Fade_None:
+		return PickProjection<Free, Fade_None>();
+	default:
+		return PickProjection<Free, Fade_Exact>();
+	}
+}
+
+// Raster kernel for buffers of frame, with or without trails
+template <int Raster> StarFly2::RasterKernel StarFly2::PickRaster() const
+{
+	return (NULL != stars.xpPrev) ? &StarFly2::DrawPoolStars<Raster, true> : &StarFly2::DrawPoolStars<Raster, false>;
+}
+
+// Move stars towards viewer, tick fade-in and project to screen
+// from, to - range of star indices, from should be multiple of StarPool::Block
+// movedZ - distance passed since previous frame
+// passedMs - time passed since previous frame
+// respawn - receives indices of stars which are out of sight, they should be regenerated by RegenerateStars
+// Does not use random generator, so it could be executed in parallel for different ranges
+void StarFly2::ProjectStars( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn )
+{
+	if (UseSimd)
+	{
+		int to1 = from + (to - from) / StarPool::Block * StarPool::Block; // Whole blocks are handled by SIMD
+		(this->*projectKernel)(from, to1, movedZ, passedMs, respawn);
+		from = to1;
+	}
+	for (int i = from; i < to; i++) // Rest - one by one, reference code
+	{
+		Star star;
+		stars.Get(i, star);
+		if (FreeCamera)
+		{	// Camera is shifted and rotated
+			FP_TYPE x0 = star.x - frameShift[0];
+			FP_TYPE y0 = star.y - frameShift[1];
+			FP_TYPE z0 = star.z - frameShift[2];
+			star.x = frameRotation[0]*x0 + frameRotation[1]*y0 + frameRotation[2]*z0;
+			star.y = frameRotation[3]*x0 + frameRotation[4]*y0 + frameRotation[5]*z0;
+			star.z = frameRotation[6]*x0 + frameRotation[7]*y0 + frameRotation[8]*z0;
+		}
+		else
+			star.z -= movedZ;            // Stars are moved towards viewer
+		if (0 < star.fadeIn)
+			star.fadeIn -= passedMs;     // Tick fade-in
+		if (!star.Project(this))         // Update star screen position
+			respawn.Push(i);
+		stars.Set(i, star);
+	}
+}
+
+// Regenerate stars which are out of sight
+// respawn - indices of stars from ProjectStars, in ascending order
+// Each star takes generator of its block, chunks hold whole blocks, so star field does not depend on chunks and threads
+void StarFly2::RegenerateStars( const IndexList& respawn )
+{
+	for (int k = 0; k < respawn.count; k++)
+	{
+		int i = respawn.data[k];
+		Star star;
+		stars.Get(i, star);
+		star.Process(this, blockRandom[i / RandomBlock]); // Randomize and project
+		stars.Set(i, star);
+		if (NULL != stars.xpPrev)
+		{	// No trail from place of previous star
+			stars.xpPrev[i] = star.xp;
+			stars.ypPrev[i] = star.yp;
+		}
+	}
+}
+
+// SSE2 version of projection, 4 stars per iteration, same formulas as Star::Project
+// Free - stars are moved by matrix of free camera, otherwise along z only
+// Fade - FadeKind for FadePower and FastMath, FastSqrt - 1/sqrt by estimate (FastMath)
+template <bool Free, int Fade, bool FastSqrt> void StarFly2::ProjectStarsSse2( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn )
+{
+	const __m128 zero = _mm_setzero_ps();
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 moved = _mm_set1_ps(movedZ);
+	const __m128 scale = _mm_set1_ps(ScreenScale);
+	const __m128 centerX = _mm_set1_ps(CenterX*ScreenWidth);
+	const __m128 centerY = _mm_set1_ps(CenterY*ScreenHeight);
+	const __m128 width = _mm_set1_ps((FP_TYPE)ScreenWidth);
+	const __m128 height = _mm_set1_ps((FP_TYPE)ScreenHeight);
+	const __m128 fadeInK = _mm_set1_ps(FadeInK);
+	const __m128i passed = _mm_set1_epi32(passedMs);
+	const __m128i zeroi = _mm_setzero_si128();
+	const __m128 half = _mm_set1_ps(0.5f);
+	const __m128 three = _mm_set1_ps(3.0f);
+	const __m128 fadeSteps = _mm_set1_ps((FP_TYPE)FastTables::FadeSteps);
+	__m128 rotation[9], shift[3];
+	for (int k = 0; k < 9; k++)
+		rotation[k] = _mm_set1_ps(frameRotation[k]);
+	for (int k = 0; k < 3; k++)
+		shift[k] = _mm_set1_ps(frameShift[k]);
+	const __m128 farNormal = _mm_set1_ps(FarPlane);
+	const __m128 farGiant = _mm_set1_ps(FarPlane * Star::giantFactor);
+	const __m128 giantSize = _mm_set1_ps(StarSizeFactor * Star::giantFactor);
+
+	for (int i = from; i < to; i += 4)
+	{
+		__m128 x, y, z;
+		if (Free)
+		{	// Camera is shifted and rotated
+			__m128 x0 = _mm_sub_ps(_mm_load_ps(stars.x + i), shift[0]);
+			__m128 y0 = _mm_sub_ps(_mm_load_ps(stars.y + i), shift[1]);
+			__m128 z0 = _mm_sub_ps(_mm_load_ps(stars.z + i), shift[2]);
+			x = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rotation[0], x0), _mm_mul_ps(rotation[1], y0)), _mm_mul_ps(rotation[2], z0));
+			y = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rotation[3], x0), _mm_mul_ps(rotation[4], y0)), _mm_mul_ps(rotation[5], z0));
+			z = _mm_add_ps(_mm_add_ps(_mm_mul_ps(rotation[6], x0), _mm_mul_ps(rotation[7], y0)), _mm_mul_ps(rotation[8], z0));
+			_mm_store_ps(stars.x + i, x);
+			_mm_store_ps(stars.y + i, y);
+			_mm_store_ps(stars.z + i, z);
+		}
+		else
+		{
+			z = _mm_sub_ps(_mm_load_ps(stars.z + i), moved); // Stars are moved towards viewer
+			_mm_store_ps(stars.z + i, z);
+			x = _mm_load_ps(stars.x + i);
+			y = _mm_load_ps(stars.y + i);
+		}
+		__m128i fadeIn = _mm_load_si128((__m128i*)(stars.fadeIn + i));
+		fadeIn = _mm_sub_epi32(fadeIn, _mm_and_si128(_mm_cmpgt_epi32(fadeIn, zeroi), passed)); // Tick fade-in
+		_mm_store_si128((__m128i*)(stars.fadeIn + i), fadeIn);
+
+		__m128 visible = _mm_cmpge_ps(z, zero); // Star is not behind viewer
+		if (Free)
+		{	// and not beyond far plane of its kind
+			__m128 giant = _mm_cmpgt_ps(_mm_load_ps(stars.size + i), giantSize);
+			visible = _mm_and_ps(visible, _mm_cmple_ps(z, _mm_or_ps(_mm_and_ps(giant, farGiant), _mm_andnot_ps(giant, farNormal))));
+		}
+
+		__m128 dist2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(x, x), _mm_mul_ps(y, y)), _mm_mul_ps(z, z));
+		__m128 viewSize;
+		if (FastSqrt)
+		{	// Estimate of 1/sqrt with one Newton-Raphson step, relative error is below 1e-6
+			__m128 r = _mm_rsqrt_ps(dist2);
+			r = _mm_mul_ps(_mm_mul_ps(half, r), _mm_sub_ps(three, _mm_mul_ps(_mm_mul_ps(dist2, r), r)));
+			viewSize = _mm_mul_ps(_mm_load_ps(stars.size + i), r);
+		}
+		else
+			viewSize = _mm_div_ps(_mm_load_ps(stars.size + i), _mm_sqrt_ps(dist2));
+		__m128 size1 = _mm_cvtepi32_ps(_mm_cvttps_epi32(viewSize)); // (int)viewSize
+
+		__m128 k1 = _mm_div_ps(scale, z);
+		__m128 xp = _mm_add_ps(centerX, _mm_mul_ps(x, k1));
+		__m128 yp = _mm_add_ps(centerY, _mm_mul_ps(y, k1));
+		// Star circle is inside viewed cone
+		visible = _mm_and_ps(visible, _mm_cmpge_ps(xp, _mm_sub_ps(zero, size1)));
+		visible = _mm_and_ps(visible, _mm_cmplt_ps(xp, _mm_add_ps(width, size1)));
+		visible = _mm_and_ps(visible, _mm_cmpge_ps(yp, _mm_sub_ps(zero, size1)));
+		visible = _mm_and_ps(visible, _mm_cmplt_ps(yp, _mm_add_ps(height, size1)));
+
+		// Fade of color with distance
+		__m128 fade;
+		if (Fade_Linear == Fade)
+			fade = _mm_min_ps(viewSize, one);
+		else if (Fade_None == Fade)
+			fade = one;
+		else if (Fade_Table == Fade)
+		{	// Linear interpolation in table, no SIMD gather - per lane
+			__m128 t = _mm_mul_ps(_mm_max_ps(_mm_min_ps(viewSize, one), zero), fadeSteps); // NaN becomes 1.0
+			__m128i index = _mm_cvttps_epi32(t);
+			__m128 frac = _mm_sub_ps(t, _mm_cvtepi32_ps(index));
+			__declspec(align(16)) int n[4];
+			__declspec(align(16)) FP_TYPE a[4];
+			__declspec(align(16)) FP_TYPE b[4];
+			_mm_store_si128((__m128i*)n, index);
+			for (int k = 0; k < 4; k++)
+			{
+				a[k] = tables.fade[n[k]];
+				b[k] = tables.fade[n[k] + 1];
+			}
+			__m128 fade0 = _mm_load_ps(a);
+			fade = _mm_add_ps(fade0, _mm_mul_ps(_mm_sub_ps(_mm_load_ps(b), fade0), frac));
+		}
+		else
+		{	// No SIMD pow - per lane
+			__declspec(align(16)) FP_TYPE v[4];
+			_mm_store_ps(v, viewSize);
+			for (int k = 0; k < 4; k++)
+				v[k] = ((FP_TYPE)1.0 > v[k]) ? pow(v[k], FadePower) : (FP_TYPE)1.0;
+			fade = _mm_load_ps(v);
+		}
+
+		// Fade in of star (regardless of FadePower)
+		__m128 fadingIn = _mm_cmpgt_ps(_mm_cvtepi32_ps(fadeIn), zero);
+		if (0 != _mm_movemask_ps(fadingIn))
+		{
+			__m128 k2 = _mm_sub_ps(one, _mm_mul_ps(_mm_cvtepi32_ps(fadeIn), fadeInK));
+			__m128 big = _mm_cmplt_ps(one, viewSize); // size0 > 1  =>  fade = min(viewSize, 1), otherwise fade *= k2
+			__m128 viewSizeK = _mm_mul_ps(viewSize, k2);
+			__m128 fadeK = _mm_or_ps(_mm_and_ps(big, _mm_min_ps(viewSizeK, one)), _mm_andnot_ps(big, _mm_mul_ps(fade, k2)));
+			viewSize = _mm_or_ps(_mm_and_ps(fadingIn, viewSizeK), _mm_andnot_ps(fadingIn, viewSize));
+			fade = _mm_or_ps(_mm_and_ps(fadingIn, fadeK), _mm_andnot_ps(fadingIn, fade));
+		}
+
+		_mm_store_ps(stars.xp + i, xp);
+		_mm_store_ps(stars.yp + i, yp);
+		_mm_store_ps(stars.viewSize + i, viewSize);
+		_mm_store_ps(stars.fade + i, fade);
+
+		int mask = _mm_movemask_ps(visible);
+		if (0xF != mask) // Some stars are out of sight - to be regenerated
+			for (int k = 0; k < 4; k++)
+				if (0 == (mask & (1 << k)))
+					respawn.Push(i + k);
+	}
+}
+
+#if defined(__AVX2__)
+// AVX2 version of projection, 8 stars per iteration, see ProjectStarsSse2
+template <bool Free, int Fade, bool FastSqrt> void StarFly2::ProjectStarsAvx2( int from, int to, FP_TYPE movedZ, int passedMs, IndexList& respawn )
+{
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 moved = _mm256_set1_ps(movedZ);
+	const __m256 scale = _mm256_set1_ps(ScreenScale);
+	const __m256 centerX = _mm256_set1_ps(CenterX*ScreenWidth);
+	const __m256 centerY = _mm256_set1_ps(CenterY*ScreenHeight);
+	const __m256 width = _mm256_set1_ps((FP_TYPE)ScreenWidth);
+	const __m256 height = _mm256_set1_ps((FP_TYPE)ScreenHeight);
+	const __m256 fadeInK = _mm256_set1_ps(FadeInK);
+	const __m256i passed = _mm256_set1_epi32(passedMs);
+	const __m256i zeroi = _mm256_setzero_si256();
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 three = _mm256_set1_ps(3.0f);
+	const __m256 fadeSteps = _mm256_set1_ps((FP_TYPE)FastTables::FadeSteps);
+	__m256 rotation[9], shift[3];
+	for (int k = 0; k < 9; k++)
+		rotation[k] = _mm256_set1_ps(frameRotation[k]);
+	for (int k = 0; k < 3; k++)
+		shift[k] = _mm256_set1_ps(frameShift[k]);
+	const __m256 farNormal = _mm256_set1_ps(FarPlane);
+	const __m256 farGiant = _mm256_set1_ps(FarPlane * Star::giantFactor);
+	const __m256 giantSize = _mm256_set1_ps(StarSizeFactor * Star::giantFactor);
+
+	for (int i = from; i < to; i += 8)
+	{
+		__m256 x, y, z;
+		if (Free)
+		{	// No FMA - same rounding as scalar code
+			__m256 x0 = _mm256_sub_ps(_mm256_load_ps(stars.x + i), shift[0]);
+			__m256 y0 = _mm256_sub_ps(_mm256_load_ps(stars.y + i), shift[1]);
+			__m256 z0 = _mm256_sub_ps(_mm256_load_ps(stars.z + i), shift[2]);
+			x = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rotation[0], x0), _mm256_mul_ps(rotation[1], y0)), _mm256_mul_ps(rotation[2], z0));
+			y = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rotation[3], x0), _mm256_mul_ps(rotation[4], y0)), _mm256_mul_ps(rotation[5], z0));
+			z = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(rotation[6], x0), _mm256_mul_ps(rotation[7], y0)), _mm256_mul_ps(rotation[8], z0));
+			_mm256_store_ps(stars.x + i, x);
+			_mm256_store_ps(stars.y + i, y);
+			_mm256_store_ps(stars.z + i, z);
+		}
+		else
+		{
+			z = _mm256_sub_ps(_mm256_load_ps(stars.z + i), moved);
+			_mm256_store_ps(stars.z + i, z);
+			x = _mm256_load_ps(stars.x + i);
+			y = _mm256_load_ps(stars.y + i);
+		}
+		__m256i fadeIn = _mm256_load_si256((__m256i*)(stars.fadeIn + i));
+		fadeIn = _mm256_sub_epi32(fadeIn, _mm256_and_si256(_mm256_cmpgt_epi32(fadeIn, zeroi), passed));
+		_mm256_store_si256((__m256i*)(stars.fadeIn + i), fadeIn);
+
+		__m256 visible = _mm256_cmp_ps(z, zero, _CMP_GE_OQ);
+		if (Free)
+		{
+			__m256 giant = _mm256_cmp_ps(_mm256_load_ps(stars.size + i), giantSize, _CMP_GT_OQ);
+			visible = _mm256_and_ps(visible, _mm256_cmp_ps(z, _mm256_blendv_ps(farNormal, farGiant, giant), _CMP_LE_OQ));
+		}
+
+		__m256 dist2 = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(x, x), _mm256_mul_ps(y, y)), _mm256_mul_ps(z, z)); // No FMA - same rounding as scalar code
+		__m256 viewSize;
+		if (FastSqrt)
+		{
+			__m256 r = _mm256_rsqrt_ps(dist2);
+			r = _mm256_mul_ps(_mm256_mul_ps(half, r), _mm256_sub_ps(three, _mm256_mul_ps(_mm256_mul_ps(dist2, r), r)));
+			viewSize = _mm256_mul_ps(_mm256_load_ps(stars.size + i), r);
+		}
+		else
+			viewSize = _mm256_div_ps(_mm256_load_ps(stars.size + i), _mm256_sqrt_ps(dist2));
+		__m256 size1 = _mm256_cvtepi32_ps(_mm256_cvttps_epi32(viewSize));
+
+		__m256 k1 = _mm256_div_ps(scale, z);
+		__m256 xp = _mm256_add_ps(centerX, _mm256_mul_ps(x, k1));
+		__m256 yp = _mm256_add_ps(centerY, _mm256_mul_ps(y, k1));
+		visible = _mm256_and_ps(visible, _mm256_cmp_ps(xp, _mm256_sub_ps(zero, size1), _CMP_GE_OQ));
+		visible = _mm256_and_ps(visible, _mm256_cmp_ps(xp, _mm256_add_ps(width, size1), _CMP_LT_OQ));
+		visible = _mm256_and_ps(visible, _mm256_cmp_ps(yp, _mm256_sub_ps(zero, size1), _CMP_GE_OQ));
+		visible = _mm256_and_ps(visible, _mm256_cmp_ps(yp, _mm256_add_ps(height, size1), _CMP_LT_OQ));
+
+		__m256 fade;
+		if (Fade_Linear == Fade)
+			fade = _mm256_min_ps(viewSize, one);
+		else if (Fade_None == Fade)
+			fade = one;
+		else if (Fade_Table == Fade)
+		{
+			__m256 t = _mm256_mul_ps(_mm256_max_ps(_mm256_min_ps(viewSize, one), zero), fadeSteps);
+			__m256i index = _mm256_cvttps_epi32(t);
+			__m256 frac = _mm256_sub_ps(t, _mm256_cvtepi32_ps(index));
+			__m256 fade0 = _mm256_i32gather_ps(tables.fade, index, 4);
+			__m256 fade1 = _mm256_i32gather_ps(tables.fade + 1, index, 4);
+			fade = _mm256_add_ps(fade0, _mm256_mul_ps(_mm256_sub_ps(fade1, fade0), frac));
+		}
+		else
+		{
+			__declspec(align(32)) FP_TYPE v[8];
+			_mm256_store_ps(v, viewSize);
+			for (int k = 0; k < 8; k++)
+				v[k] = ((FP_TYPE)1.0 > v[k]) ? pow(v[k], FadePower) : (FP_TYPE)1.0;
+			fade = _mm256_load_ps(v);
+		}
+
+		__m256 fadingIn = _mm256_cmp_ps(_mm256_cvtepi32_ps(fadeIn), zero, _CMP_GT_OQ);
+		if (0 != _mm256_movemask_ps(fadingIn))
+		{
+			__m256 k2 = _mm256_sub_ps(one, _mm256_mul_ps(_mm256_cvtepi32_ps(fadeIn), fadeInK));
+			__m256 big = _mm256_cmp_ps(one, viewSize, _CMP_LT_OQ);
+			__m256 viewSizeK = _mm256_mul_ps(viewSize, k2);
+			__m256 fadeK = _mm256_blendv_ps(_mm256_mul_ps(fade, k2), _mm256_min_ps(viewSizeK, one), big);
+			viewSize = _mm256_blendv_ps(viewSize, viewSizeK, fadingIn);
+			fade = _mm256_blendv_ps(fade, fadeK, fadingIn);
+		}
+
+		_mm256_store_ps(stars.xp + i, xp);
+		_mm256_store_ps(stars.yp + i, yp);
+		_mm256_store_ps(stars.viewSize + i, viewSize);
+		_mm256_store_ps(stars.fade + i, fade);
+
+		int mask = _mm256_movemask_ps(visible);
+		if (0xFF != mask)
+			for (int k = 0; k < 8; k++)
+				if (0 == (mask & (1 << k)))
+					respawn.Push(i + k);
+	}
+}
+#endif
+
+// Range of active stars of given chunk, chunk boundaries are aligned to RandomBlock (whole SIMD blocks and generators)
+void StarFly2::ChunkRange( int chunk, int& from, int& to ) const
+{
+	from = (int)((INT64)activeStars * chunk / ChunkCount) / RandomBlock * RandomBlock;
+	to = (chunk + 1 == ChunkCount) ? activeStars :
+		(int)((INT64)activeStars * (chunk + 1) / ChunkCount) / RandomBlock * RandomBlock;
+}
+
+// Range of screen rows which could be affected by rendering of star, bounds of DrawStar with reserve
+// Return Value: false if star is outside of screen rows
+bool StarFly2::StarRows( int index, int& rowFrom, int& rowTo ) const
+{
+	FP_TYPE viewSize = stars.viewSize[index];
+	int yp1 = (int)stars.yp[index];
+	if (Star::minSize < viewSize)
+	{
+		int size1 = ((FP_TYPE)1.0 < viewSize) ? (int)viewSize : 1;
+		rowFrom = max(0, yp1 - size1 - 1); // Includes single point fallback and sprites from cache (one row more)
+		rowTo = min(yp1 + size1 + 3, ScreenHeight);
+	}
+	else
+	{
+		rowFrom = max(0, yp1);
+		rowTo = min(yp1 + 1, ScreenHeight);
+	}
+	if (NULL != stars.xpPrev && State_Background != stars.state[index])
+	{	// Trail, anti-aliased one touches rows on both sides of its ends; background stars have no trail and no previous position
+		int yTail = (int)floor(stars.ypPrev[index]);
+		int yHead = (int)floor(stars.yp[index]);
+		rowFrom = max(0, min(rowFrom, min(yTail, yHead) - 1));
+		rowTo = min(max(rowTo, max(yTail, yHead) + 2), ScreenHeight);
+	}
+	return rowFrom < rowTo;
+}
+
+// Parallel job - move and project stars of one chunk
+void StarFly2::JobProject( void* context, int task )
+{
+	StarFly2* app = (StarFly2*)context;
+	int from, to;
+	app->ChunkRange(task, from, to);
+	app->respawns[task].Clear();
+	app->ProjectStars(from, to, app->frameMovedZ, app->framePassedMs, app->respawns[task]);
+	app->RegenerateStars(app->respawns[task]);
+	app->ProjectBackground(task);
+	if (0 < app->ClusterCount)
+		app->ProcessClusters(task);
+}
+
+// Range of background stars in chunk, as ChunkRange for field stars
+void StarFly2::BackRange( int chunk, int& from, int& to ) const
+{
+	from = backFirst + (int)((INT64)generatedBack * chunk / ChunkCount) / RandomBlock * RandomBlock;
+	to = backFirst + ((chunk + 1 == ChunkCount) ? generatedBack :
+		(int)((INT64)generatedBack * (chunk + 1) / ChunkCount) / RandomBlock * RandomBlock);
+}
+
+// Move and project background stars of chunk by distance and time since previous bake, only on frame of bake
+// Stars which came nearer than far side of field stars are regenerated on FarPlane, as ones out of view
+// chunk - index of chunk, generators of its blocks are used
+void StarFly2::ProjectBackground( int chunk )
+{
+	IndexList& respawn = backRespawns[chunk];
+	respawn.Clear();
+	if (!bakeBackground)
+		return;
+	int from, to;
+	BackRange(chunk, from, to);
+	ProjectStars(from, to, backMovedZ, backPassedMs, respawn);
+
+	FP_TYPE nearZ = fieldDepth * FarPlane;
+	FP_TYPE giantSize = StarSizeFactor * Star::giantFactor;
+	int projected = respawn.count, k = 0;
+	for (int i = from; i < to; i++)
+	{
+		if (k < projected && respawn.data[k] == i)
+		{	// Already out of sight, list is sorted
+			k++;
+			continue;
+		}
+		if (stars.z[i] < ((stars.size[i] > giantSize) ? nearZ * Star::giantFactor : nearZ))
+		{
+			stars.z[i] = (FP_TYPE)-1.0; // Behind viewer - Process generates new star
+			respawn.Push(i);
+		}
+	}
+	RegenerateStars(respawn);
+}
+
+// Parallel job - sort stars of one chunk into bands
+// With depth order chunk is range of depth buckets, chunks go from far to near
+void StarFly2::JobBin( void* context, int task )
+{
+	StarFly2* app = (StarFly2*)context;
+	IndexList* bins = app->bins + task * app->BandCount;
+	for (int band = 0; band < app->BandCount; band++)
+		bins[band].Clear();
+
+	if (app->bakeBackground)
+	{	// Background stars of chunk, with same split as in projection
+		IndexList* backBins = app->backBins + task * app->BandCount;
+		for (int band = 0; band < app->BandCount; band++)
+			backBins[band].Clear();
+		int from, to;
+		app->BackRange(task, from, to);
+		for (int i = from; i < to; i++)
+			app->BinStar(i, backBins);
+	}
+
+	if (app->UseDepthOrder)
+	{
+		LONGLONG farBucket = app->nearBucket + DepthBuckets - 1;
+		for (int step = app->chunkBuckets[task]; step < app->chunkBuckets[task + 1]; step++)
+		{
+			int slot = (int)((farBucket - step) % DepthBuckets);
+			const IndexList& bucket = app->depthRing[slot];
+			for (int k = 0; k < bucket.count; k++)
+			{
+				int i = bucket.data[k];
+				if (i < app->activeStars)
+					app->BinStar(i, bins);
+			}
+		}
+		return;
+	}
+
+	int from, to;
+	app->ChunkRange(task, from, to);
+	for (int i = from; i < to; i++)
+		app->BinStar(i, bins);
+}
+
+// Put star into bins of all bands it touches
+// index - index of star
+// bins - [BandCount] bins of chunk
+void StarFly2::BinStar( int index, IndexList* bins ) const
+{
+	int rowFrom, rowTo;
+	if (0 == FadeColor(palette[stars.color[index]], stars.fade[index]))
+		return; // Black after fade - not drawn
+	if (!StarRows(index, rowFrom, rowTo))
+		return;
+	int bandTo = rowBand[rowTo - 1];
+	for (int band = rowBand[rowFrom]; band <= bandTo; band++)
+		bins[band].Push(index);
+}
+
+// Parallel job - clear and render one band
+void StarFly2::JobRaster( void* context, int task )
+{
+	((StarFly2*)context)->RasterBand(task);
+}
+
+// Clear band of screen and render all stars touching it
+// Each band has its own rows of MemBuffer and zBuffer, so bands could be rendered in parallel
+// Stars are drawn in order of indices (or of depth buckets), so result is the same as for single-threaded rendering
+void StarFly2::RasterBand( int band )
+{
+	int rowFrom = bandRows[band];
+	int rowTo = bandRows[band + 1];
+
+	counters[band].Clear();
+	ClearBand(band);
+
+	if (bakeBackground)
+	{	// Background first, field stars are drawn over it
+		for (int chunk = 0; chunk < ChunkCount; chunk++)
+		{
+			const IndexList& bin = backBins[chunk * BandCount + band];
+			for (int k = 0; k < bin.count; k++)
+			{
+				int i = bin.data[k];
+				DrawStar(stars.xp[i], stars.yp[i], stars.viewSize[i], stars.fade[i], stars.z[i], palette[stars.color[i]],
+					rowFrom, rowTo, dirty[band], counters[band]);
+			}
+		}
+		SaveBackground(rowFrom, rowTo, dirty[band]);
+	}
+
+	for (int chunk = 0; chunk < ChunkCount; chunk++)
+	{
+		const IndexList& bin = bins[chunk * BandCount + band];
+		(this->*rasterKernel)(bin.data, 0, bin.count, rowFrom, rowTo, dirty[band], counters[band]);
+	}
+	if (0 < ClusterCount)
+		DrawClusters(rowFrom, rowTo, dirty[band], counters[band]);
+}
+
+// Clear pixels of band touched on previous frame
+// Only pixels of rendered stars are cleared, whole band is cleared if they are too many or after clearAll was set
+// With background pixels are restored from it, on frame of bake band is cleared to black for new background
+void StarFly2::ClearBand( int band )
+{
+	int rowFrom = bandRows[band];
+	int rowTo = bandRows[band + 1];
+	IndexList& spans = dirty[band];
+	LONGLONG start = FrameProfiler::Now();
+	bool restore = (NULL != background && !bakeBackground);
+
+	if (clearAll || bakeBackground || spans.count > (rowTo - rowFrom) * ScreenWidth / 16) // Each span is 2 items, so ~1/32 of pixels
+	{	// Clear - fill with black color
+		int offset = rowFrom * RowStride;
+		int length = (rowTo - rowFrom) * RowStride;
+		if (restore)
+			memcpy(MemBuffer + offset * 4, background + offset, length * 4);
+		else
+			memset(MemBuffer + offset * 4, 0, length * 4); // 4 bytes for 32-bit RGB
+		if (NULL != zBuffer)
+			memset(zBuffer + offset, 0xFF, length * sizeof(UINT16)); // Max distance
+		if (NULL != lightBuffer)
+		{
+			if (restore && NULL != backLight)
+				memcpy(lightBuffer + offset * 4, backLight + offset * 4, length * 8);
+			else
+				memset(lightBuffer + offset * 4, 0, length * 8);
+		}
+	}
+	else
+	{
+		for (int k = 0; k < spans.count; k += 2)
+		{
+			int offset = spans.data[k];
+			int length = spans.data[k + 1];
+			if (restore)
+				memcpy(MemBuffer + offset * 4, background + offset, length * 4);
+			else
+				memset(MemBuffer + offset * 4, 0, length * 4);
+			if (NULL != zBuffer)
+				memset(zBuffer + offset, 0xFF, length * sizeof(UINT16));
+			if (NULL != lightBuffer)
+			{
+				if (restore && NULL != backLight)
+					memcpy(lightBuffer + offset * 4, backLight + offset * 4, length * 8);
+				else
+					memset(lightBuffer + offset * 4, 0, length * 8);
+			}
+		}
+	}
+	spans.Clear();
+	counters[band].clearTicks += FrameProfiler::Now() - start;
+}
+
+// Keep rows of frame with drawn background stars as new background
+// Background is behind all field stars, so z-buffer is reset; its pixels are not dirty, they are restored as they are
+// rowFrom, rowTo - rows of band
+// dirty - spans of band
+void StarFly2::SaveBackground( int rowFrom, int rowTo, IndexList& dirty )
+{
+	int offset = rowFrom * RowStride;
+	int length = (rowTo - rowFrom) * RowStride;
+	memcpy(background + offset, MemBuffer + offset * 4, length * 4);
+	if (NULL != backLight)
+		memcpy(backLight + offset * 4, lightBuffer + offset * 4, length * 8);
+	if (NULL != zBuffer)
+		memset(zBuffer + offset, 0xFF, length * sizeof(UINT16));
+	dirty.Clear();
+}
+
+// Mark rectangle of pixels drawn not by stars (e.g. by GDI) to be cleared on next frame
+// x,y - top-left corner
+// Should not be called during parallel render
+void StarFly2::MarkDirty( int x, int y, int width, int height )
+{
+	int xFrom = max(0, x);
+	int xTo = min(x + width, ScreenWidth);
+	if (xFrom >= xTo)
+		return;
+	for (int j = max(0, y); j < min(y + height, ScreenHeight); j++)
+	{
+		dirty[rowBand[j]].Push(xFrom + j*RowStride);
+		dirty[rowBand[j]].Push(xTo - xFrom);
+	}
+}
+
+// Print profiler overlay on top-left corner of frame
+// dc - DC with frame selected
+void StarFly2::DrawProfile( HDC dc )
+{
+	SetTextColor(dc, RGB(255, 255, 255));
+	SetBkColor(dc, RGB(0, 0, 0));
+	int y = 0;
+	for (int line = 0; line < FrameProfiler::Lines; line++)
+	{
+		char txt[300];
+		int len1 = profiler.Line(line, txt, sizeof(txt));
+		TextOut(dc, 0, y, txt, len1);
+		SIZE extent;
+		if (!GetTextExtentPoint32(dc, txt, len1, &extent))
+		{
+			clearAll = true;
+			break;
+		}
+		MarkDirty(0, y, extent.cx, extent.cy);
+		y += extent.cy;
+	}
+}
+
+// Move, project and render all stars
+// Times of phases are added to profiler, with several threads clear is measured in bands and taken as their average
+void StarFly2::RenderStars()
+{
+	if (tables.fadePower != FadePower)
+	{	// Power was changed
+		tables.BuildFade(FadePower);
+		SelectKernels();
+	}
+	LONGLONG start = FrameProfiler::Now(), projected;
+	if (generatedStars < fieldStars || generatedBack < backCount)
+		GenerateStars(GenerateBatch); // Star field is filled during first frames
+	if (NULL != stars.xpPrev)
+		stars.KeepPositions(); // After generation, so new stars have trail from place of birth
+	if (NULL != background)
+	{	// Background is baked again when its stars could move on screen by BackgroundError
+		backMovedZ += frameMovedZ;
+		backPassedMs += framePassedMs;
+		if (backMovedZ >= backStep)
+			bakeBackground = true;
+	}
+	if (1 == workers.Threads())
+	{	// Single thread - no chunks and bands
+		respawns[0].Clear();
+		ProjectStars(0, activeStars, frameMovedZ, framePassedMs, respawns[0]);
+		RegenerateStars(respawns[0]);
+		for (int chunk = 0; chunk < ChunkCount; chunk++)
+			ProjectBackground(chunk);
+		if (0 < ClusterCount)
+			ProcessClusters(0);
+		if (UseDepthOrder)
+			UpdateDepthOrder();
+		projected = FrameProfiler::Now();
+		if (bakeBackground)
+		{	// Moved by whole step, next one starts
+			backMovedZ = 0;
+			backPassedMs = 0;
+		}
+		if (Stopping())
+			return; // Exit, frame is not shown
+
+		if (UseDepthOrder)
+		{	// Stars of one chunk and band, from far to near
+			JobBin(this, 0);
+			RasterBand(0);
+		}
+		else
+		{
+			counters[0].Clear();
+			ClearBand(0);
+			if (bakeBackground)
+			{
+				for (int i = backFirst; i < backFirst + generatedBack; i++)
+					DrawStar(stars.xp[i], stars.yp[i], stars.viewSize[i], stars.fade[i], stars.z[i], palette[stars.color[i]],
+						0, ScreenHeight, dirty[0], counters[0]);
+				SaveBackground(0, ScreenHeight, dirty[0]);
+			}
+			(this->*rasterKernel)(NULL, 0, activeStars, 0, ScreenHeight, dirty[0], counters[0]);
+			if (0 < ClusterCount)
+				DrawClusters(0, ScreenHeight, dirty[0], counters[0]);
+		}
+	}
+	else
+	{
+		// Parallel update and respawn
+		workers.Run(JobProject, this, ChunkCount);
+		if (UseDepthOrder)
+			UpdateDepthOrder();
+		projected = FrameProfiler::Now();
+		if (bakeBackground)
+		{
+			backMovedZ = 0;
+			backPassedMs = 0;
+		}
+		if (Stopping())
+			return; // Exit, frame is not shown
+
+		// Parallel render by bands
+		workers.Run(JobBin, this, ChunkCount);
+		workers.Run(JobRaster, this, BandCount);
+	}
+	clearAll = false;
+	bakeBackground = false;
+
+	LONGLONG clear = 0;
+	for (int band = 0; band < BandCount; band++)
+		clear += counters[band].clearTicks;
+	clear /= min(BandCount, workers.Threads());
+	profiler.Add(Phase_Process, projected - start);
+	profiler.Add(Phase_Clear, clear);
+	profiler.Add(Phase_Raster, FrameProfiler::Now() - projected - clear);
+	for (int chunk = 0; chunk < ChunkCount; chunk++)
+		frameRespawns += respawns[chunk].count + backRespawns[chunk].count;
+}
+
+// Quality governor - keeps time of star render within TargetFrameMs by changing number of active stars
+// Load is reduced at once in proportion to overrun and restored smoothly when there is headroom
+// costMs - time of move, projection and raster of current frame
+void StarFly2::GovernQuality( double costMs )
+{
+	static const int MinShare = 16;     // Active stars are not reduced below 1/MinShare of field stars
+	static const int RestoreSteps = 64; // Stars are restored by 1/RestoreSteps of field stars per frame
+	static const int HoldFrames = 4;    // Frames after reduction to measure reduced load
+	static const double Headroom = 0.8; // Stars are restored if cost is below this share of budget
+
+	frameCostMs = (0 == frameCostMs) ? costMs : frameCostMs * 0.8 + costMs * 0.2; // Smoothed, single slow frame does not matter
+	if (0 < governorHold)
+	{
+		governorHold--;
+		return;
+	}
+
+	int minStars = min(fieldStars, max(StarPool::Block, fieldStars / MinShare));
+	if (frameCostMs > TargetFrameMs && activeStars > minStars)
+	{	// Cost is roughly proportional to number of stars
+		int reduced = max(minStars, (int)(activeStars * max(0.5, 0.95 * TargetFrameMs / frameCostMs)));
+		frameCostMs = frameCostMs * reduced / activeStars; // Expected
+		activeStars = reduced;
+		governorHold = HoldFrames;
+	}
+	else if (frameCostMs < Headroom * TargetFrameMs && activeStars < generatedStars)
+		ActivateStars(min(generatedStars, activeStars + max(1, fieldStars / RestoreSteps))); // Restored gradually
+}
+
+// Make more first stars of field active, stars becoming active appear in the distance and fade-in, like respawned ones
+// count - number of active stars, at most generatedStars
+void StarFly2::ActivateStars( int count )
+{
+	int from = activeStars;
+	activeStars = max(activeStars, count);
+	for (int i = from; i < activeStars; i++)
+	{
+		Star star;
+		stars.Get(i, star);
+		star.z = (FP_TYPE)-1.0; // To trigger randomize in Process
+		star.state = State_Generated;
+		star.Process(this, random);
+		stars.Set(i, star);
+		if (UseDepthOrder)
+			PlaceStar(i);
+	}
+}
+
+// Prepare free camera from FlyYaw, FlyPitch and rotation of view, should be called when size of screen is known
+// Respawned stars should appear where motion brings space into view, density on face is normal component of velocity
+// Velocity of stars is linear in position, so density is linear too and its peak on face is at one of corners
+void StarFly2::InitializeCamera()
+{
+	static const double degree = 3.14159265358979323846 / 180.0;
+	FreeCamera = (0 != FlyYaw || 0 != FlyPitch || 0 != RotateYaw || 0 != RotatePitch || 0 != RotateRoll);
+
+	flyDirection[0] = (FP_TYPE)(sin(FlyYaw * degree) * cos(FlyPitch * degree));
+	flyDirection[1] = (FP_TYPE)-sin(FlyPitch * degree); // Axis y goes down, as rows of frame
+	flyDirection[2] = (FP_TYPE)(cos(FlyYaw * degree) * cos(FlyPitch * degree));
+	starSpin[0] = (FP_TYPE)(-RotatePitch * degree / 1000); // View turns up - stars go down
+	starSpin[1] = (FP_TYPE)(-RotateYaw * degree / 1000);   // View turns right - stars go left
+	starSpin[2] = (FP_TYPE)(-RotateRoll * degree / 1000);  // View rolls clockwise - stars roll counterclockwise
+	BuildSpawnSides();
+
+	for (int k = 0; k < 9; k++)
+	{
+		frameRotation[k] = (0 == k % 4) ? (FP_TYPE)1.0 : (FP_TYPE)0.0;
+		cameraTurn[k] = frameRotation[k];
+	}
+	for (int k = 0; k < 3; k++)
+		frameShift[k] = 0;
+}
+
+// Faces of viewed pyramid for respawn and planes for culling, from FlySpeed, spin of stars and spans of view
+// Should be called again when one of them changes
+void StarFly2::BuildSpawnSides()
+{
+	// Corners of faces, first one is viewer for sides
+	double x0 = -CenterX * XrandSpan, x1 = (1 - CenterX) * XrandSpan;
+	double y0 = -CenterY * YrandSpan, y1 = (1 - CenterY) * YrandSpan;
+	double f = FarPlane;
+	double corners[Face_Count][4][3] = {
+		{ { x0, y0, f }, { x1, y0, f }, { x1, y1, f }, { x0, y1, f } },
+		{ { 0, 0, 0 }, { x0, y0, f }, { x0, y1, f }, { x0, y1, f } },
+		{ { 0, 0, 0 }, { x1, y1, f }, { x1, y0, f }, { x1, y0, f } },
+		{ { 0, 0, 0 }, { x1, y0, f }, { x0, y0, f }, { x0, y0, f } },
+		{ { 0, 0, 0 }, { x0, y1, f }, { x1, y1, f }, { x1, y1, f } } };
+	double weight[Face_Count], total = 0;
+	for (int face = 0; face < Face_Count; face++)
+	{
+		// Normal of face, out of pyramid by order of corners
+		const double* a = corners[face][0];
+		const double* b = corners[face][1];
+		const double* c = corners[face][2];
+		double normal[3] = {
+			(b[1] - a[1]) * (c[2] - a[2]) - (b[2] - a[2]) * (c[1] - a[1]),
+			(b[2] - a[2]) * (c[0] - a[0]) - (b[0] - a[0]) * (c[2] - a[2]),
+			(b[0] - a[0]) * (c[1] - a[1]) - (b[1] - a[1]) * (c[0] - a[0]) };
+		double area = sqrt(normal[0] * normal[0] + normal[1] * normal[1] + normal[2] * normal[2]);
+		for (int k = 0; k < 3; k++)
+			normal[k] /= area;
+		if (Face_Far != face)
+		{
+			area /= 2; // Triangle
+			for (int k = 0; k < 3; k++)
+				viewPlanes[face - Face_MinX][k] = (FP_TYPE)normal[k];
+		}
+
+		// Velocity is -flight + spin x position, its inward component is inflow - dot(position, normal x spin)
+		SpawnSide& side = spawnSides[face];
+		side.inflow = (FP_TYPE)(FlySpeed * (normal[0] * flyDirection[0] + normal[1] * flyDirection[1] + normal[2] * flyDirection[2]));
+		side.gradient[0] = (FP_TYPE)-(normal[1] * starSpin[2] - normal[2] * starSpin[1]);
+		side.gradient[1] = (FP_TYPE)-(normal[2] * starSpin[0] - normal[0] * starSpin[2]);
+		side.gradient[2] = (FP_TYPE)-(normal[0] * starSpin[1] - normal[1] * starSpin[0]);
+		double peak = 0;
+		for (int corner = 0; corner < 4; corner++)
+		{
+			const double* p = corners[face][corner];
+			peak = max(peak, side.inflow + side.gradient[0] * p[0] + side.gradient[1] * p[1] + side.gradient[2] * p[2]);
+		}
+		side.peak = (FP_TYPE)peak;
+		weight[face] = area * peak;
+		total += weight[face];
+	}
+	if (0 == total)
+	{	// Stars do not leave view - all to far plane
+		weight[Face_Far] = 1;
+		total = 1;
+		spawnSides[Face_Far].peak = 0;
+	}
+	double passed = 0;
+	for (int face = 0; face < Face_Count; face++)
+	{
+		passed += weight[face];
+		spawnSides[face].share = (FP_TYPE)(passed / total);
+	}
+	spawnSides[Face_Count - 1].share = (FP_TYPE)1.0;
+}
+
+// Matrix of free camera for current frame, stars are rotated by spin around axis thru viewer (Rodrigues formula)
+// passedMs - time passed since previous frame
+void StarFly2::UpdateCamera( int passedMs )
+{
+	for (int k = 0; k < 3; k++)
+		frameShift[k] = FlySpeed * passedMs * flyDirection[k];
+
+	double axis[3] = { starSpin[0] * passedMs, starSpin[1] * passedMs, starSpin[2] * passedMs };
+	double angle = sqrt(axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2]);
+	if (0 != angle)
+		for (int k = 0; k < 3; k++)
+			axis[k] /= angle;
+	double c = cos(angle), s = sin(angle), t = 1 - c;
+	double x = axis[0], y = axis[1], z = axis[2];
+	double m[9] = {
+		t*x*x + c,   t*x*y - s*z, t*x*z + s*y,
+		t*x*y + s*z, t*y*y + c,   t*y*z - s*x,
+		t*x*z - s*y, t*y*z + s*x, t*z*z + c };
+	for (int k = 0; k < 9; k++)
+		frameRotation[k] = (FP_TYPE)m[k];
+
+	// Offsets of cluster stars are turned by whole rotation since start, its rows are orthonormalized to not drift
+	double turn[9];
+	for (int row = 0; row < 3; row++)
+		for (int col = 0; col < 3; col++)
+			turn[row * 3 + col] = m[row * 3] * cameraTurn[col] + m[row * 3 + 1] * cameraTurn[3 + col] + m[row * 3 + 2] * cameraTurn[6 + col];
+	for (int row = 0; row < 3; row++)
+	{
+		double* r = turn + row * 3;
+		for (int prev = 0; prev < row; prev++)
+		{
+			const double* p = turn + prev * 3;
+			double d = r[0] * p[0] + r[1] * p[1] + r[2] * p[2];
+			for (int k = 0; k < 3; k++)
+				r[k] -= d * p[k];
+		}
+		double length = sqrt(r[0] * r[0] + r[1] * r[1] + r[2] * r[2]);
+		for (int k = 0; k < 3; k++)
+			r[k] /= length;
+	}
+	for (int k = 0; k < 9; k++)
+		cameraTurn[k] = turn[k];
+}
+
+// Position of respawned star with free camera, on face of viewed pyramid with density of flow into view
+// Candidate is uniform on face, face is picked by its area and peak of density, then candidate is accepted by ratio of density to peak
+// random - generator of calling thread
+// xs, ys - receive share of screen width and height
+// depth - receives share of FarPlane
+void StarFly2::SpawnOnFace( Random& random, FP_TYPE& xs, FP_TYPE& ys, FP_TYPE& depth ) const
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
+	static const int MaxAttempts = 64; // Flow could come only thru small part of face, then last candidate is taken anyway
+	FP_TYPE marginX = (FP_TYPE)0.5 / ScreenWidth; // Star on side is half of pixel inside, so rounding does not put it out of view
+	FP_TYPE marginY = (FP_TYPE)0.5 / ScreenHeight;
+	for (int attempt = 0; attempt < MaxAttempts; attempt++)
+	{
+		FP_TYPE u[4];
+		random.Fill(u, 4);
+		int face = 0;
+		while (face + 1 < Face_Count && u[0] >= spawnSides[face].share)
+			face++;
+		xs = u[1];
+		ys = u[2];
+		if (Face_Far == face)
+			depth = one;
+		else // Length of side section grows as z, so z = FarPlane * sqrt(uniform); (0, 1] to not put star into viewer
+			depth = sqrt(one - u[1]);
+		if (Face_MinX == face)
+			xs = marginX;
+		else if (Face_MaxX == face)
+			xs = one - marginX;
+		else if (Face_MinY == face)
+		{
+			xs = u[2];
+			ys = marginY;
+		}
+		else if (Face_MaxY == face)
+		{
+			xs = u[2];
+			ys = one - marginY;
+		}
+
+		const SpawnSide& side = spawnSides[face];
+		FP_TYPE density = side.inflow +
+			side.gradient[0] * (xs - CenterX) * XrandSpan * depth +
+			side.gradient[1] * (ys - CenterY) * YrandSpan * depth +
+			side.gradient[2] * FarPlane * depth;
+		if (0 >= side.peak || u[3] * side.peak <= density)
+			break;
+	}
+}
+
+// Take arrays of clusters from arena and spawn clusters in whole viewed space, their stars are generated when they come near
+// Return Value: true on success
+bool StarFly2::InitializeClusters()
+{
+	static const int SizeSamples = 1024;
+	size_t members = (size_t)ClusterCount * ClusterStars;
+	clusters = (Cluster*)arena.Take(ClusterCount * sizeof(Cluster));
+	offsetX = (FP_TYPE*)arena.Take(members * sizeof(FP_TYPE));
+	offsetY = (FP_TYPE*)arena.Take(members * sizeof(FP_TYPE));
+	offsetZ = (FP_TYPE*)arena.Take(members * sizeof(FP_TYPE));
+	if (NULL == clusters || NULL == offsetX || NULL == offsetY || NULL == offsetZ)
+		return false;
+
+	// Average size by even samples of distribution, without random generator
+	double sum = 0;
+	for (int k = 0; k < SizeSamples; k++)
+		sum += RandomSize((FP_TYPE)((k + 0.5) / SizeSamples));
+	clusterStarSize = (FP_TYPE)(StarSizeFactor * sum / SizeSamples);
+	return true;
+}
+
+// Place cluster in viewed space as giant star - up to far plane of giants, so it appears as faint glow
+// Initial one is placed in whole pyramid, respawned - on far plane or on faces exposed by free camera
+// cluster - receives center, size, kind, colors and seed of its stars
+// initial - cluster is created on program start
+// random - generator of calling thread
+void StarFly2::SpawnCluster( Cluster& cluster, bool initial, Random& random )
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
+	FP_TYPE u[6];
+	random.Fill(u, 6);
+	FP_TYPE xs = u[1];
+	FP_TYPE ys = u[2];
+	FP_TYPE depth; // Share of far plane of giants
+	if (initial) // Area of pyramid section grows as z^2, as for stars
+		depth = (FP_TYPE)pow((FP_TYPE)(one - u[0]), (FP_TYPE)(1.0 / 3.0));
+	else
+	{
+		depth = one;
+		if (FreeCamera)
+			SpawnOnFace(random, xs, ys, depth);
+	}
+	depth *= Star::giantFactor;
+	cluster.z = depth*FarPlane;
+	cluster.x = (xs - CenterX)*XrandSpan*depth;
+	cluster.y = (ys - CenterY)*YrandSpan*depth;
+	cluster.radius = ClusterSize*(FP_TYPE)(0.5 + u[3]); // [0.5, 1.5) of average
+	cluster.kind = (ClusterKind)min((int)(u[4]*ClusterKind_Count), ClusterKind_Count - 1);
+	cluster.colorFrom = (UINT8)(u[5]*(PaletteSize - ClusterColors + 1));
+	cluster.seed = random.Next();
+	cluster.generated = false;
+	cluster.view = ClusterView_Hidden;
+}
+
+// Generate stars of cluster from its seed, as offsets from center in coordinates of star field at start
+// Globular cluster has Plummer profile truncated at radius, galaxy - exponential disk along two logarithmic spirals and small bulge
+// index - index of cluster
+void StarFly2::GenerateClusterStars( int index )
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
+	static const FP_TYPE pi2 = (FP_TYPE)(2.0 * 3.14159265358979323846);
+	static const FP_TYPE BulgeShare = (FP_TYPE)0.15;    // Stars of galaxy in its central sphere
+	static const FP_TYPE ArmTwist = (FP_TYPE)2.5;       // Turn of spiral arm (radians) per e-fold of radius
+	static const FP_TYPE ArmWidth = (FP_TYPE)0.8;       // Spread of angle around arm, radians
+	static const FP_TYPE DiskThickness = (FP_TYPE)0.04; // Half of thickness of disk, share of radius
+	Cluster& cluster = clusters[index];
+	Random random;
+	random.Seed(cluster.seed);
+	FP_TYPE radius = cluster.radius;
+
+	// Plane of disk - random normal and two axes
+	FP_TYPE u[7];
+	random.Fill(u, 2);
+	FP_TYPE nz = 2*u[0] - one, nr = sqrt(max((FP_TYPE)0.0, one - nz*nz));
+	FP_TYPE normal[3] = { nr*cos(pi2*u[1]), nr*sin(pi2*u[1]), nz };
+	FP_TYPE axis1[3] = { normal[1], -normal[0], 0 }; // normal x (0, 0, 1), or (1, 0, 0) for normal near z
+	if (fabs(nz) > (FP_TYPE)0.9)
+	{
+		axis1[0] = 0;
+		axis1[1] = normal[2];
+		axis1[2] = -normal[1];
+	}
+	FP_TYPE length = sqrt(axis1[0]*axis1[0] + axis1[1]*axis1[1] + axis1[2]*axis1[2]);
+	for (int k = 0; k < 3; k++)
+		axis1[k] /= length;
+	FP_TYPE axis2[3] = {
+		normal[1]*axis1[2] - normal[2]*axis1[1],
+		normal[2]*axis1[0] - normal[0]*axis1[2],
+		normal[0]*axis1[1] - normal[1]*axis1[0] };
+
+	int first = index * ClusterStars;
+	for (int k = 0; k < ClusterStars; k++)
+	{
+		random.Fill(u, 7);
+		FP_TYPE offset[3];
+		if (ClusterKind_Globular == cluster.kind || u[6] < BulgeShare)
+		{	// Plummer sphere by inverse of its mass within r: m = r^3 / (r^2 + a^2)^1.5, truncated at radius
+			FP_TYPE a = radius * ((ClusterKind_Globular == cluster.kind) ? (FP_TYPE)0.25 : (FP_TYPE)0.08);
+			FP_TYPE mMax = radius*radius*radius / pow(radius*radius + a*a, (FP_TYPE)1.5);
+			FP_TYPE m = (one - u[0])*mMax; // (0, mMax]
+			FP_TYPE r = a / sqrt(max(pow(m, (FP_TYPE)(-2.0 / 3.0)) - one, (FP_TYPE)1e-6));
+			FP_TYPE dz = 2*u[1] - one, dr = sqrt(max((FP_TYPE)0.0, one - dz*dz));
+			offset[0] = r*dr*cos(pi2*u[2]);
+			offset[1] = r*dr*sin(pi2*u[2]);
+			offset[2] = r*dz;
+		}
+		else
+		{	// Radius of exponential disk (scale h) has Gamma(2, h) distribution - sum of two exponential ones, truncated at radius
+			FP_TYPE h = radius * (FP_TYPE)0.25;
+			FP_TYPE r = -h*(log(one - u[0]) + log(one - u[1]));
+			while (r > radius)
+			{
+				random.Fill(u, 2);
+				r = -h*(log(one - u[0]) + log(one - u[1]));
+			}
+			FP_TYPE angle = ((u[2] < (FP_TYPE)0.5) ? 0 : pi2/2) + ArmTwist*log(one + r/h) + (u[3] - (FP_TYPE)0.5)*ArmWidth;
+			FP_TYPE c = r*cos(angle), s = r*sin(angle);
+			FP_TYPE height = radius*DiskThickness*(u[4] + u[5] - one); // Triangular, denser to plane
+			for (int j = 0; j < 3; j++)
+				offset[j] = axis1[j]*c + axis2[j]*s + normal[j]*height;
+		}
+		offsetX[first + k] = offset[0];
+		offsetY[first + k] = offset[1];
+		offsetZ[first + k] = offset[2];
+
+		int i = clusterFirst + first + k;
+		stars.size[i] = StarSizeFactor*RandomSize(random.NextFloat());
+		stars.color[i] = (UINT8)(cluster.colorFrom + min((int)(random.NextFloat()*ClusterColors), ClusterColors - 1));
+		stars.state[i] = State_Clustered;
+		stars.fadeIn[i] = 0;
+	}
+	cluster.generated = true;
+}
+
+// Cull cluster by its bounding sphere and decide how it is drawn, impostor is projected
+// cluster - cluster moved for current frame, receives view and viewed values of impostor
+// Return Value: false if cluster is out of view and should be respawned
+bool StarFly2::ViewCluster( Cluster& cluster )
+{
+	static const FP_TYPE one = (FP_TYPE)1.0;
+	static const FP_TYPE pi = (FP_TYPE)3.14159265358979323846;
+	FP_TYPE radius = cluster.radius;
+	cluster.view = ClusterView_Hidden;
+	if (0 > cluster.z + radius)
+		return false; // Behind viewer
+	if (FreeCamera && cluster.z - radius > FarPlane * Star::giantFactor)
+		return false; // Beyond far plane of giants - it could go away only with free camera
+	for (int side = 0; side < 4; side++)
+		if (viewPlanes[side][0]*cluster.x + viewPlanes[side][1]*cluster.y + viewPlanes[side][2]*cluster.z > radius)
+			return false; // Outside of side of viewed pyramid
+
+	FP_TYPE k1 = ScreenScale/cluster.z;
+	if (cluster.z <= radius || radius*k1 >= ImpostorRadius)
+	{
+		cluster.view = ClusterView_Stars;
+		return true;
+	}
+
+	// Far - its stars (as ones of average size) are spread over disk of glow
+	cluster.view = ClusterView_Impostor;
+	cluster.xp = CenterX*ScreenWidth + cluster.x*k1;
+	cluster.yp = CenterY*ScreenHeight + cluster.y*k1;
+	cluster.viewSize = radius*k1;
+	FP_TYPE dist = sqrt(cluster.x*cluster.x + cluster.y*cluster.y + cluster.z*cluster.z);
+	FP_TYPE starFade = pow(min(clusterStarSize/dist, one), FadePower);
+	FP_TYPE cover = ClusterStars / max(one, pi*cluster.viewSize*cluster.viewSize); // Stars per pixel
+	cluster.fade = min(one, starFade * ((NULL != lightBuffer) ? cover : min(cover, one))); // Light adds only in additive mode, otherwise nearest star is seen
+	return true;
+}
+
+// Move, cull and respawn clusters of chunk, place and project stars of near ones
+// Clusters are split between chunks as stars, so it runs in parallel after projection of stars of same chunk
+// chunk - index of chunk, visible stars are put into its clusterStars
+void StarFly2::ProcessClusters( int chunk )
+{
+	IndexList& visible = clusterStars[chunk];
+	IndexList& hidden = clusterHidden[chunk];
+	visible.Clear();
+	FP_TYPE turn[9];
+	for (int k = 0; k < 9; k++)
+		turn[k] = (FP_TYPE)cameraTurn[k];
+
+	int from = (int)((INT64)ClusterCount * chunk / ChunkCount);
+	int to = (int)((INT64)ClusterCount * (chunk + 1) / ChunkCount);
+	for (int index = from; index < to; index++)
+	{
+		Cluster& cluster = clusters[index];
+		if (FreeCamera)
+		{	// Center is moved as star
+			FP_TYPE x0 = cluster.x - frameShift[0];
+			FP_TYPE y0 = cluster.y - frameShift[1];
+			FP_TYPE z0 = cluster.z - frameShift[2];
+			cluster.x = frameRotation[0]*x0 + frameRotation[1]*y0 + frameRotation[2]*z0;
+			cluster.y = frameRotation[3]*x0 + frameRotation[4]*y0 + frameRotation[5]*z0;
+			cluster.z = frameRotation[6]*x0 + frameRotation[7]*y0 + frameRotation[8]*z0;
+		}
+		else
+			cluster.z -= frameMovedZ;
+		if (!ViewCluster(cluster))
+		{	// Whole cluster is out of sight - new one in the distance
+			Random respawn; // Own generator of cluster, from seed of its stars, so clusters do not depend on chunks
+			respawn.Seed(cluster.seed ^ 0x5BD1E995u);
+			SpawnCluster(cluster, false, respawn);
+			if (!ViewCluster(cluster))
+				continue; // Only by rounding, it is respawned on next frame
+		}
+		if (ClusterView_Stars != cluster.view)
+			continue;
+
+		// Near - stars are placed around center and projected as not moving ones
+		if (!cluster.generated)
+			GenerateClusterStars(index);
+		int first = clusterFirst + index * ClusterStars;
+		int last = first + ClusterStars;
+		const FP_TYPE* ox = offsetX + (size_t)index * ClusterStars; // Offsets of this cluster, k-th one is of star first + k
+		const FP_TYPE* oy = offsetY + (size_t)index * ClusterStars;
+		const FP_TYPE* oz = offsetZ + (size_t)index * ClusterStars;
+		if (FreeCamera)
+			for (int k = 0; k < ClusterStars; k++)
+			{
+				int i = first + k;
+				stars.x[i] = cluster.x + turn[0]*ox[k] + turn[1]*oy[k] + turn[2]*oz[k];
+				stars.y[i] = cluster.y + turn[3]*ox[k] + turn[4]*oy[k] + turn[5]*oz[k];
+				stars.z[i] = cluster.z + turn[6]*ox[k] + turn[7]*oy[k] + turn[8]*oz[k];
+			}
+		else
+			for (int k = 0; k < ClusterStars; k++)
+			{
+				int i = first + k;
+				stars.x[i] = cluster.x + ox[k];
+				stars.y[i] = cluster.y + oy[k];
+				stars.z[i] = cluster.z + oz[k];
+			}
+
+		hidden.Clear();
+		if (UseSimd) // Range is whole SIMD blocks
+			(this->*clusterKernel)(first, last, 0, 0, hidden);
+		else
+			for (int i = first; i < last; i++)
+			{
+				Star star;
+				stars.Get(i, star);
+				if (!star.Project(this))
+					hidden.Push(i);
+				stars.Set(i, star);
+			}
+		for (int i = first, k = 0; i < last; i++)
+		{	// Hidden ones are in ascending order
+			if (k < hidden.count && hidden.data[k] == i)
+				k++;
+			else
+				visible.Push(i);
+		}
+	}
+}
+
+// Render glows of far clusters and visible stars of near ones
+// rowFrom, rowTo, dirty, counters - as for DrawStar
+void StarFly2::DrawClusters( int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters )
+{
+	for (int index = 0; index < ClusterCount; index++)
+	{
+		const Cluster& cluster = clusters[index];
+		if (ClusterView_Impostor == cluster.view &&
+			cluster.yp + cluster.viewSize + 3 >= rowFrom && cluster.yp - cluster.viewSize - 3 < rowTo)
+			DrawImpostor(cluster, rowFrom, rowTo, dirty, counters);
+	}
+	for (int chunk = 0; chunk < ChunkCount; chunk++)
+	{
+		const IndexList& visible = clusterStars[chunk];
+		for (int k = 0; k < visible.count; k++)
+		{
+			int i = visible.data[k];
+			FP_TYPE reach = max(stars.viewSize[i], (FP_TYPE)1.0) + 3; // Bounds of DrawStar with reserve, as StarRows
+			if (stars.yp[i] + reach < rowFrom || stars.yp[i] - reach >= rowTo)
+				continue;
+			DrawStar(stars.xp[i], stars.yp[i], stars.viewSize[i], stars.fade[i], stars.z[i],
+				palette[stars.color[i]], rowFrom, rowTo, dirty, counters);
+		}
+	}
+}
+
+// Render glow of far cluster - nested circles, each one of half radius and twice brighter (up to 3)
+// Sum of light is the same as of uniform disk with average fade, in additive mode inner circles add only rise of level
+// cluster - projected impostor
+// rowFrom, rowTo, dirty, counters - as for DrawStar
+void StarFly2::DrawImpostor( const Cluster& cluster, int rowFrom, int rowTo, IndexList& dirty, FrameCounters& counters )
+{
+	static const FP_TYPE norm[3] = { (FP_TYPE)1.0, (FP_TYPE)1.25, (FP_TYPE)1.375 }; // Light of levels 1, 2, 4 by share of area
+	UINT32 color = palette[cluster.colorFrom + ClusterColors / 2];
+	int layers = (cluster.viewSize >= 4) ? 3 : ((cluster.viewSize >= 2) ? 2 : 1); // Inner circle is at least pixel wide
+	FP_TYPE base = cluster.fade / norm[layers - 1];
+	FP_TYPE radius = cluster.viewSize;
+	for (int layer = 0; layer < layers; layer++, radius *= (FP_TYPE)0.5)
+	{
+		FP_TYPE level = base * (FP_TYPE)(1 << layer);
+		if (NULL != lightBuffer && 0 < layer)
+			level *= (FP_TYPE)0.5; // Added to previous one
+		DrawStar(cluster.xp, cluster.yp, radius, level, cluster.z, color, rowFrom, rowTo, dirty, counters);
+	}
+}
+
+// Allocate ring of depth buckets, stars are placed into it when generated
+// Return Value: true on success
+bool StarFly2::InitializeDepthOrder()
+{
+	DestroyDepthOrder();
+	depthRing = new IndexList[DepthBuckets];
+	starBucket = new int[stars.capacity]; // Field could grow within pool
+	starEntry = new int[stars.capacity];
+	chunkBuckets = new int[ChunkCount + 1];
+	nearBucket = 0;
+	depthDistance = 0;
+	for (int i = 0; i < stars.capacity; i++)
+		starBucket[i] = -1;
+	return true;
+}
+
+// Free ring of depth buckets
+void StarFly2::DestroyDepthOrder()
+{
+	delete[] depthRing;
+	delete[] starBucket;
+	delete[] starEntry;
+	delete[] chunkBuckets;
+	depthRing = NULL;
+	starBucket = NULL;
+	starEntry = NULL;
+	chunkBuckets = NULL;
+}
+
+// Move star into bucket of its absolute depth, after star was generated
+// index - index of star
+void StarFly2::PlaceStar( int index )
+{
+	int previous = starBucket[index];
+	if (0 <= previous)
+	{	// Remove from previous bucket - last entry takes its place
+		IndexList& list = depthRing[previous];
+		int last = list.data[--list.count];
+		list.data[starEntry[index]] = last;
+		starEntry[last] = starEntry[index];
+	}
+
+	LONGLONG bucket = (LONGLONG)floor((stars.z[index] + depthDistance) / DepthBucketDepth);
+	bucket = min(max(bucket, nearBucket), nearBucket + DepthBuckets - 1);
+	int slot = (int)(bucket % DepthBuckets);
+	starBucket[index] = slot;
+	starEntry[index] = depthRing[slot].count;
+	depthRing[slot].Push(index);
+}
+
+// Advance ring of depth buckets by distance of frame, place respawned stars and split buckets into chunks
+// Should be called after projection and respawn of frame, not in parallel
+void StarFly2::UpdateDepthOrder()
+{
+	depthDistance += frameMovedZ;
+
+	// Buckets passed by viewer contain only stars behind viewer, they are respawned (or inactive)
+	LONGLONG bucket = (LONGLONG)floor(depthDistance / DepthBucketDepth);
+	for (LONGLONG passed = max(nearBucket, bucket - DepthBuckets); passed < bucket; passed++)
+	{
+		IndexList& list = depthRing[passed % DepthBuckets];
+		for (int k = 0; k < list.count; k++)
+			starBucket[list.data[k]] = -1;
+		list.Clear();
+	}
+	nearBucket = max(nearBucket, bucket);
+
+	for (int chunk = 0; chunk < ChunkCount; chunk++)
+		for (int k = 0; k < respawns[chunk].count; k++)
+			PlaceStar(respawns[chunk].data[k]);
+
+	// Chunks of about equal number of stars, far buckets are more populated
+	LONGLONG farBucket = nearBucket + DepthBuckets - 1;
+	INT64 total = 0, passed = 0;
+	for (int slot = 0; slot < DepthBuckets; slot++)
+		total += depthRing[slot].count;
+	int chunk = 0;
+	chunkBuckets[0] = 0;
+	for (int step = 0; step < DepthBuckets && chunk + 1 < ChunkCount; step++)
+	{
+		passed += depthRing[(farBucket - step) % DepthBuckets].count;
+		while (chunk + 1 < ChunkCount && passed * ChunkCount >= total * (chunk + 1))
+			chunkBuckets[++chunk] = step + 1;
+	}
+	while (chunk < ChunkCount)
+		chunkBuckets[++chunk] = DepthBuckets;
+}
+
+// Build palette of star colors for ColorType and DarkestRGB
+// Random colors are taken from generator, so it should be seeded
+void StarFly2::BuildPalette()
+{
+	const FP_TYPE colorRand = (FP_TYPE)(256 - DarkestRGB); // Span of color generation
+	const FP_TYPE colorRange = (FP_TYPE)(255 - DarkestRGB); // Colorization
+	for (int index = 0; index < PaletteSize; index++)
+	{
+		UINT8 r, g, b;
+		if (ColorType_RandomRGB == ColorType)
+		{
+			// Random color in range [DarkestRGB, 256)
+			// Could produce green, purple, cyan and so on - colors are not possible in real space
+			FP_TYPE u[3];
+			random.Fill(u, 3);
+			r = DarkestRGB + (UINT8)(u[0]*colorRand);
+			g = DarkestRGB + (UINT8)(u[1]*colorRand);
+			b = DarkestRGB + (UINT8)(u[2]*colorRand);
+		}
+		else //if (ColorType_RandomBlackBody == ColorType)
+		{
+			// Black-body radiation color, evenly by BV
+			// Based on https://stackoverflow.com/questions/21977786/star-b-v-color-index-to-apparent-rgb-color/#22630970  (optimized a bit)
+			FP_TYPE t, bv = (FP_TYPE)(-0.4 + (index + 0.5)*2.4/PaletteSize); // BV in range [-0.4, 2.4)
+			// Convert BV into RGB
+			r = DarkestRGB, b = DarkestRGB, g = DarkestRGB;
+			if (bv < 0.00) // Switch for red
+			{
+				t = (FP_TYPE)((bv + 0.40)/(0.00 + 0.40));
+				r += (UINT8)(colorRange*(0.61+(0.11*t)+(0.1*t*t)));
+			}
+			else if (bv < 0.40)
+			{
+				t = (FP_TYPE)((bv - 0.00)/(0.40 - 0.00));
+				r += (UINT8)(colorRange*(0.83+(0.17*t)));
+			}
+			else
+				r += (UINT8)(colorRange);
+			if (bv < 0.00) // Switch for green
+			{
+				t = (FP_TYPE)((bv + 0.40)/(0.00 + 0.40));
+				g += (UINT8)(colorRange*(0.70+(0.07*t)+(0.1*t*t)));
+			}
+			else if (bv < 0.40)
 			{
 				t = (FP_TYPE)((bv - 0.00)/(0.40 - 0.00));
 				g += (UINT8)(colorRange*(0.87+(0.11*t)));
@@ -388,85 +4609,776 @@ void Star::Process( StarFly2* app )
 				b += (UINT8)(colorRange*(0.63-(0.6*t*t)));
 			}
 		}
-	} // Will rerun projection due to while-true loop
+		palette[index] = (r << 16) | (g << 8) | b; // Same order of bytes as in frame - B, G, R
+	}
 }
 
-// Render star to memory buffer
-// app - pointer to main object
-void Star::Render( StarFly2* app )
+// Split stars between field and background
+// count - number of all stars
+// field, back - receive numbers of field stars and stars of background
+void StarFly2::SplitStars( int count, int& field, int& back ) const
 {
-	static const FP_TYPE minSize = (FP_TYPE)0.8; // If larger - draw as circle, smaller - just 1 pixel
-	UINT16 zp = (UINT16)z; // z-buffer value
-	UINT8 r0 = (UINT8)(r*fade), g0 = (UINT8)(g*fade), b0 = (UINT8)(b*fade);
+	field = count;
+	back = 0;
+	if (0 < fieldDepth && fieldDepth < 1)
+	{	// Field stars fill nearer part of pyramid with same density, its volume is cube of depth
+		field = max(1, (int)(count * (double)fieldDepth * fieldDepth * fieldDepth + 0.5));
+		back = max(0, count - field);
+	}
+}
+
+// Distance of fly between bakes of background
+// Farther stars move slower on screen, the fastest ones are nearest stars of shell in corners of screen
+FP_TYPE StarFly2::BackgroundStep() const
+{
+	FP_TYPE dx = max(CenterX, (FP_TYPE)1.0 - CenterX) * ScreenWidth;
+	FP_TYPE dy = max(CenterY, (FP_TYPE)1.0 - CenterY) * ScreenHeight;
+	return BackgroundError * fieldDepth * FarPlane / max((FP_TYPE)1.0, sqrt(dx*dx + dy*dy));
+}
+
+// Take buffers of pixels for current frame size and RowStride from arena of frame, stars are kept
+// Background is cleared and baked again by next frames
+// Return Value: true on success
+bool StarFly2::AllocatePixels()
+{
+	// Buffers of pixels have rows of frame, they are cleared by first frame
+	size_t pixels = (size_t)RowStride * ScreenHeight;
+	bool useZ = !UseAdditive && !UseDepthOrder; // Not needed if light is added or stars are drawn back-to-front
+	bool useBack = (fieldDepth < 1);
+	zBuffer = NULL;
+	lightBuffer = NULL;
+	background = NULL;
+	backLight = NULL;
+	if (!pixelArena.Reserve((useZ ? Arena::Round(pixels * sizeof(UINT16)) : 0) +
+		(UseAdditive ? Arena::Round(pixels * 8) : 0) +
+		(useBack ? Arena::Round(pixels * 4) + (UseAdditive ? Arena::Round(pixels * 8) : 0) : 0)))
+		return false;
+	if (useZ)
+		zBuffer = (UINT16*)pixelArena.Take(pixels * sizeof(UINT16));
+	if (UseAdditive)
+		lightBuffer = (UINT16*)pixelArena.Take(pixels * 8); // 4 channels of 16 bits
+	if (useBack)
+	{	// First frames show background being filled
+		background = (UINT32*)pixelArena.Take(pixels * 4);
+		memset(background, 0, pixels * 4);
+		if (UseAdditive)
+		{
+			backLight = (UINT16*)pixelArena.Take(pixels * 8);
+			memset(backLight, 0, pixels * 8);
+		}
+		backStep = BackgroundStep();
+		bakeBackground = (0 < generatedBack);
+	}
+	clearAll = true;
+	SelectKernels(); // Buffers of frame are known
+	return true;
+}
 
-	if (minSize < viewSize)
+// Allocate pool of StarCount stars, clusters and buffers of pixels, stars are not generated
+// Return Value: true on success
+bool StarFly2::AllocateStars()
+{
+	// One block for stars and clusters, stars of clusters are in pool after field stars, each cluster from whole SIMD block
+	size_t clusterBytes = 0;
+	fieldDepth = (0 < BackgroundDepth && BackgroundDepth < 1 && !FreeCamera) ? BackgroundDepth : (FP_TYPE)1.0; // Far shell could be baked only for forward fly
+	SplitStars(StarCount, fieldStars, backCount);
+	int poolStars = StarCount;
+	if (fieldDepth < 1)
 	{
-		int size1 = ((FP_TYPE)1.0 < viewSize) ? (int)viewSize : 1;
-		int xp1 = (int)xp; // Integer coordinates
-		int yp1 = (int)yp;
+		backFirst = (fieldStars + RandomBlock - 1) / RandomBlock * RandomBlock; // Blocks of generators are not shared with field
+		poolStars = backFirst + backCount;
+	}
+	randomBlocks = (poolStars + RandomBlock - 1) / RandomBlock; // Stars of clusters are not respawned one by one
+	if (0 < ClusterCount)
+	{
+		ClusterStars = (ClusterStars + StarPool::Block - 1) / StarPool::Block * StarPool::Block;
+		clusterFirst = (poolStars + StarPool::Block - 1) / StarPool::Block * StarPool::Block;
+		if (clusterFirst + (INT64)ClusterCount * ClusterStars > 0x7FFFFFFF) // Index of star is int
+			return false;
+		poolStars = clusterFirst + ClusterCount * ClusterStars;
+		clusterBytes = Arena::Round(ClusterCount * sizeof(Cluster)) + 3 * Arena::Round((size_t)ClusterCount * ClusterStars * sizeof(FP_TYPE));
+	}
+	if (!arena.Allocate(StarPool::Bytes(poolStars, UseStreaks) + clusterBytes + Arena::Round(randomBlocks * sizeof(Random))))
+		return false;
+	if (!stars.Allocate(poolStars, UseStreaks, arena))
+		return false;
+	blockRandom = (Random*)arena.Take(randomBlocks * sizeof(Random));
+	Random seeds;
+	seeds.Seed(respawnSeed);
+	for (int block = 0; block < randomBlocks; block++)
+		blockRandom[block].Seed(seeds.Next());
+	if (0 < ClusterCount && !InitializeClusters())
+		return false;
+	if (!AllocatePixels())
+		return false;
+	if (UseSprites && !UseAdditive && !sprites.Build())
+		return false;
+	if (UseDepthOrder && !InitializeDepthOrder())
+		return false;
+	return true;
+}
 
-#if 0 // Square
-		for (int j = max(0,yp1-size1);j<min(yp1+size1,app->ScreenHeight);j++)
-		for (int k = max(0,xp1-size1);k<min(xp1+size1,app->ScreenWidth);k++)
-			app->PutPixelOnBufferZ(k,j, r,g,b ,zp);
-		return;
+// Allocate and generate stars for CPU render
+// Return Value: true on success
+bool StarFly2::InitializeStars()
+{
+	if (!AllocateStars())
+		return false;
+	for (int index = 0; index < ClusterCount; index++)
+		SpawnCluster(clusters[index], true, random);
+
+	// Only first batch before first frame, so start does not depend on number of stars
+	generatedStars = 0;
+	activeStars = 0;
+	generatedBack = 0;
+	bakeBackground = (0 < backCount);
+	backMovedZ = 0;
+	backPassedMs = 0;
+	frameCostMs = 0;
+	governorHold = 0;
+	snapshotStatus = Snapshot_Off;
+	if (0 != snapshotPath[0])
+		snapshotStatus = LoadSnapshot();
+	if (Snapshot_Failed == snapshotStatus)
+	{	// No file yet - whole field is generated now and written, so next start takes same field
+		GenerateStars(StarCount);
+		snapshotStatus = SaveSnapshot() ? Snapshot_Saved : Snapshot_Failed;
+	}
+	else if (Snapshot_Loaded != snapshotStatus)
+		GenerateStars(GenerateBatch);
+
+#if 0	// Debug - star dead ahead
+	stars.x[0] = 0;
+	stars.y[0] = 0;
+	stars.z[0] = 200;
+	stars.size[0] = StarSizeFactor*(FP_TYPE)27.15; // Biggest possible with cur random generator
 #endif
+	return true;
+}
 
-#if 1 // Fine-grained circle with FP center
-		bool drawn = false;
-		FP_TYPE lim = viewSize*viewSize;
-		// Loops (j,k) - on intersection of screen and bounding rectangle around star circle
-		for (int j = max(0, yp1-size1);
-				j < min(yp1+size1+2, app->ScreenHeight); j++)
-		{
-			FP_TYPE yd = j - yp;        // (xd,yd) - vector from star center to current pixel
-			FP_TYPE lim2 = lim - yd*yd; // From 'xd*xd + yd*yd <= lim' we can write 'xd*xd <= lim - yd*yd'
-			if (0 <= lim2)
-				for (int k = max(0, xp1-size1);
-						k < min(xp1+size1+2, app->ScreenWidth); k++)
-				{
-					FP_TYPE xd = k - xp;
-					if (xd*xd > lim2) continue; // Length of vector (xd,yd) is larger than circle radius
-					app->PutPixelOnBufferZ(k,j, r0,g0,b0,zp);
-					drawn = true;
-				}
-			// Note: We could also limit loop on k based on lim2 value, but this will require sqrt calc or something apprx.
-			// Also we could use memset instead of writing r,g,b per byte, but this could improve perf. only if we have many large circles
+// Generate next stars in whole viewed space, they are moved and drawn from next frame
+// Stars generated after start fade-in as respawned ones
+// count - number of stars, at most all not generated yet
+void StarFly2::GenerateStars( int count )
+{
+	int to = min(fieldStars, generatedStars + count);
+	int backTo = min(backCount, generatedBack + max(0, count - (to - generatedStars))); // Background after field stars
+	for (int i = generatedStars; i < to; i++)
+	{
+		Star star;
+		star.z = (FP_TYPE)-1.0; // To trigger randomize in Process
+		star.state = State_New;
+		star.Process(this, random);
+		star.state = State_Generated;
+		if (0 < TotalTimeMs)
+			star.fadeIn = FadeInTime;
+		stars.Set(i, star);
+		if (UseDepthOrder)
+			PlaceStar(i);
+	}
+	if (activeStars == generatedStars)
+		activeStars = to; // Unless governor reduced load
+	generatedStars = to;
+
+	for (int i = backFirst + generatedBack; i < backFirst + backTo; i++)
+	{
+		Star star;
+		star.z = (FP_TYPE)-1.0;
+		star.state = State_NewBackground;
+		star.Process(this, random);
+		star.state = State_Background; // No fade-in, it would wait for next bake
+		stars.Set(i, star);
+	}
+	if (generatedBack < backTo)
+		bakeBackground = true;
+	generatedBack = backTo;
+}
+
+// Change number of stars without new star field: kept stars stay in place, added ones are generated by next frames and fade-in
+// Fewer stars or more within room of pool are just counted, otherwise pool is allocated again and kept stars,
+// clusters and their stars are copied into it; background is baked again
+// count - new number of field and background stars
+// Return Value: false if new pool could not be allocated
+bool StarFly2::ResizeStars( int count )
+{
+	int field, back;
+	SplitStars(max(1, count), field, back);
+	int poolEnd = (0 < ClusterCount) ? clusterFirst : stars.capacity; // Clusters are after field and background
+	int fieldRoom = (fieldDepth < 1) ? backFirst : poolEnd;
+	int backRoom = (fieldDepth < 1) ? poolEnd - backFirst : 0;
+	StarCount = max(1, count);
+	if (field <= fieldRoom && back <= backRoom)
+	{
+		fieldStars = field;
+		backCount = back;
+		generatedStars = min(generatedStars, field);
+		activeStars = min(activeStars, field);
+		generatedBack = min(generatedBack, back);
+		bakeBackground = (0 < back); // Without removed stars
+		return true;
+	}
+
+	// Arrays of previous pool stay valid till its arena is freed
+	Arena previous;
+	previous.Swap(arena);
+	StarPool kept = stars;
+	int keptField = min(generatedStars, field);
+	int keptBack = min(generatedBack, back);
+	int keptActive = min(activeStars, keptField);
+	int keptBackFirst = backFirst;
+	int keptClusterFirst = clusterFirst;
+	Cluster* keptClusters = clusters;
+	const FP_TYPE* keptOffsets[3] = { offsetX, offsetY, offsetZ };
+	FP_TYPE keptClusterSize = clusterStarSize;
+	const Random* keptRandom = blockRandom;
+	int keptBlocks = randomBlocks;
+	if (!AllocateStars())
+		return false;
+
+	// Generators of kept blocks go on, so respawns do not repeat ones since start
+	int keptBackBlock = (fieldDepth < 1) ? keptBackFirst / RandomBlock : keptBlocks;
+	int backBlock = (fieldDepth < 1) ? backFirst / RandomBlock : randomBlocks;
+	memcpy(blockRandom, keptRandom, min(keptBackBlock, backBlock) * sizeof(Random));
+	if (fieldDepth < 1)
+		memcpy(blockRandom + backBlock, keptRandom + keptBackBlock, max(0, min(keptBlocks - keptBackBlock, randomBlocks - backBlock)) * sizeof(Random));
+
+	stars.Copy(kept, 0, 0, keptField);
+	stars.Copy(kept, keptBackFirst, backFirst, keptBack);
+	if (0 < ClusterCount)
+	{
+		size_t members = (size_t)ClusterCount * ClusterStars;
+		memcpy(clusters, keptClusters, ClusterCount * sizeof(Cluster));
+		memcpy(offsetX, keptOffsets[0], members * sizeof(FP_TYPE));
+		memcpy(offsetY, keptOffsets[1], members * sizeof(FP_TYPE));
+		memcpy(offsetZ, keptOffsets[2], members * sizeof(FP_TYPE));
+		stars.Copy(kept, keptClusterFirst, clusterFirst, (int)members);
+		clusterStarSize = keptClusterSize;
+	}
+	previous.Free();
+
+	generatedStars = keptField;
+	activeStars = keptActive;
+	generatedBack = keptBack;
+	bakeBackground = (0 < backCount);
+	if (UseDepthOrder)
+		for (int i = 0; i < keptField; i++)
+			PlaceStar(i);
+	return true;
+}
+
+// Change zoom and center of view, all stars are moved, so they keep their places on screen
+// Star field stays even in new viewed pyramid, new parts of view are filled by respawns
+// zoom - new Zoom
+// centerX, centerY - new CenterX, CenterY
+void StarFly2::ApplyView( FP_TYPE zoom, FP_TYPE centerX, FP_TYPE centerY )
+{
+	FP_TYPE scale = min(ScreenWidth, ScreenHeight) * zoom;
+	FP_TYPE k = ScreenScale / scale; // Screen position x*ScreenScale/z + CenterX*ScreenWidth is kept
+	FP_TYPE dx = (CenterX - centerX) * ScreenWidth / scale;
+	FP_TYPE dy = (CenterY - centerY) * ScreenHeight / scale;
+	for (int i = 0; i < stars.count; i++)
+	{
+		stars.x[i] = stars.x[i] * k + dx * stars.z[i];
+		stars.y[i] = stars.y[i] * k + dy * stars.z[i];
+	}
+	for (int index = 0; index < ClusterCount; index++)
+	{	// Stars of cluster are placed from its center
+		Cluster& cluster = clusters[index];
+		cluster.x = cluster.x * k + dx * cluster.z;
+		cluster.y = cluster.y * k + dy * cluster.z;
+	}
+
+	Zoom = zoom;
+	CenterX = centerX;
+	CenterY = centerY;
+	ScreenScale = scale;
+	XrandSpan = ScreenWidth * FarPlane / ScreenScale;
+	YrandSpan = ScreenHeight * FarPlane / ScreenScale;
+	BuildSpawnSides();
+	if (NULL != background)
+	{
+		backStep = BackgroundStep();
+		bakeBackground = true;
+	}
+	clearAll = true;
+}
+
+// Render frames of new window size (display mode or DPI changed), stars are kept in place
+// Frame, bands and buffers of pixels are taken again (pool of pixels is reused if it fits), spans of spawn follow new view;
+// stars on GPU are generated again for new frame
+// width, height - new frame size
+// Return Value: true on success
+bool StarFly2::ResizeFrame( int width, int height )
+{
+	PresentBackend backend = presenter->Backend(); // GDI stays after fall back
+#ifdef STARFLY2_D3D11
+	bool onGpu = (NULL != gpu);
+	DestroyGpu(); // Uses device of presenter
+#endif
+	ScreenWidth = width;
+	ScreenHeight = height;
+	ScreenScale = min(ScreenWidth, ScreenHeight) * Zoom;
+	XrandSpan = ScreenWidth * FarPlane / ScreenScale;
+	YrandSpan = ScreenHeight * FarPlane / ScreenScale;
+	BuildSpawnSides();
+	InitializeBands();
+	if (!InitializePresenter(backend))
+		return false;
+#ifdef STARFLY2_D3D11
+	if (onGpu && (Backend_D3D11 != presenter->Backend() || !InitializeGpu()))
+		return InitializeStars(); // CPU render
+	if (onGpu)
+		return true;
+#endif
+	return AllocatePixels();
+}
+
+// Fill header of snapshot for current configuration, after stars are allocated
+// header - receives configuration, padding is zeroed, so header could be compared as memory
+void StarFly2::FillSnapshotHeader( SnapshotHeader& header ) const
+{
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, "SF2SNAP", 8);
+	header.version = 3; // Generators of blocks instead of ones of chunks
+	header.fpBytes = sizeof(FP_TYPE);
+	header.width = ScreenWidth;
+	header.height = ScreenHeight;
+	header.stars = StarCount;
+	header.fieldStars = fieldStars;
+	header.backCount = backCount;
+	header.savedStars = (0 < ClusterCount) ? clusterFirst : stars.count;
+	header.clusters = ClusterCount;
+	header.clusterStars = ClusterStars;
+	header.sizeType = SizeType;
+	header.colorType = ColorType;
+	header.darkestRGB = DarkestRGB;
+	header.fastMath = UseFastMath ? 1 : 0; // Sizes are taken from table
+	header.starSize = StarSizeFactor;
+	header.zoom = Zoom;
+	header.centerX = CenterX;
+	header.centerY = CenterY;
+	header.clusterSize = ClusterSize;
+	header.background = BackgroundDepth;
+	header.flyYaw = FlyYaw;
+	header.flyPitch = FlyPitch;
+	header.rotateYaw = RotateYaw;
+	header.rotatePitch = RotatePitch;
+	header.rotateRoll = RotateRoll;
+	header.seed = Seed;
+}
+
+// Arrays of star field in snapshot, same order for save and load
+// Stars of clusters are not saved - they are generated from seeds of clusters, when clusters come near
+// Projected values are saved too, streaks take them as previous positions on first frame
+// data, bytes - receive up to MaxSnapshotArrays arrays
+// Return Value: number of arrays
+int StarFly2::SnapshotArrays( void** data, size_t* bytes )
+{
+	size_t count = (0 < ClusterCount) ? clusterFirst : stars.count;
+	size_t fp = count * sizeof(FP_TYPE);
+	int arrays = 0;
+	data[arrays] = palette;       bytes[arrays++] = sizeof(palette);
+	data[arrays] = &random;       bytes[arrays++] = sizeof(random);
+	data[arrays] = blockRandom;   bytes[arrays++] = randomBlocks * sizeof(Random);
+	data[arrays] = stars.x;       bytes[arrays++] = fp;
+	data[arrays] = stars.y;       bytes[arrays++] = fp;
+	data[arrays] = stars.z;       bytes[arrays++] = fp;
+	data[arrays] = stars.size;    bytes[arrays++] = fp;
+	data[arrays] = stars.fadeIn;  bytes[arrays++] = count * sizeof(int);
+	data[arrays] = stars.xp;      bytes[arrays++] = fp;
+	data[arrays] = stars.yp;      bytes[arrays++] = fp;
+	data[arrays] = stars.viewSize; bytes[arrays++] = fp;
+	data[arrays] = stars.fade;    bytes[arrays++] = fp;
+	data[arrays] = stars.color;   bytes[arrays++] = count;
+	data[arrays] = stars.state;   bytes[arrays++] = count * sizeof(StarState);
+	data[arrays] = clusters;      bytes[arrays++] = ClusterCount * sizeof(Cluster);
+	return arrays;
+}
+
+// Take whole star field from snapshot file, which is mapped into memory and copied into pool
+// Generators of blocks are restored too, so frames after load do not depend on number of threads
+// Return Value: Snapshot_Loaded on success, Snapshot_Failed if there is no file, Snapshot_Mismatch if it is for other configuration
+SnapshotStatus StarFly2::LoadSnapshot()
+{
+	HANDLE file = CreateFile(snapshotPath, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (INVALID_HANDLE_VALUE == file)
+		return Snapshot_Failed;
+
+	SnapshotStatus status = Snapshot_Mismatch;
+	DWORD high = 0;
+	DWORD low = GetFileSize(file, &high);
+	UINT64 fileBytes = ((UINT64)high << 32) | low;
+	HANDLE mapping = (sizeof(SnapshotHeader) <= fileBytes) ? CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL) : NULL;
+	const UINT8* view = (NULL != mapping) ? (const UINT8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+	if (NULL != view)
+	{
+		SnapshotHeader expected;
+		FillSnapshotHeader(expected);
+		const SnapshotHeader* header = (const SnapshotHeader*)view;
+		void* data[MaxSnapshotArrays];
+		size_t bytes[MaxSnapshotArrays];
+		int arrays = SnapshotArrays(data, bytes);
+		UINT64 total = sizeof(SnapshotHeader);
+		for (int i = 0; i < arrays; i++)
+			total += bytes[i];
+		if (0 == memcmp(header, &expected, FIELD_OFFSET(SnapshotHeader, seed)) && header->bytes == fileBytes && total == fileBytes)
+		{
+			const UINT8* from = view + sizeof(SnapshotHeader);
+			for (int i = 0; i < arrays; i++)
+			{
+				memcpy(data[i], from, bytes[i]);
+				from += bytes[i];
+			}
+			status = Snapshot_Loaded;
+		}
+		UnmapViewOfFile(view);
+	}
+	if (NULL != mapping)
+		CloseHandle(mapping);
+	CloseHandle(file);
+	if (Snapshot_Loaded != status)
+		return status;
+
+	// Whole field is generated
+	generatedStars = fieldStars;
+	activeStars = fieldStars;
+	generatedBack = backCount;
+	bakeBackground = (0 < backCount);
+	if (UseDepthOrder)
+		for (int i = 0; i < fieldStars; i++)
+			PlaceStar(i);
+	return status;
+}
+
+// Write whole generated star field into snapshot file, before first frame
+// Return Value: true on success, incomplete file is deleted
+bool StarFly2::SaveSnapshot()
+{
+	SnapshotHeader header;
+	FillSnapshotHeader(header);
+	void* data[MaxSnapshotArrays];
+	size_t bytes[MaxSnapshotArrays];
+	int arrays = SnapshotArrays(data, bytes);
+	header.bytes = sizeof(SnapshotHeader);
+	for (int i = 0; i < arrays; i++)
+		header.bytes += bytes[i];
+
+	FILE* output = NULL;
+	if (0 != fopen_s(&output, snapshotPath, "wb") || NULL == output)
+		return false;
+	bool written = (1 == fwrite(&header, sizeof(header), 1, output));
+	for (int i = 0; written && i < arrays; i++)
+		written = (bytes[i] == fwrite(data[i], 1, bytes[i], output));
+	written = (0 == fclose(output)) && written;
+	if (!written)
+		remove(snapshotPath); // Incomplete file would be rejected, but never written again
+	return written;
+}
+
+// Switch to GDI presenter and CPU render after failure of Direct3D 11 (e.g. device lost)
+// Star field is generated again if it was on GPU, buffers of pixels are taken again if rows of new frame have other pitch
+// Return Value: true on success
+bool StarFly2::FallBackToGdi()
+{
+	bool generate = false;
+	int stride = RowStride;
+#ifdef STARFLY2_D3D11
+	if (NULL != gpu)
+	{
+		DestroyGpu();
+		generate = true;
+	}
+#endif
+	if (!InitializePresenter(Backend_Gdi))
+		return false;
+	if (generate)
+		return InitializeStars();
+	if (stride != RowStride)
+		return AllocatePixels();
+	return true;
+}
+
+// Create presenter and render into its frame, previous presenter is destroyed
+// Frame is taken by BeginFrame on each frame, here only its pitch is known
+// backend - preferred backend, GDI is used if Direct3D 11 fails
+// Return Value: true on success
+bool StarFly2::InitializePresenter( PresentBackend backend )
+{
+	DestroyPresenter();
+	if (Backend_Memory == backend)
+	{
+		presenter = new MemoryPresenter();
+		if (!presenter->Initialize(OurWindow, ScreenWidth, ScreenHeight))
+		{
+			DestroyPresenter();
+			return false;
+		}
+		RowStride = presenter->Pitch() / 4;
+		return true;
+	}
+#ifdef STARFLY2_D3D11
+	if (Backend_D3D11 == backend)
+	{
+		presenter = new D3D11Presenter();
+		if (presenter->Initialize(OurWindow, ScreenWidth, ScreenHeight))
+		{
+			RowStride = presenter->Pitch() / 4;
+			return true;
 		}
+		DestroyPresenter();
+	}
 #endif
-		if (drawn)
-			return;
-		// If no pixels were drawn - fall back to single point
+	presenter = new GdiPresenter();
+	if (!presenter->Initialize(OurWindow, ScreenWidth, ScreenHeight))
+	{
+		DestroyPresenter();
+		return false;
 	}
-	// Single point
-	app->PutPixelOnBufferCheckZ((int)xp,(int)yp,r0,g0,b0,zp);
+	RowStride = presenter->Pitch() / 4;
+	return true;
 }
 
-// Put single pixel into memory buffer without screen border checks
-// x,y - coordinates
-// r,g,b - color
-// z - z-buffer value
-void StarFly2::PutPixelOnBufferZ(int x, int y, UINT8 r, UINT8 g, UINT8 b, UINT16 z)
+// Free presenter and its frame
+void StarFly2::DestroyPresenter()
 {
-	if (zBuffer[x + y*ScreenWidth] < z) // Check z-buffer
-		return;
-	int offset = (x + y*ScreenWidth)<<2;
-	// Rows are inverted in DIB Section, but our star field looks the same
-	MemBuffer[offset] = b;   // Blue
-	MemBuffer[offset+1] = g; // Green
-	MemBuffer[offset+2] = r; // Red
-	zBuffer[x + y*ScreenWidth] = z;
+	delete presenter;
+	presenter = NULL;
+	MemBuffer = NULL;
+	clearAll = true; // New frame is not cleared by dirty spans
 }
 
-// Put single pixel into memory buffer with border checks
-// x,y - coordinates
-// r,g,b - color
-// z - z-buffer value
-void StarFly2::PutPixelOnBufferCheckZ(int x, int y, UINT8 r, UINT8 g, UINT8 b, UINT16 z)
+#ifdef STARFLY2_D3D11
+// Create GPU render and generate all stars into its buffer
+// Return Value: false if GPU render is not available, then CPU one should be used
+bool StarFly2::InitializeGpu()
 {
-	if (0>x || 0>y || x>=ScreenWidth || y>=ScreenHeight)
-		return;
-	PutPixelOnBufferZ(x,y, r,g,b, z);
+	gpu = new GpuStarRenderer();
+	exitRing = new IndexList[ExitBuckets];
+	nextExit = 0;
+	gpuDistance = 0;
+
+	GpuStar* mapped = NULL;
+	if (gpu->Initialize(static_cast<D3D11Presenter*>(presenter), ScreenWidth, ScreenHeight, StarCount) &&
+		NULL != (mapped = gpu->MapStars(true)))
+	{
+		for (int i = 0; i < StarCount; i++)
+			SpawnGpuStar(i, State_New, mapped[i]);
+		generatedStars = StarCount;
+		activeStars = StarCount; // Governor is not used
+		gpu->UnmapStars();
+		return true;
+	}
+	DestroyGpu();
+	return false;
+}
+
+// Free GPU render
+void StarFly2::DestroyGpu()
+{
+	delete gpu;
+	delete[] exitRing;
+	gpu = NULL;
+	exitRing = NULL;
+}
+
+// Respawn stars, which left view, and render frame on GPU
+// Return Value: true on success
+bool StarFly2::RenderStarsGpu()
+{
+	LONGLONG start = FrameProfiler::Now();
+	gpuDistance += frameMovedZ;
+
+	// Buckets, which are completely passed, contain only stars out of view
+	GpuStar* mapped = NULL;
+	while ((nextExit + 1) * ExitBucketDepth <= gpuDistance)
+	{
+		IndexList& bucket = exitRing[nextExit % ExitBuckets];
+		nextExit++; // Respawned stars go to later buckets
+		if (0 == bucket.count)
+			continue;
+		if (NULL == mapped && NULL == (mapped = gpu->MapStars(false)))
+			return false;
+		for (int k = 0; k < bucket.count; k++)
+			SpawnGpuStar(bucket.data[k], State_Generated, mapped[bucket.data[k]]);
+		frameRespawns += bucket.count;
+		bucket.Clear();
+	}
+	if (NULL != mapped)
+		gpu->UnmapStars();
+	LONGLONG respawned = FrameProfiler::Now();
+	profiler.Add(Phase_Process, respawned - start);
+
+	GpuFrame frame;
+	memset(&frame, 0, sizeof(frame));
+	frame.screen[0] = (FP_TYPE)ScreenWidth;
+	frame.screen[1] = (FP_TYPE)ScreenHeight;
+	frame.screen[2] = CenterX*ScreenWidth;
+	frame.screen[3] = CenterY*ScreenHeight;
+	frame.view[0] = ScreenScale;
+	frame.view[1] = (FP_TYPE)fmod(gpuDistance, (double)GpuStarRenderer::DepthWrap);
+	frame.view[2] = FadePower;
+	frame.view[3] = FadeInK;
+	frame.time[0] = TotalTimeMs;
+	bool Result = gpu->Render(frame);
+	profiler.Add(Phase_Raster, FrameProfiler::Now() - respawned); // Only submission, GPU works asynchronously
+	return Result;
+}
+
+// Generate star for GPU render and put it into bucket of its exit from view
+// index - index of star
+// state - State_New for initial generation in whole view, State_Generated for new star on FarPlane
+// target - receives star
+void StarFly2::SpawnGpuStar( int index, StarState state, GpuStar& target )
+{
+	Star star;
+	star.z = (FP_TYPE)-1.0; // To trigger randomize in Process
+	star.state = state;
+	star.Process(this, random);
+
+	target.x = star.x;
+	target.y = star.y;
+	target.z = (FP_TYPE)fmod(star.z + gpuDistance, (double)GpuStarRenderer::DepthWrap);
+	target.size = star.size;
+	target.fadeInEnd = TotalTimeMs + star.fadeIn;
+	UINT32 color = palette[star.color];
+	target.color = ((color >> 16) & 0xFF) | (color & 0xFF00) | ((color & 0xFF) << 16); // R in lowest byte
+
+	// Star is respawned when its whole bucket is passed, so it is never removed while visible
+	double exit = gpuDistance + (star.z - ExitDepth(star));
+	LONGLONG bucket = max((LONGLONG)floor(exit / ExitBucketDepth), nextExit);
+	exitRing[bucket % ExitBuckets].Push(index);
+}
+
+// Depth, at which star leaves view
+// star - star visible now, its screen position only grows with decreasing depth
+// Return Value: depth at which star is not visible anymore
+FP_TYPE StarFly2::ExitDepth( const Star& star ) const
+{
+	// Depth at which center crosses border of screen, exact for stars smaller than 1 pixel there
+	FP_TYPE exit = 0;
+	FP_TYPE centerX = CenterX*ScreenWidth;
+	FP_TYPE centerY = CenterY*ScreenHeight;
+	FP_TYPE borderX = (0 < star.x) ? ScreenWidth - centerX : centerX;
+	FP_TYPE borderY = (0 < star.y) ? ScreenHeight - centerY : centerY;
+	if (0 < borderX)
+		exit = max(exit, (FP_TYPE)fabs(star.x) * ScreenScale / borderX);
+	if (0 < borderY)
+		exit = max(exit, (FP_TYPE)fabs(star.y) * ScreenScale / borderY);
+	if (!VisibleAt(star, exit))
+		return exit;
+
+	// Bigger circle is still partially seen - bisection downto 1/4096 of depth
+	FP_TYPE hidden = 0;
+	for (int i = 0; i < 12; i++)
+	{
+		FP_TYPE z = (hidden + exit) * (FP_TYPE)0.5;
+		if (VisibleAt(star, z))
+			exit = z;
+		else
+			hidden = z;
+	}
+	return hidden;
+}
+
+// Check of Star::Project at given depth
+// star - star
+// z - depth
+// Return Value: true if star is visible
+bool StarFly2::VisibleAt( const Star& star, FP_TYPE z ) const
+{
+	if (0 >= z)
+		return false;
+	FP_TYPE viewSize = star.size / sqrt(star.x*star.x + star.y*star.y + z*z);
+	int size1 = (int)viewSize;
+	FP_TYPE k1 = ScreenScale/z;
+	FP_TYPE xp = CenterX*ScreenWidth + star.x * k1;
+	if (xp<-size1 || xp>=(ScreenWidth+size1))
+		return false;
+	FP_TYPE yp = CenterY*ScreenHeight + star.y * k1;
+	return !(yp<-size1 || yp>=(ScreenHeight+size1));
+}
+#endif
+
+// Start worker threads and prepare chunks and bands
+// Return Value: true on success
+bool StarFly2::InitializeThreads()
+{
+	int threads = ThreadCount;
+	if (0 >= threads)
+	{	// Auto - one thread per logical processor, shared by surfaces of monitors
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		threads = max(1, (int)info.dwNumberOfProcessors / SurfaceCount);
+	}
+	threads = max(1, min(threads, 64));
+	if (!workers.Start(threads - 1))
+		return false;
+
+	threads = workers.Threads();
+	ChunkCount = (1 == threads) ? 1 : threads * 4; // Several tasks per thread for load balancing
+
+	respawns = new IndexList[ChunkCount];
+	clusterStars = new IndexList[ChunkCount];
+	clusterHidden = new IndexList[ChunkCount];
+	backRespawns = new IndexList[ChunkCount];
+	InitializeBands();
+	return true;
+}
+
+// Split frame into bands of rows for render tasks, again when frame height changes
+void StarFly2::InitializeBands()
+{
+	DestroyBands();
+	int threads = workers.Threads();
+	BandCount = (1 == threads) ? 1 : max(1, min(threads * 4, ScreenHeight));
+
+	bins = new IndexList[ChunkCount * BandCount];
+	dirty = new IndexList[BandCount];
+	counters = new FrameCounters[BandCount];
+	backBins = new IndexList[ChunkCount * BandCount];
+	for (int band = 0; band < BandCount; band++)
+		counters[band].Clear();
+	bandRows = new int[BandCount + 1];
+	rowBand = new int[ScreenHeight];
+	for (int band = 0; band <= BandCount; band++)
+		bandRows[band] = ScreenHeight * band / BandCount;
+	for (int band = 0; band < BandCount; band++)
+		for (int row = bandRows[band]; row < bandRows[band + 1]; row++)
+			rowBand[row] = band;
+	clearAll = true; // Dirty rectangles of previous bands are lost
+}
+
+// Free bands of rows with their bins and dirty rectangles
+void StarFly2::DestroyBands()
+{
+	delete[] bins;
+	delete[] dirty;
+	delete[] counters;
+	delete[] backBins;
+	delete[] bandRows;
+	delete[] rowBand;
+	bins = NULL;
+	dirty = NULL;
+	counters = NULL;
+	backBins = NULL;
+	bandRows = NULL;
+	rowBand = NULL;
+	clearAll = true;
+}
+
+// Stop worker threads and free chunks and bands
+void StarFly2::DestroyThreads()
+{
+	workers.Stop();
+	DestroyBands();
+	delete[] respawns;
+	delete[] clusterStars;
+	delete[] clusterHidden;
+	delete[] backRespawns;
+	respawns = NULL;
+	clusterStars = NULL;
+	clusterHidden = NULL;
+	backRespawns = NULL;
 }
 
 // Main object constructor
@@ -490,74 +5402,399 @@ StarFly2::StarFly2()
 	ColorType = ColorType_RandomBlackBody;
 	SizeType = SizeType_GammaLike;
 
+	FlyYaw = 0;
+	FlyPitch = 0;
+	RotateYaw = 0;
+	RotatePitch = 0;
+	RotateRoll = 0;
+	FreeCamera = false;
 	XrandSpan = 0;
 	YrandSpan = 0;
 	ScreenWidth = 1024;
 	ScreenHeight = 768;
 	ScreenScale = 768;
 	FadeInK = 0;
+	Seed = 0;
+	respawnSeed = 0;
+	blockRandom = NULL;
+	randomBlocks = 0;
+	UseFastMath = true;
+	UseSimd = true;
+	UseSprites = true;
+	ThreadCount = 0;
+	ChunkCount = 1;
+	BandCount = 1;
+	respawns = NULL;
+	bins = NULL;
+	bandRows = NULL;
+	rowBand = NULL;
+	dirty = NULL;
+	counters = NULL;
+	clearAll = true;
+	frameMovedZ = 0;
+	framePassedMs = 0;
+	frameRespawns = 0;
+	TargetFrameMs = 0;
+	generatedStars = 0;
+	activeStars = 0;
+	frameCostMs = 0;
+	governorHold = 0;
 	TotalTimeMs = 0;
-	inRender = false;
 	PrevTime  = 0;
+	Monitors = 1;
+	MonitorIndex = 0;
+	SurfaceCount = 1;
+	renderLeader = NULL;
+	nextSurface = NULL;
+	OurWindow = NULL;
+	renderThread = NULL;
+	stopEvent = NULL;
+	stopping = 0;
+	frameTimer = NULL;
+	iniPath[0] = 0;
+	iniChange = NULL;
+	iniWriteTime.dwLowDateTime = iniWriteTime.dwHighDateTime = 0;
+	timerPeriod = false;
+	frameSkipped = 0;
+	Backend = Backend_Gdi;
+	presenter = NULL;
 	MemBuffer = NULL;
+	RowStride = 0;
+	Renderer = Renderer_Cpu;
+#ifdef STARFLY2_D3D11
+	gpu = NULL;
+	exitRing = NULL;
+	nextExit = 0;
+	gpuDistance = 0;
+#endif
 	zBuffer = NULL;
-	allStars = NULL;
+	lightBuffer = NULL;
+	UseAdditive = false;
+	UseDepthOrder = false;
+	UseStreaks = false;
+	depthRing = NULL;
+	starBucket = NULL;
+	starEntry = NULL;
+	chunkBuckets = NULL;
+	nearBucket = 0;
+	depthDistance = 0;
+	ClusterCount = 0;
+	ClusterStars = 2000;
+	ClusterSize = 250;
+	clusters = NULL;
+	clusterFirst = 0;
+	offsetX = offsetY = offsetZ = NULL;
+	clusterStarSize = 0;
+	projectKernel = NULL;
+	clusterKernel = NULL;
+	rasterKernel = NULL;
+	clusterStars = NULL;
+	clusterHidden = NULL;
+	BackgroundDepth = 0;
+	fieldDepth = (FP_TYPE)1.0;
+	fieldStars = 0;
+	backFirst = 0;
+	backCount = 0;
+	generatedBack = 0;
+	background = NULL;
+	backLight = NULL;
+	bakeBackground = false;
+	backStep = 0;
+	backMovedZ = 0;
+	backPassedMs = 0;
+	backRespawns = NULL;
+	backBins = NULL;
+	snapshotPath[0] = 0;
+	snapshotStatus = Snapshot_Off;
 
 #ifdef _DEBUG
-	RandCount = 0;
+	profiler.enabled = true; // Overlay by default in debug build
+#endif
+}
+
+// Main object destructor
+// Render thread is stopped and everything is freed, if Destroy was not called by window
+StarFly2::~StarFly2()
+{
+	Destroy();
+}
+
+// Read settings from ini-like file
+// filename - path of file
+// target - receives settings by its ApplySetting( name, value ), unknown settings are skipped
+// Return Value: true if file was opened and read to its end
+template <class Target> static bool ReadSettings( const char* filename, Target& target )
+{
+	bool Result = false;
+	FILE * f1;
+	fopen_s(&f1, filename, "rt");
+	if (NULL != f1)
+	{
+		char buffer[MAX_PATH + 64]; // Name and path of file
+		while (NULL != fgets(buffer, sizeof(buffer), f1))
+		{
+			size_t length = strlen(buffer);
+			if (0 < length && '\n' != buffer[length - 1] && !feof(f1))
+			{	// Too long line - skip its rest, it is not a setting
+				int c;
+				while (EOF != (c = fgetc(f1)) && '\n' != c);
+				continue;
+			}
+			char* rightPart = strchr(buffer, '=');
+			if (NULL == rightPart)
+				continue; // Skip lines without '='
+			*rightPart++ = 0; // Put EOL
+			target.ApplySetting(trim(buffer), trim(rightPart)); // Trim extra spaces
+		}
+		Result = (0 == ferror(f1));
+		fclose(f1);
+	}
+	return Result;
+}
+
+// Load settings from ini-like file
+// Return Value: true if file was opened and read to its end
+bool StarFly2::LoadSettings ( const char* filename)
+{
+	bool Result = ReadSettings(filename, *this);
+	if (Result)
+		strncpy_s(iniPath, sizeof(iniPath), filename, _TRUNCATE); // Watched for changes
+	// Only last value matters
+	// Not found settings are kept default
+	return Result;
+}
+
+// Setting of one monitor - "MonitorN.Name"
+// name - name of setting
+// monitor - MonitorIndex of surface
+// Return Value: name without prefix, NULL if setting is for other monitor
+static const char* MonitorSetting( const char* name, int monitor )
+{
+	if (0 == _strnicmp(name, "Monitor", 7) && '0' <= name[7] && name[7] <= '9')
+	{
+		char* dot;
+		long index = strtol(name + 7, &dot, 10);
+		if ('.' == *dot)
+			return (index == monitor) ? dot + 1 : NULL;
+	}
+	return name;
+}
+
+// Path of file written by one surface: "name.ext" becomes "name.N.ext" for monitor N > 1, so windows of monitors do not share file
+// path - receives path
+// size - size of path buffer
+// value - path from settings
+// monitor - MonitorIndex of surface
+static void MonitorFilePath( char* path, size_t size, const char* value, int monitor )
+{
+	strncpy_s(path, size, value, _TRUNCATE);
+	size_t length = strlen(value);
+	if (1 >= monitor || 0 == length || length + 12 > size) // Room for ".N"
+		return;
+	const char* slash = strrchr(value, '\\');
+	const char* dot = strrchr(value, '.');
+	size_t stem = (NULL != dot && (NULL == slash || dot > slash)) ? (size_t)(dot - value) : length;
+	sprintf_s(path, size, "%.*s.%i%s", (int)stem, value, monitor, value + stem);
+}
+
+// Apply one setting, same names as in ini file
+// name - name of setting
+// value - text of value
+// Return Value: false if setting is unknown
+bool StarFly2::ApplySetting ( const char* name, const char* value )
+{
+	name = MonitorSetting(name, MonitorIndex);
+	if (NULL == name)
+		return true; // Setting of other monitor
+
+	// Integer settings
+	if (0 == _stricmp(name, "Stars")) // 
+		StarCount = atoi(value);
+	else if (0 == _stricmp(name, "TimerRate") || 0 == _stricmp(name, "FrameInterval")) // Documented name and name used by code before
+		FrameInterval = atoi(value);
+	else if (0 == _stricmp(name, "SizeType"))
+		SizeType = (RandomStarSize)atoi(value);
+	else if (0 == _stricmp(name, "ColorType"))
+		ColorType = (RandomColorType)atoi(value);
+	else if (0 == _stricmp(name, "DarkestRGB"))
+		DarkestRGB = (UINT8)atoi(value);
+	else if (0 == _stricmp(name, "FadeInTime"))
+		FadeInTime = atoi(value);
+	else if (0 == _stricmp(name, "StarSize"))
+		StarSizeFactor = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Clusters"))
+		ClusterCount = max(0, atoi(value));
+	else if (0 == _stricmp(name, "ClusterStars"))
+		ClusterStars = max(1, atoi(value));
+	// Float settings
+	else if (0 == _stricmp(name, "Speed"))
+		FlySpeed = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Zoom"))
+		Zoom = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "CenterX"))
+		CenterX = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "CenterY"))
+		CenterY = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "FadePower"))
+		FadePower = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "ClusterSize"))
+		ClusterSize = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Background"))
+		BackgroundDepth = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "FlyYaw"))
+		FlyYaw = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "FlyPitch"))
+		FlyPitch = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "RotateYaw"))
+		RotateYaw = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "RotatePitch"))
+		RotatePitch = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "RotateRoll"))
+		RotateRoll = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Simd"))
+		UseSimd = (0 != atoi(value));
+	else if (0 == _stricmp(name, "Threads"))
+		ThreadCount = atoi(value);
+	else if (0 == _stricmp(name, "Additive"))
+		UseAdditive = (0 != atoi(value));
+	else if (0 == _stricmp(name, "DepthOrder"))
+		UseDepthOrder = (0 != atoi(value));
+	else if (0 == _stricmp(name, "Streaks"))
+		UseStreaks = (0 != atoi(value));
+	else if (0 == _stricmp(name, "SpriteCache"))
+		UseSprites = (0 != atoi(value));
+	else if (0 == _stricmp(name, "Backend"))
+		Backend = (PresentBackend)atoi(value);
+	else if (0 == _stricmp(name, "Renderer"))
+		Renderer = (RenderMode)atoi(value);
+	else if (0 == _stricmp(name, "Seed"))
+		Seed = (UINT32)strtoul(value, NULL, 10);
+	else if (0 == _stricmp(name, "FastMath"))
+		UseFastMath = (0 != atoi(value));
+	else if (0 == _stricmp(name, "Monitors"))
+		Monitors = atoi(value);
+	else if (0 == _stricmp(name, "TargetFrameMs"))
+		TargetFrameMs = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Profile"))
+		profiler.enabled = (0 != atoi(value));
+	else if (0 == _stricmp(name, "ProfileCsv"))
+		profiler.SetCsv(value);
+	else if (0 == _stricmp(name, "Snapshot"))
+		MonitorFilePath(snapshotPath, sizeof(snapshotPath), value, MonitorIndex);
+	else if (0 == _stricmp(name, "StepLog"))
+	{
+		char path[MAX_PATH];
+		MonitorFilePath(path, sizeof(path), value, MonitorIndex);
+		stepLog.SetPath(path);
+	}
+	else
+		return false;
+	return true;
+}
+
+// Apply settings changed in ini file, which do not need new star field:
+// Speed, FadePower, FadeInTime, TargetFrameMs, also Zoom, CenterX, CenterY and Stars for CPU render
+// Other settings are applied on next start. Should be called by render thread between frames
+// Return Value: false if a serious failure occurred
+bool StarFly2::ReloadSettings ( )
+{
+	// Current values, overridden by settings present in ini
+	LiveSettings loaded;
+	loaded.monitor = MonitorIndex;
+	loaded.speed = FlySpeed;
+	loaded.fadePower = FadePower;
+	loaded.fadeInTime = FadeInTime;
+	loaded.targetFrameMs = TargetFrameMs;
+	loaded.zoom = Zoom;
+	loaded.centerX = CenterX;
+	loaded.centerY = CenterY;
+	loaded.stars = StarCount;
+	if (!ReadSettings(iniPath, loaded))
+		return true; // File is locked or replaced now, next change notification reads it again
+
+	if (loaded.speed != FlySpeed)
+	{
+		FlySpeed = loaded.speed;
+		if (FreeCamera)
+			BuildSpawnSides(); // Inflow thru faces
+	}
+	FadePower = loaded.fadePower; // Table of fade and kernels are rebuilt by next frame, if it was changed
+	if (loaded.fadeInTime != FadeInTime)
+	{
+		FadeInTime = loaded.fadeInTime;
+		FadeInK = (FP_TYPE)1.0 / FadeInTime;
+	}
+	if (loaded.targetFrameMs != TargetFrameMs)
+	{
+		TargetFrameMs = loaded.targetFrameMs;
+		frameCostMs = 0;
+		governorHold = 0;
+		if (0 >= TargetFrameMs)
+			ActivateStars(generatedStars); // Governor is off - all stars
+	}
+
+#ifdef STARFLY2_D3D11
+	if (NULL != gpu)
+		return true; // Stars on GPU keep spans of view and number of stars
 #endif
+	if (loaded.zoom != Zoom || loaded.centerX != CenterX || loaded.centerY != CenterY)
+		ApplyView(loaded.zoom, loaded.centerX, loaded.centerY);
+	if (loaded.stars != StarCount)
+		return ResizeStars(loaded.stars);
+	return true;
 }
 
-// Load settings from ini-like file
-void StarFly2::LoadSettings ( const char* filename)
+// Apply one setting of ini file which could be changed live, names as for StarFly2::ApplySetting
+// name - name of setting
+// value - text of value
+// Return Value: false if setting is unknown or is not applied live
+bool LiveSettings::ApplySetting( const char* name, const char* value )
 {
-	// Load from ini file
-	FILE * f1;
-	fopen_s(&f1, filename, "rt");
-	if (NULL != f1)
-	{
-		while(!feof(f1))
-		{
-			char buffer[200];
-			fgets(buffer,sizeof(buffer),f1);
-			char* rightPart = strchr(buffer, '=');
-			if (NULL == rightPart)
-				continue; // Skip lines without '='
-			*rightPart++ = 0; // Put EOL
-			char* leftPart = trim(buffer); // Trim extra spaces
-
-			// Integer settings
-			if (0 == _stricmp(leftPart, "Stars")) // 
-				StarCount = atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "FrameInterval"))
-				FrameInterval = atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "SizeType"))
-				SizeType = (RandomStarSize)atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "ColorType"))
-				ColorType = (RandomColorType)atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "DarkestRGB"))
-				DarkestRGB = (UINT8)atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "FadeInTime"))
-				FadeInTime = atoi(rightPart);
-			else if (0 == _stricmp(leftPart, "StarSize"))
-				StarSizeFactor = (FP_TYPE)atof(rightPart);
-			// Float settings
-			else if (0 == _stricmp(leftPart, "Speed"))
-				FlySpeed = (FP_TYPE)atof(rightPart);
-			else if (0 == _stricmp(leftPart, "Zoom"))
-				Zoom = (FP_TYPE)atof(rightPart);
-			else if (0 == _stricmp(leftPart, "CenterX"))
-				CenterX = (FP_TYPE)atof(rightPart);
-			else if (0 == _stricmp(leftPart, "CenterY"))
-				CenterY = (FP_TYPE)atof(rightPart);
-			else if (0 == _stricmp(leftPart, "FadePower"))
-				FadePower = (FP_TYPE)atof(rightPart);
-		}
-		fclose(f1);
-	}
-	// Only last value matters
-	// Not found settings are kept default
-	CenterY = (FP_TYPE)1.0 - CenterY; // Rows are reverted in DIB section, so we just invert CenterY
+	name = MonitorSetting(name, monitor);
+	if (NULL == name)
+		return true; // Setting of other monitor
+	if (0 == _stricmp(name, "Stars"))
+		stars = atoi(value);
+	else if (0 == _stricmp(name, "FadeInTime"))
+		fadeInTime = atoi(value);
+	else if (0 == _stricmp(name, "Speed"))
+		speed = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "FadePower"))
+		fadePower = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "TargetFrameMs"))
+		targetFrameMs = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "Zoom"))
+		zoom = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "CenterX"))
+		centerX = (FP_TYPE)atof(value);
+	else if (0 == _stricmp(name, "CenterY"))
+		centerY = (FP_TYPE)atof(value);
+	else
+		return false;
+	return true;
+}
+
+// Time of last write of file
+// path - path of file
+// time - receives time, zero if file could not be queried
+static void FileWriteTime( const char* path, FILETIME& time )
+{
+	WIN32_FILE_ATTRIBUTE_DATA data;
+	if (FALSE != GetFileAttributesEx(path, GetFileExInfoStandard, &data))
+		time = data.ftLastWriteTime;
+	else
+		time.dwLowDateTime = time.dwHighDateTime = 0;
+}
+
+// Bind object to monitor, should be called before LoadSettings and Initialize
+// monitor - number of monitor, 1 - primary
+// surfaces - number of surfaces rendered simultaneously
+// leader - surface, which render thread also renders this one, NULL - own render thread
+void StarFly2::SetSurface ( int monitor, int surfaces, StarFly2* leader )
+{
+	MonitorIndex = monitor;
+	SurfaceCount = max(1, surfaces);
+	renderLeader = leader;
 }
 
 /*++
@@ -571,99 +5808,395 @@ Return Value:
 --*/
 bool StarFly2::Initialize ( HWND Window )
 {
-	HDC Dc;
 	bool Result = false;
 
 	do
 	{
 		RECT ScreenRect;
 
-		inRender = false;
-		PrevTime = timeGetTime();
-		srand(PrevTime); // Reseed random generator to see each time different star field
-
-		Dc = NULL;
-
 		// Save the window.
 		OurWindow = Window;
-		OurTimer = 0;
-		TotalTimeMs = 0;
 
 		// Get window size
 		if (FALSE == GetClientRect(OurWindow, &ScreenRect))
 			break;
 
-		ScreenWidth = ScreenRect.right - ScreenRect.left;   // Only initial window sizes are used for render
-		ScreenHeight = ScreenRect.bottom - ScreenRect.top;
-		ScreenScale = min(ScreenWidth, ScreenHeight) * Zoom;
-		FadeInK = (FP_TYPE)1.0 / FadeInTime;
+		// Initial window sizes, later ones are followed by RenderFrame
+		if (!InitializeRender(ScreenRect.right - ScreenRect.left, ScreenRect.bottom - ScreenRect.top))
+			break;
 
-		XrandSpan = ScreenWidth * FarPlane / ScreenScale;  // Spans on X and Y axis of rect.cuboid in which stars are generated
-		YrandSpan = ScreenHeight * FarPlane / ScreenScale; // FarPlane is far side of this cuboid and it is completely seen on screen
+		// Kick off the render thread.
+		PrevTime = timeGetTime();
+		if (NULL != renderLeader)
+		{	// Leader is created last, its thread is not started yet
+			nextSurface = renderLeader->nextSurface;
+			renderLeader->nextSurface = this;
+		}
+		else if (!StartRenderThread())
+			break;
 
-		allStars = new Star[StarCount];
-		zBuffer = new UINT16[ScreenWidth*ScreenHeight];
+		Result = true;
+	} while (false);
 
-#ifdef _DEBUG
-		RandCount = 0;
+	return Result;
+}
+
+// Prepare tables, threads, frame and stars - everything except window and timer
+// width, height - frame size
+// Return Value: true on success
+bool StarFly2::InitializeRender( int width, int height )
+{
+	PrevTime = timeGetTime();
+	UINT32 fieldSeed = ((0 != Seed) ? Seed : PrevTime) + (UINT32)max(0, MonitorIndex - 1) * 0x9E3779B9u;
+	random.Seed(fieldSeed); // Reseed random generator to see each time different star field, unless it is fixed; other field on each monitor
+	respawnSeed = fieldSeed ^ 0xA5A5A5A5u; // Generators of blocks, same for any number of threads
+	TotalTimeMs = 0;
+
+	ScreenWidth = width;
+	ScreenHeight = height;
+	ScreenScale = min(ScreenWidth, ScreenHeight) * Zoom;
+	FadeInK = (FP_TYPE)1.0 / FadeInTime;
+
+	XrandSpan = ScreenWidth * FarPlane / ScreenScale;  // Spans on X and Y axis of rect.cuboid in which stars are generated
+	YrandSpan = ScreenHeight * FarPlane / ScreenScale; // FarPlane is far side of this cuboid and it is completely seen on screen
+	InitializeCamera();
+	if (FreeCamera || 0 < ClusterCount)
+		UseDepthOrder = false; // Stars do not keep their depth buckets, stars of clusters are not in them
+
+	tables.BuildFade(FadePower);
+	tables.BuildSize();
+	BuildPalette();
+
+	if (!InitializeThreads())
+		return false;
+
+	// Prepare frame buffer for fast drawing
+	if (!InitializePresenter(Backend))
+		return false;
+
+#ifdef STARFLY2_D3D11
+	if (Renderer_Gpu == Renderer && Backend_D3D11 == presenter->Backend() && !FreeCamera && 0 == ClusterCount) // Shaders move stars only forward, without clusters
+		InitializeGpu(); // CPU render is used if it fails
+	if (NULL == gpu)
 #endif
-		for (int i = 0; i<StarCount; i++)
+	if (!InitializeStars())
+		return false;
+	return true;
+}
+
+/*++
+Description:
+    This routine runs headless benchmark - frame in memory, fixed time step, no window and timer.
+Arguments:
+    options - command line, "Name=value" parts are applied: Width, Height, Frames, Step (ms)
+        and any setting of ini file, StepLog is replayed. Other parts are skipped.
+Return Value:
+    Exit code for process, 0 on success.
+--*/
+int StarFly2::Benchmark ( char* options )
+{
+	static const int WarmUpFrames = 10; // Not measured, first frame clears whole screen
+	int width = 1920;
+	int height = 1080;
+	int frames = 300;
+	int stepMs = FrameInterval;
+
+	char* context = NULL;
+	for (char* part = strtok_s(options, " \t", &context); NULL != part; part = strtok_s(NULL, " \t", &context))
+	{
+		char* value = strchr(part, '=');
+		if (NULL == value)
+			continue; // Skip "/bench" itself
+		*value++ = 0;
+		if (0 == _stricmp(part, "Width"))
+			width = atoi(value);
+		else if (0 == _stricmp(part, "Height"))
+			height = atoi(value);
+		else if (0 == _stricmp(part, "Frames"))
+			frames = atoi(value);
+		else if (0 == _stricmp(part, "Step"))
+			stepMs = atoi(value);
+		else if (!ApplySetting(part, value))
 		{
-			allStars[i].z = (FP_TYPE)-1.0; // To trigger randomize in Process
-			allStars[i].state = State_New;
-			allStars[i].Process(this);
-			allStars[i].state = State_Generated;
+			printf("Unknown setting %s\n", part);
+			return 1;
 		}
+	}
+	if (0 >= width || 0 >= height || 0 >= frames || 0 > stepMs)
+	{
+		printf("Wrong Width, Height, Frames or Step\n");
+		return 1;
+	}
 
-#if 0	// Debug - star dead ahead
-		allStars[0].x = 0;
-		allStars[0].y = 0;
-		allStars[0].z = 200;
-		allStars[0].size = StarSizeFactor*(FP_TYPE)27.15; // Biggest possible with cur random generator
-#endif
+	IndexList steps; // Steps of StepLog, all its frames are replayed and measured without warm-up
+	if (stepLog.Enabled())
+	{
+		if (!stepLog.Load(steps) || 0 == steps.count)
+		{
+			printf("No steps in StepLog %s\n", stepLog.Path());
+			return 1;
+		}
+		frames = steps.count;
+	}
 
-		// Prepare DC and bitmap for fast drawing
-		Dc = GetDC(Window);
-		MemDc = CreateCompatibleDC(Dc);
-		if (NULL == MemDc)
-			break;
+	Backend = Backend_Memory;
+	Renderer = Renderer_Cpu;
+	if (0 == Seed)
+		Seed = 1; // Same star field each run, so checksums could be compared
+	OurWindow = NULL;
 
-		// Based on https://stackoverflow.com/questions/10036527/render-buffer-on-screen-in-windows
-		BITMAPINFO bmi;
-		memset(&bmi, 0, sizeof(bmi));
-		bmi.bmiHeader.biSize = sizeof(BITMAPINFOHEADER);
-		bmi.bmiHeader.biWidth = ScreenWidth;
-		bmi.bmiHeader.biHeight = ScreenHeight;
-		bmi.bmiHeader.biPlanes = 1;
-		bmi.bmiHeader.biBitCount = 32;
-		bmi.bmiHeader.biCompression = BI_RGB;
+	int Return = 1;
+	if (InitializeRender(width, height))
+	{
+		GenerateStars(StarCount); // Whole star field is measured, not its filling
+		for (int frame = 0; frame < WarmUpFrames && 0 == steps.count; frame++)
+			RenderFrame(stepMs, width, height);
+		LONGLONG start = FrameProfiler::Now();
+		for (int frame = 0; frame < frames; frame++)
+			RenderFrame((0 < steps.count) ? steps.data[frame] : stepMs, width, height);
+		double ms = profiler.Ms(FrameProfiler::Now() - start) / frames;
+
+		// Report in form of ini file
+		printf("Width = %i\nHeight = %i\nStars = %i\nThreads = %i\nSimd = %i\nFastMath = %i\nSpriteCache = %i\n",
+			width, height, StarCount, workers.Threads(), UseSimd ? 1 : 0, UseFastMath ? 1 : 0, UseSprites ? 1 : 0);
+		printf("SizeType = %i\nColorType = %i\nSeed = %u\nFrames = %i\nStep = %i\n",
+			(int)SizeType, (int)ColorType, Seed, frames, stepMs);
+		printf("FramesPerSec = %.2f\nMsPerFrame = %.4f\nNsPerStar = %.3f\nNsPerPixel = %.4f\n",
+			1000.0 / ms, ms, ms * 1e6 / max(StarCount, 1), ms * 1e6 / ((double)width * height));
+		if (0 < TargetFrameMs)
+			printf("TargetFrameMs = %g\nActiveStars = %i\n", (double)TargetFrameMs, activeStars); // Governor state at end
+		if (0 != snapshotPath[0])
+		{
+			static const char* const status[] = { "off", "loaded", "saved", "failed", "mismatch" };
+			printf("Snapshot = %s\nSnapshotStatus = %s\n", snapshotPath, status[snapshotStatus]);
+		}
+		if (0 < steps.count)
+			printf("StepLog = %s\n", stepLog.Path());
+		printf("Checksum = %08X\n", fnv1a(MemBuffer, (size_t)width * height * 4)); // Of last frame
+		Return = 0;
+	}
+	else
+		printf("Initialization failed\n");
+	fflush(stdout);
 
-		MemBitmap = CreateDIBSection(Dc, &bmi, DIB_RGB_COLORS, (void **)&MemBuffer, 0, 0);
-		if (NULL == MemBuffer || NULL == MemBitmap)
-			break;
+	Destroy();
+	return Return;
+}
 
-		OrigBitmap1 = (HBITMAP)SelectObject(MemDc, MemBitmap);
-		if (NULL == OrigBitmap1)
-			break;
+// Print timing of one kernel as JSON object of report of BenchmarkKernels
+// name - name of kernel
+// items - stars, circles or pixels processed by one run
+// ms - times of runs, sorted here
+// runs - number of runs
+// threaded - kernel is run by worker threads
+// last - last object of list, without comma
+static void PrintKernel( const char* name, int items, double* ms, int runs, bool threaded, bool last )
+{
+	qsort(ms, runs, sizeof(double), CompareMs);
+	double median = ms[runs / 2];
+	printf("    {\"name\": \"%s\", \"threaded\": %s, \"items\": %i, \"msMin\": %.4f, \"msMedian\": %.4f, \"nsPerItem\": %.3f}%s\n",
+		name, threaded ? "true" : "false", items, ms[0], median, median * 1e6 / max(items, 1), last ? "" : ",");
+}
 
-		// Kick off the timer.
-		OurTimer = timeSetEvent(FrameInterval,   // Interval
-								FrameInterval,   // Resolution
-								TimerEvent,      // Which function to call
-								(DWORD_PTR)this, // User data - pointer to our main object
-								TIME_PERIODIC | TIME_CALLBACK_FUNCTION);
+/*++
+Description:
+    This routine runs benchmark of separate kernels on frame in memory: projection, respawn, update (both by threads),
+    circles of several radii, points, clear, raster of all stars (by threads) and GDI copy of frame.
+    Stars and positions of circles are from fixed seed, so runs of different builds and settings (Simd, FastMath,
+    SpriteCache, Threads) measure the same work.
+Arguments:
+    options - command line, "Name=value" parts are applied: Width, Height, Runs (of each kernel)
+        and any setting of ini file. Other parts are skipped.
+Return Value:
+    Exit code for process, 0 on success.
+--*/
+int StarFly2::BenchmarkKernels ( char* options )
+{
+	static const int Circles = 4096; // Per run of circle kernel
+	static const FP_TYPE Radii[] = { (FP_TYPE)0.5, (FP_TYPE)1.5, (FP_TYPE)4.0, (FP_TYPE)16.0, (FP_TYPE)64.0 }; // First one is point
+	static const int RadiusCount = sizeof(Radii) / sizeof(Radii[0]);
+	int width = 1920;
+	int height = 1080;
+	int runs = 20;
+
+	char* context = NULL;
+	for (char* part = strtok_s(options, " \t", &context); NULL != part; part = strtok_s(NULL, " \t", &context))
+	{
+		char* value = strchr(part, '=');
+		if (NULL == value)
+			continue; // Skip "/kernels" itself
+		*value++ = 0;
+		if (0 == _stricmp(part, "Width"))
+			width = atoi(value);
+		else if (0 == _stricmp(part, "Height"))
+			height = atoi(value);
+		else if (0 == _stricmp(part, "Runs"))
+			runs = atoi(value);
+		else if (!ApplySetting(part, value))
+		{
+			printf("Unknown setting %s\n", part);
+			return 1;
+		}
+	}
+	if (0 >= width || 0 >= height || 0 >= runs)
+	{
+		printf("Wrong Width, Height or Runs\n");
+		return 1;
+	}
 
-		if (0 == OurTimer)
-			break;
+	Backend = Backend_Memory;
+	Renderer = Renderer_Cpu;
+	if (0 == Seed)
+		Seed = 1;
+	OurWindow = NULL;
+	if (!InitializeRender(width, height))
+	{
+		printf("Initialization failed\n");
+		fflush(stdout);
+		Destroy();
+		return 1;
+	}
+	GenerateStars(StarCount);
+	RenderFrame(FrameInterval, width, height); // Frame is taken, buffers are cleared
 
-		PrevTime = timeGetTime();
+	int lanes = 4; // Stars per SIMD projection step
+#if defined(__AVX2__)
+	lanes = 8;
+#endif
+	double* ms = new double[runs];
+	LONGLONG start;
+	printf("{\n  \"width\": %i, \"height\": %i, \"activeStars\": %i, \"threads\": %i, \"simd\": %i, \"simdLanes\": %i, \"fastMath\": %i,\n",
+		width, height, activeStars, workers.Threads(), UseSimd ? 1 : 0, UseSimd ? lanes : 1, UseFastMath ? 1 : 0);
+	printf("  \"spriteCache\": %i, \"additive\": %i, \"depthOrder\": %i, \"streaks\": %i, \"seed\": %u, \"runs\": %i,\n  \"kernels\": [\n",
+		UseSprites ? 1 : 0, UseAdditive ? 1 : 0, UseDepthOrder ? 1 : 0, UseStreaks ? 1 : 0, Seed, runs);
+
+	// Projection of all stars by one thread, stars out of view are respawned after time is taken
+	FP_TYPE movedZ = FlySpeed * FrameInterval;
+	for (int run = 0; run < runs; run++)
+	{
+		respawns[0].Clear();
+		start = FrameProfiler::Now();
+		ProjectStars(0, activeStars, movedZ, FrameInterval, respawns[0]);
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+		RegenerateStars(respawns[0]);
+	}
+	PrintKernel("project", activeStars, ms, runs, false, false);
 
-		Result = true;
-	} while (false);
+	// Respawn - random position, size and color of new star on far side of field, stars of pool are not changed
+	Random random;
+	FP_TYPE sink = 0;
+	for (int run = 0; run < runs; run++)
+	{
+		random.Seed(Seed);
+		start = FrameProfiler::Now();
+		for (int i = 0; i < activeStars; i++)
+		{
+			Star star;
+			star.z = (FP_TYPE)-1.0; // To trigger randomize in Process
+			star.state = State_Generated;
+			star.Process(this, random);
+			sink += star.xp;
+		}
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+	}
+	PrintKernel("respawn", activeStars, ms, runs, false, false);
 
-	if (NULL != Dc)
-		ReleaseDC(Window, Dc);
-	return Result;
+	// Update of frame - move, projection and respawn of all stars by chunks
+	frameMovedZ = movedZ;
+	framePassedMs = FrameInterval;
+	for (int run = 0; run < runs; run++)
+	{
+		start = FrameProfiler::Now();
+		workers.Run(JobProject, this, ChunkCount);
+		if (UseDepthOrder)
+			UpdateDepthOrder();
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+	}
+	PrintKernel("update", activeStars, ms, runs, 1 < workers.Threads(), false);
+
+	// Raster of all stars by bands - bins, clear of previous stars and circles
+	for (int run = 0; run < runs; run++)
+	{
+		start = FrameProfiler::Now();
+		workers.Run(JobBin, this, ChunkCount);
+		workers.Run(JobRaster, this, BandCount);
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+	}
+	PrintKernel("raster", activeStars, ms, runs, 1 < workers.Threads(), false);
+
+	// Clear of whole frame (and of z-buffer or light buffer) by one thread
+	for (int run = 0; run < runs; run++)
+	{
+		clearAll = true;
+		start = FrameProfiler::Now();
+		for (int band = 0; band < BandCount; band++)
+			ClearBand(band);
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+	}
+	PrintKernel("clear", width * height, ms, runs, false, false);
+
+	// Circles of fixed radius at same random places and depths, frame is cleared between runs
+	FP_TYPE* places = new FP_TYPE[Circles * 3];
+	random.Seed(Seed);
+	random.Fill(places, Circles * 3);
+	for (int radius = 0; radius < RadiusCount; radius++)
+	{
+		for (int run = 0; run < runs; run++)
+		{
+			clearAll = true;
+			for (int band = 0; band < BandCount; band++)
+				ClearBand(band);
+			dirty[0].Clear();
+			start = FrameProfiler::Now();
+			for (int k = 0; k < Circles; k++)
+				DrawStar(places[k * 3] * width, places[k * 3 + 1] * height, Radii[radius], (FP_TYPE)1.0,
+					(FP_TYPE)1.0 + places[k * 3 + 2] * (FarPlane - 1), palette[k % PaletteSize], 0, height, dirty[0], counters[0]);
+			ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+		}
+		char name[32];
+		if (0 == radius)
+			strcpy_s(name, sizeof(name), "point");
+		else
+			sprintf_s(name, sizeof(name), "circle_r%g", (double)Radii[radius]);
+		PrintKernel(name, Circles, ms, runs, false, false);
+	}
+	delete[] places;
+	dirty[0].Clear();
+	clearAll = true;
+
+	// Present - GDI copy of DIB section to bitmap of display format, as BitBlt to window without window
+	GdiPresenter gdi;
+	HDC screenDc = GetDC(NULL);
+	HDC targetDc = CreateCompatibleDC(screenDc);
+	HBITMAP target = CreateCompatibleBitmap(screenDc, width, height);
+	HGDIOBJ original = (NULL != targetDc && NULL != target) ? SelectObject(targetDc, target) : NULL;
+	bool present = (NULL != original && gdi.Initialize(NULL, width, height));
+	for (int run = 0; run < runs && present; run++)
+	{
+		start = FrameProfiler::Now();
+		present = (FALSE != BitBlt(targetDc, 0, 0, width, height, gdi.BufferDc(), 0, 0, SRCCOPY));
+		GdiFlush(); // Batched call is finished
+		ms[run] = profiler.Ms(FrameProfiler::Now() - start);
+	}
+	if (present)
+		PrintKernel("present_gdi", width * height, ms, runs, false, true);
+	else
+		printf("    {\"name\": \"present_gdi\", \"failed\": true}\n");
+	gdi.Destroy();
+	if (NULL != original)
+		SelectObject(targetDc, original);
+	if (NULL != target)
+		DeleteObject(target);
+	if (NULL != targetDc)
+		DeleteDC(targetDc);
+	if (NULL != screenDc)
+		ReleaseDC(NULL, screenDc);
+
+	printf("  ],\n  \"sink\": %g\n}\n", (double)sink); // Respawned stars are used, so loop is not optimized out
+	fflush(stdout);
+	delete[] ms;
+	Destroy();
+	return 0;
 }
 
 /*++
@@ -672,27 +6205,172 @@ Description:
 --*/
 VOID StarFly2::Destroy (  )
 {
-	if (0 != OurTimer)
-		timeKillEvent(OurTimer);
+	// Render thread abandons current frame and is joined, so nothing uses arrays after this
+	// Could be called several times, e.g. by window and by destructor
+	if (NULL != renderLeader)
+		renderLeader->StopRenderThread(); // Renders this surface too, application is exiting anyway
+	StopRenderThread();
+
+	// Free allocations
+#ifdef STARFLY2_D3D11
+	DestroyGpu();
+#endif
+	DestroyPresenter();
+	DestroyThreads();
+	DestroyDepthOrder();
+	stars.Free();
+	arena.Free(); // Stars and clusters
+	pixelArena.Free(); // zBuffer, lightBuffer and background
+	zBuffer = NULL;
+	lightBuffer = NULL;
+	clusters = NULL;
+	offsetX = offsetY = offsetZ = NULL;
+	blockRandom = NULL;
+	background = NULL;
+	backLight = NULL;
+	sprites.Free();
+	profiler.Close();
+	stepLog.Close();
+
+	return;
+}
+
+// Create waitable timer and start render thread
+// High-resolution timer is used if available, otherwise resolution of system timer is raised to 1 ms
+// Return Value: true on success
+bool StarFly2::StartRenderThread ( )
+{
+	typedef HANDLE (WINAPI *CreateWaitableTimerExFunc)( LPSECURITY_ATTRIBUTES, LPCSTR, DWORD, DWORD );
+	CreateWaitableTimerExFunc createTimerEx = (CreateWaitableTimerExFunc)GetProcAddress(GetModuleHandle("kernel32.dll"), "CreateWaitableTimerExA"); // Vista+
+	if (NULL != createTimerEx)
+		frameTimer = createTimerEx(NULL, NULL, CREATE_WAITABLE_TIMER_HIGH_RESOLUTION, TIMER_ALL_ACCESS); // Fails before Windows 10 1803
+	if (NULL == frameTimer)
+	{
+		frameTimer = CreateWaitableTimer(NULL, FALSE, NULL);
+		timerPeriod = (TIMERR_NOERROR == timeBeginPeriod(1));
+	}
+	stopEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+	if (NULL == frameTimer || NULL == stopEvent)
+		return false;
+
+	// Folder of ini file is watched, settings are applied live without it if watch fails
+	char folder[MAX_PATH];
+	strcpy_s(folder, sizeof(folder), iniPath);
+	char* name = strrchr(folder, '\\');
+	if (NULL != name)
+	{
+		*name = 0;
+		iniChange = FindFirstChangeNotification(folder, FALSE, FILE_NOTIFY_CHANGE_LAST_WRITE);
+		if (INVALID_HANDLE_VALUE == iniChange)
+			iniChange = NULL;
+		FileWriteTime(iniPath, iniWriteTime);
+	}
+
+	InterlockedExchange(&stopping, 0);
+	renderThread = CreateThread(NULL, 0, RenderThreadProc, this, 0, NULL);
+	return NULL != renderThread;
+}
 
-	// If Exit event happens during rendering - we should wait till it ended before freeing arrays
-	unsigned int Time1 = timeGetTime();
-	while(inRender &&
-		timeGetTime()<(Time1 + 1000)) // But no more than 1 second
+// Signal render thread to exit, wait for it and free timer
+// Current frame is abandoned between phases, wait of next deadline is interrupted
+void StarFly2::StopRenderThread ( )
+{
+	if (NULL != renderThread)
 	{
-		Sleep(1);
+		InterlockedExchange(&stopping, 1);
+		SetEvent(stopEvent);
+		// Render thread could wait for message sent to window of this thread (e.g. by Present), so sent messages are handled while waiting
+		while (WAIT_OBJECT_0 + 1 == MsgWaitForMultipleObjects(1, &renderThread, FALSE, INFINITE, QS_SENDMESSAGE))
+		{
+			MSG message;
+			PeekMessage(&message, NULL, 0, 0, PM_NOREMOVE | PM_QS_SENDMESSAGE);
+		}
+		CloseHandle(renderThread);
 	}
-	StarCount = 0; // Should additionally trigger exit from render loop
+	if (NULL != stopEvent)
+		CloseHandle(stopEvent);
+	if (NULL != frameTimer)
+		CloseHandle(frameTimer);
+	if (NULL != iniChange)
+		FindCloseChangeNotification(iniChange);
+	if (timerPeriod)
+		timeEndPeriod(1);
+	renderThread = NULL;
+	stopEvent = NULL;
+	frameTimer = NULL;
+	iniChange = NULL;
+	timerPeriod = false;
+}
 
-	// Restore GDI objects
-	SelectObject(MemDc, OrigBitmap1);
-	DeleteObject(MemBitmap);
-	DeleteDC(MemDc);
+// Check if render thread should exit, then rest of frame is not rendered
+// Return Value: true if StopRenderThread was called for render thread of this surface
+bool StarFly2::Stopping() const
+{
+	const StarFly2* owner = (NULL != renderLeader) ? renderLeader : this;
+	return 0 != owner->stopping;
+}
 
-	// Free allocations
-	delete[] allStars;
+// Render frames till stop event, also frames of surfaces of other monitors linked to this one
+// Deadlines of frames are on grid of FrameInterval. If frame took too long, missed deadlines are skipped,
+// so frames are not rendered in burst to catch up. FrameInterval = 0 - uncapped, next frame right after previous
+void StarFly2::RenderLoop ( )
+{
+	LARGE_INTEGER frequency;
+	QueryPerformanceFrequency(&frequency);
+	const LONGLONG interval = (LONGLONG)max(FrameInterval, 0) * frequency.QuadPart / 1000;
+	LONGLONG deadline = FrameProfiler::Now() + interval;
+	HANDLE waits[2] = { stopEvent, frameTimer };
 
-	return;
+	while (true)
+	{
+		frameSkipped = 0;
+		LONGLONG now = FrameProfiler::Now();
+		if (0 == interval || now >= deadline)
+		{	// Uncapped or late - start right now, late frame takes slot of last missed deadline
+			if (0 != interval)
+			{
+				frameSkipped = (int)((now - deadline) / interval);
+				deadline += frameSkipped * interval;
+			}
+			if (WAIT_OBJECT_0 == WaitForSingleObject(stopEvent, 0))
+				break;
+		}
+		else
+		{
+			LARGE_INTEGER due;
+			due.QuadPart = -(deadline - now) * 10000000 / frequency.QuadPart; // Relative, in 100 ns
+			DWORD wait = WAIT_FAILED;
+			if (FALSE != SetWaitableTimer(frameTimer, &due, 0, NULL, NULL, FALSE))
+				wait = WaitForMultipleObjects(2, waits, FALSE, INFINITE);
+			if (WAIT_OBJECT_0 == wait)
+				break; // Stop event
+			if (WAIT_OBJECT_0 + 1 != wait)
+			{	// Timer failed - no more frames, screensaver is closed instead of showing frozen frame
+				PostMessage(OurWindow, WM_CLOSE, 0, 0);
+				break;
+			}
+		}
+
+		bool updated = UpdateScreen();
+		for (StarFly2* surface = nextSurface; updated && NULL != surface; surface = surface->nextSurface)
+			updated = surface->UpdateScreen();
+		if (NULL != iniChange && WAIT_OBJECT_0 == WaitForSingleObject(iniChange, 0))
+		{	// Something was written in folder of ini file - if it was ini itself, changed settings are applied to surfaces of this thread before next frame
+			FindNextChangeNotification(iniChange);
+			FILETIME written;
+			FileWriteTime(iniPath, written);
+			bool changed = (0 != CompareFileTime(&written, &iniWriteTime)); // Not own ProfileCsv, StepLog or Snapshot
+			iniWriteTime = written;
+			for (StarFly2* surface = this; changed && updated && NULL != surface; surface = surface->nextSurface)
+				updated = surface->ReloadSettings();
+		}
+		if (!updated)
+		{
+			PostMessage(OurWindow, WM_CLOSE, 0, 0);
+			break;
+		}
+		deadline += interval;
+	}
 }
 
 /*++
@@ -704,22 +6382,15 @@ Return Value:
 --*/
 bool StarFly2::UpdateScreen ( )
 {
-	HDC Dc;
 	bool Result = false;
 
 	do
 	{
-		inRender = true; // Set barrier
-
-		Dc = GetDC(OurWindow);
-		if (NULL == Dc)
-			break;
-
 		// Update main time.
 		unsigned int CurTime = timeGetTime();
 		unsigned int PassedTimeMs = CurTime - PrevTime;
 		PrevTime = CurTime;
-		TotalTimeMs += PassedTimeMs;
+		stepLog.Record(PassedTimeMs);
 
 		RECT ScreenRect;
 
@@ -727,54 +6398,107 @@ bool StarFly2::UpdateScreen ( )
 		if (FALSE == GetClientRect(OurWindow, &ScreenRect))
 			break;
 
-		int WindowWidth = ScreenRect.right - ScreenRect.left;
-		int WindowHeight = ScreenRect.bottom - ScreenRect.top;
+		Result = RenderFrame(PassedTimeMs, ScreenRect.right - ScreenRect.left, ScreenRect.bottom - ScreenRect.top);
+	} while(false);
 
-		// Clear - fill with black color
-		memset(MemBuffer, 0, ScreenHeight * ScreenWidth * 4); // 4 bytes for 32-bit RGB
-		memset(zBuffer, 0xFF, ScreenHeight * ScreenWidth * sizeof(UINT16)); // Max distance
+	InvalidateRect(OurWindow, NULL, FALSE);
 
-#ifdef _DEBUG
-		RandCount = 0;
-#endif
-		FP_TYPE movedZ = FlySpeed*PassedTimeMs;
+	return Result;
+}
 
-		// Render all stars
-		for (int i = 0; i < StarCount; i++)
+// Move stars, render and present one frame
+// PassedTimeMs - time passed since previous frame
+// WindowWidth, WindowHeight - current size of window client area
+// Return Value: false if a serious failure occurred
+bool StarFly2::RenderFrame ( unsigned int PassedTimeMs, int WindowWidth, int WindowHeight )
+{
+	bool Result = false;
+
+	do
+	{
+		profiler.BeginFrame();
+		TotalTimeMs += PassedTimeMs;
+
+		frameMovedZ = FlySpeed*PassedTimeMs;
+		framePassedMs = PassedTimeMs;
+		frameRespawns = 0;
+		if (FreeCamera)
+			UpdateCamera(PassedTimeMs);
+
+		// Window was resized (display mode, DPI or monitor changed) - frame follows it
+		if ((WindowWidth != ScreenWidth || WindowHeight != ScreenHeight) && 0 < WindowWidth && 0 < WindowHeight &&
+			!ResizeFrame(WindowWidth, WindowHeight))
+			break;
+
+#ifdef STARFLY2_D3D11
+		if (NULL != gpu)
 		{
-			allStars[i].z -= movedZ;                // Stars are moved towards viewer
-			if (0 < allStars[i].fadeIn)
-				allStars[i].fadeIn -= PassedTimeMs; // Tick fade-in
-			allStars[i].Process(this);              // Update star screen position or randomize it
-			allStars[i].Render(this);               // Render star (to MemBuffer)
+			// Respawn stars, which left view, and render all on GPU
+			bool rendered = RenderStarsGpu();
+			LONGLONG flipStart = FrameProfiler::Now();
+			if (rendered)
+				rendered = static_cast<D3D11Presenter*>(presenter)->Flip();
+			profiler.Add(Phase_Present, FrameProfiler::Now() - flipStart);
+			if (!rendered)
+			{
+				if (!FallBackToGdi()) // Device could be lost or removed, this frame is skipped
+					break;
+			}
+			Result = true;
+			break;
 		}
+#endif
 
-#if _DEBUG //Debug prints
+		// Frame could be other memory than on previous frame, then it is cleared whole
+		if (!presenter->BeginFrame(profiler.enabled)) // Profiler prints on frame
 		{
-			char txt[300];
-			int len1 = sprintf_s(txt,sizeof(txt),"ms:%u rnd:%i",PassedTimeMs,RandCount);
-			TextOut(MemDc,0,0,txt,len1);
+			if (Backend_Gdi == presenter->Backend() || !FallBackToGdi())
+				break;
+			Result = true; // Frame is skipped
+			break;
+		}
+		if (MemBuffer != presenter->Buffer())
+		{
+			MemBuffer = presenter->Buffer();
+			clearAll = true;
 		}
-#endif
 
-		if (FALSE == BitBlt( // Copy rendered to main screen
-			Dc,
-			0, 0,
-			min(ScreenWidth, WindowWidth),   // Just in case window size changed for some reason
-			min(ScreenHeight, WindowHeight),
-			MemDc,
-			0, 0,
-			SRCCOPY))
+		// Clear, move, project and render all stars (to MemBuffer)
+		LONGLONG renderStart = FrameProfiler::Now();
+		RenderStars();
+		if (Stopping())
+		{	// Exit requested during render, frame is not shown
+			Result = true;
 			break;
+		}
+		if (0 < TargetFrameMs)
+			GovernQuality(profiler.Ms(FrameProfiler::Now() - renderStart));
+
+		HDC MemDc = presenter->BufferDc();
+		if (profiler.enabled && NULL != MemDc) // Only presenter with DIB section could print on frame
+			DrawProfile(MemDc);
+
+		LONGLONG presentStart = FrameProfiler::Now();
+		bool presented = presenter->Present(WindowWidth, WindowHeight); // Copy rendered to main screen
+		profiler.Add(Phase_Present, FrameProfiler::Now() - presentStart);
+		if (!presented)
+		{
+			// Device could be lost or removed - continue with GDI, this frame is skipped
+			if (Backend_Gdi == presenter->Backend() || !FallBackToGdi())
+				break;
+		}
 
 		Result = true;
 	} while(false);
 
-	if (NULL != Dc)
-		ReleaseDC(OurWindow, Dc);
-	InvalidateRect(OurWindow, NULL, FALSE);
-
-	inRender = false; // Clear barrier
+	if (profiler.enabled && NULL != counters)
+	{
+		FrameCounters total;
+		total.Clear();
+		for (int band = 0; band < BandCount; band++)
+			total.Add(counters[band]);
+		profiler.EndFrame(PassedTimeMs, activeStars, frameRespawns, frameSkipped, total);
+	}
 
 	return Result;
 }
@@ -783,21 +6507,14 @@ bool StarFly2::UpdateScreen ( )
 
 /*++
 Description:
-    This routine is the callback from the timer.
+    This routine is the entry of render thread.
 Arguments:
-    TimerId - Supplies the timer ID that fired. Unused.
-    Message - Supplies the timer message. Unused.
-    User - Supplies the user paramater. Currently it is pointer to our main object.
-    Parameter1 - Supplies an unused parameter.
-    Parameter2 - Supplies an unused parameter.
+    parameter - Supplies pointer to our main object.
 --*/
-VOID CALLBACK StarFly2::TimerEvent ( UINT TimerId, UINT Message, DWORD_PTR User, DWORD_PTR Parameter1, DWORD_PTR Parameter2 )
+DWORD WINAPI StarFly2::RenderThreadProc ( LPVOID parameter )
 {
-	StarFly2* app = (StarFly2*)User;
-
-	if (!app->UpdateScreen())
-		PostQuitMessage(0);
-	return;
+	((StarFly2*)parameter)->RenderLoop();
+	return 0;
 }
 
 /*++
@@ -869,7 +6586,13 @@ LRESULT WINAPI StarFly2::ScreenSaverProc ( HWND hWnd, UINT Message, WPARAM wPara
 	case WM_KEYDOWN:
 	case WM_KEYUP:
 		{
-			StarFly2 const * app = (StarFly2*) GetWindowLongPtr(hWnd, GWL_USERDATA);
+			StarFly2* const app = (StarFly2*) GetWindowLongPtr(hWnd, GWL_USERDATA);
+			if (VK_F2 == wParam && (WM_KEYDOWN == Message || WM_KEYUP == Message))
+			{	// Profiler hotkey does not trigger exit
+				if (WM_KEYDOWN == Message && 0 == (lParam & 0x40000000)) // Not autorepeat
+					app->profiler.enabled = !app->profiler.enabled;
+				break;
+			}
 			if (SettlingTime < app->TotalTimeMs)
 				SendMessage(hWnd, WM_CLOSE, 0, 0);
 			break;
@@ -900,6 +6623,30 @@ LRESULT WINAPI StarFly2::ScreenSaverProc ( HWND hWnd, UINT Message, WPARAM wPara
 				SendMessage(hWnd, WM_CLOSE, 0, 0);
 			break;
 		}
+	case WM_DISPLAYCHANGE:
+	case WM_DPICHANGED:
+		{
+			// Fullscreen window covers its monitor (or whole virtual desktop) again, render thread follows new client size
+			StarFly2 const * app = (StarFly2*) GetWindowLongPtr(hWnd, GWL_USERDATA);
+			if (NULL == app || app->ScreenSaverWindowed)
+				break;
+			RECT rect;
+			MONITORINFO info;
+			info.cbSize = sizeof(info);
+			if (0 < app->MonitorIndex && FALSE != GetMonitorInfo(MonitorFromWindow(hWnd, MONITOR_DEFAULTTONEAREST), &info))
+				rect = info.rcMonitor;
+			else
+			{
+				rect.left = GetSystemMetrics(SM_XVIRTUALSCREEN);
+				rect.top = GetSystemMetrics(SM_YVIRTUALSCREEN);
+				rect.right = rect.left + GetSystemMetrics(SM_CXVIRTUALSCREEN);
+				rect.bottom = rect.top + GetSystemMetrics(SM_CYVIRTUALSCREEN);
+			}
+			SetWindowPos(hWnd, NULL, rect.left, rect.top, rect.right - rect.left, rect.bottom - rect.top, SWP_NOZORDER | SWP_NOACTIVATE);
+			if (WM_DPICHANGED == Message)
+				return 0; // Suggested rectangle is not used
+			break;
+		}
 	case WM_SYSCOMMAND:
 		if((SC_SCREENSAVE == wParam) || (SC_CLOSE == wParam))
 			return FALSE;
@@ -910,6 +6657,36 @@ LRESULT WINAPI StarFly2::ScreenSaverProc ( HWND hWnd, UINT Message, WPARAM wPara
 }
 
 
+// Rectangles of monitors, primary one first
+struct MonitorList
+{
+	static const int MaxMonitors = 16;
+	int count;
+	RECT rects[MaxMonitors];
+};
+
+// Callback of EnumDisplayMonitors, adds rectangle of monitor to MonitorList
+// monitor - handle of monitor
+// data - pointer to MonitorList
+// Return Value: TRUE to continue enumeration
+static BOOL CALLBACK CollectMonitor( HMONITOR monitor, HDC dc, LPRECT rect, LPARAM data )
+{
+	MonitorList* list = (MonitorList*)data;
+	MONITORINFO info;
+	info.cbSize = sizeof(info);
+	if (MonitorList::MaxMonitors > list->count && FALSE != GetMonitorInfo(monitor, &info))
+	{
+		int at = list->count++;
+		if (0 != (info.dwFlags & MONITORINFOF_PRIMARY))
+		{	// Move others to keep primary first
+			memmove(list->rects + 1, list->rects, at * sizeof(RECT));
+			at = 0;
+		}
+		list->rects[at] = info.rcMonitor;
+	}
+	return TRUE;
+}
+
 /*++
 Description:
     This routine is the main entry point for a Win32 application.
@@ -936,8 +6713,13 @@ INT WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE hPrevInst, LPSTR lpszCmdPara
 	LONG WindowWidth = 1024;
 	LONG WindowHeight = 768;
 	bool Configure = false;
+	const char* IniFile = NULL;
+	MonitorList Screens;
+	StarFly2* Surfaces[MonitorList::MaxMonitors] = { NULL }; // Objects of other monitors, [0] is not used
+	HWND Windows[MonitorList::MaxMonitors] = { NULL };
 
-	StarFly2 starFly;                    // Our main object. Will be hold by WinMain till it exits
+	StarFly2 starFly;                    // Our main object, primary monitor. Will be hold by WinMain till it exits
+	Screens.count = 0;
 
 	// Check filename of our executable file
 	char z[MAX_PATH];
@@ -967,10 +6749,25 @@ INT WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE hPrevInst, LPSTR lpszCmdPara
 		if ('.' == z[len-4]) // ~Check if extension has proper len
 		{
 			strcpy_s(z+len-3, 4, "ini"); // 4 with null
+			IniFile = z;
 			starFly.LoadSettings(z);  // Load settings from ini
 		}
 	}
 
+	// /BENCH runs headless benchmark, /KERNELS - benchmark of separate kernels, report is printed to standard output
+	bool kernels = (strstr(lpszCmdParam, "/kernels") != NULL) || (strstr(lpszCmdParam, "/KERNELS") != NULL);
+	if (kernels || (strstr(lpszCmdParam, "/bench") != NULL) ||
+		(strstr(lpszCmdParam, "/BENCH") != NULL)) {
+
+		// GUI application has no console - use one of parent process, unless output is redirected
+		if (NULL == GetStdHandle(STD_OUTPUT_HANDLE) && AttachConsole(ATTACH_PARENT_PROCESS))
+		{
+			FILE* console = NULL;
+			freopen_s(&console, "CONOUT$", "w", stdout);
+		}
+		return kernels ? starFly.BenchmarkKernels(lpszCmdParam) : starFly.Benchmark(lpszCmdParam);
+	}
+
 	// Parse any parameters. /C runs the 'configure' dialog.
 	if ((strstr(lpszCmdParam, "/c") != NULL) ||
 		(strstr(lpszCmdParam, "/C") != NULL)) {
@@ -1054,6 +6851,35 @@ INT WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE hPrevInst, LPSTR lpszCmdPara
 								hInstance,
 								&starFly);
 
+	} else if (0 != starFly.Monitors && FALSE != EnumDisplayMonitors(NULL, NULL, CollectMonitor, (LPARAM)&Screens) && 0 < Screens.count) {
+		// Window per monitor, so only real pixels are rendered. Primary one is created last, so it could start render thread for all
+		StarFly2* leader = (2 == starFly.Monitors) ? &starFly : NULL;
+		int surfaces = (NULL != leader) ? 1 : Screens.count;
+		for (int monitor = Screens.count - 1; 0 <= monitor; monitor--)
+		{
+			StarFly2* app = &starFly;
+			if (0 < monitor)
+			{
+				app = Surfaces[monitor] = new StarFly2();
+				app->SetSurface(monitor + 1, surfaces, leader);
+			}
+			else
+				app->SetSurface(1, surfaces, NULL);
+			if (NULL != IniFile)
+				app->LoadSettings(IniFile); // Again, with "MonitorN." settings of this monitor
+
+			const RECT& rect = Screens.rects[monitor];
+			Windows[monitor] = CreateWindowEx(WS_EX_TOPMOST,
+								starFly.ApplicationName, starFly.ApplicationName,
+								WS_VISIBLE | WS_POPUP,
+								rect.left, rect.top,
+								rect.right - rect.left, rect.bottom - rect.top,
+								NULL,
+								NULL,
+								hInstance,
+								app);
+		}
+		Window = Windows[0];
 	} else {
 		Window = CreateWindowEx(WS_EX_TOPMOST,
 								starFly.ApplicationName, starFly.ApplicationName,
@@ -1084,7 +6910,41 @@ INT WINAPI WinMain ( HINSTANCE hInstance, HINSTANCE hPrevInst, LPSTR lpszCmdPara
 	}
 
 	WinMainEnd:
+	// Windows of other monitors are destroyed before primary one, which render thread could render them
+	for (int monitor = 1; monitor < Screens.count; monitor++)
+	{
+		if (NULL != Windows[monitor] && FALSE != IsWindow(Windows[monitor]))
+			DestroyWindow(Windows[monitor]);
+		delete Surfaces[monitor];
+	}
+	if (NULL != Windows[0] && FALSE != IsWindow(Windows[0]))
+		DestroyWindow(Windows[0]);
 	ShowCursor(TRUE);
 	UnregisterClass(starFly.ApplicationName, hInstance);
 	return Return;
 }
+
+#ifdef STARFLY2_BENCH
+/*++
+Description:
+    This routine is the entry point of StarFly2Bench console project - benchmark of kernels with JSON report.
+    Settings are read from StarFly2Bench.ini next to executable, if it exists, and from command line.
+Arguments:
+    argc - Supplies number of arguments.
+    argv - Supplies arguments, "Name=value" as for "/kernels" of screensaver.
+Return Value:
+    Exit code for process, 0 on success.
+--*/
+int main ( int argc, char* argv[] )
+{
+	static char line[4096] = "/kernels";
+	for (int i = 1; i < argc; i++)
+	{
+		if (strlen(line) + strlen(argv[i]) + 2 > sizeof(line))
+			break;
+		strcat_s(line, sizeof(line), " ");
+		strcat_s(line, sizeof(line), argv[i]);
+	}
+	return WinMain(GetModuleHandle(NULL), NULL, line, SW_SHOWNORMAL);
+}
+#endif